@@ -0,0 +1,15 @@
+#version 450 core
+
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec4 color;
+
+uniform mat4 u_Projection;
+uniform mat4 u_View;
+
+layout(location = 0) out vec4 vColor;
+
+void main()
+{
+  vColor = color;
+  gl_Position = u_Projection * u_View * vec4(position, 1.0f);
+}
@@ -0,0 +1,8 @@
+#version 450
+
+/***********************************************************************************************************************************************************/
+
+// Depth pre-pass, only the depth of the terrain is written
+void main()
+{
+}
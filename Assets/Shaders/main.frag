@@ -1,4 +1,7 @@
 #version 450
+#ifdef BINDLESS_TEXTURES
+#extension GL_ARB_bindless_texture : require
+#endif
 
 layout(location = 0) out vec4 fragColor;
 
@@ -6,14 +9,87 @@ layout(location = 0) in vec3 worldPos;
 layout(location = 1) in flat int id;
 layout(location = 2) in flat int clipLevel;
 layout(location = 3) in float morphFactor;
+#ifdef TERRAIN_WORLD
+layout(location = 4) in flat int terrainIndex;
+#endif
 
 
+#if defined(TERRAIN_WORLD)
+// Heights and normals have one layer per terrain of a TerrainWorld
+layout(binding = 1) uniform sampler2D u_GradientMap;
+layout(binding = 2) uniform sampler2DArray u_AlbedoArray;
+layout(binding = 3) uniform sampler2DArray u_NormalArray;
+layout(binding = 4) uniform sampler2DArray u_NormalMap;
+
+// Must match TerrainWorld::TerrainInfo
+struct TerrainInfo
+{
+  vec2 center;
+  float worldSize;
+  float maxHeight;
+};
+
+layout(std430, binding = 4) restrict readonly buffer Terrains
+{
+  TerrainInfo in_Terrains[];
+};
+#elif defined(BINDLESS_TEXTURES)
+// Resident handles written once by Terrain, same order as the bindings below
+layout(std430, binding = 3) restrict readonly buffer TextureHandles
+{
+  uvec2 in_TextureHandles[];
+};
+#define u_Heightmap sampler2D(in_TextureHandles[0])
+#define u_GradientMap sampler2D(in_TextureHandles[1])
+#define u_AlbedoArray sampler2DArray(in_TextureHandles[2])
+#define u_NormalArray sampler2DArray(in_TextureHandles[3])
+#define u_NormalMap sampler2D(in_TextureHandles[4])
+#else
 layout(binding = 0) uniform sampler2D u_Heightmap;
 layout(binding = 1) uniform sampler2D u_GradientMap;
+layout(binding = 2) uniform sampler2DArray u_AlbedoArray;
+layout(binding = 3) uniform sampler2DArray u_NormalArray;
+layout(binding = 4) uniform sampler2D u_NormalMap;
+#endif
+
+// Must match TerrainMaterial
+#define MAX_MATERIAL_LAYERS 8
+struct MaterialRule
+{
+  // min, max, blend, tiling
+  vec4 height;
+  // min, max, blend, unused
+  vec4 slope;
+  vec4 tint;
+};
+
+layout(std140, binding = 2) uniform MaterialRules
+{
+  ivec4 u_LayerCount;
+  MaterialRule u_Rules[MAX_MATERIAL_LAYERS];
+};
+
+// Cascades of TerrainShadows, none without shadows
+layout(binding = 6) uniform sampler2DArrayShadow u_ShadowMap;
+
+// Must match TerrainShadows::ShadowData
+layout(std140, binding = 3) uniform ShadowData
+{
+  mat4 u_ShadowViewProjections[4];
+  vec4 u_LightDirection;
+  vec4 u_ShadowTexelSizes;
+};
+
+uniform int u_ShadowCascadeCount;
 
+// Sine of the horizon elevation in 8 directions baked by HorizonMap, direction d at
+// d * 45 degrees from +x towards +z. Directions 0-3 in the first layer
+layout(binding = 7) uniform sampler2DArray u_HorizonMap;
+uniform int u_HorizonMapEnabled;
 uniform int u_VertexCount;
 uniform float u_TextureDims;
 uniform float u_MaxHeight;
+uniform int u_FragmentDetail;
 
 layout(std140, binding = 0) uniform PerFrameData {
 
@@ -44,34 +120,113 @@ vec3 getColorByLevel(int level)
   return vec3(1.0f, 0.0f, 0.0f);
 }
 
-float getHeight(vec2 uv)
+// Soft window, a bound at the end of the range is open
+float getRuleWeight(vec3 range, float x)
 {
-   return texture2D(u_Heightmap, (uv + u_TextureDims * 0.5f) / u_TextureDims).r * u_MaxHeight;
+  float lower = range.x <= 0.0f ? 1.0f : smoothstep(range.x - range.z, range.x + range.z, x);
+  float upper = range.y >= 1.0f ? 1.0f : 1.0f - smoothstep(range.y - range.z, range.y + range.z, x);
+  return lower * upper;
 }
 
-vec3 grassColor = vec3(0.01f, 0.5f, 0.01f);
-vec3 rockColor = vec3(0.97f, 0.66f, 0.37f);
-vec3 calculateColor(vec3 n, float h)
+// Layers are painted in order over the first one by their splat weight.
+// Albedo layers are detail around 0.5, scaled by twice the layer tint
+vec3 calculateColor(inout vec3 n, vec3 worldPos)
 {
     float slope	= 1.0f - n.y;
-    float factor = smoothstep(0.1, 0.3, slope);
-    vec3 col = mix(grassColor, rockColor, factor);
+#ifdef TERRAIN_WORLD
+    float h01 = worldPos.y / in_Terrains[terrainIndex].maxHeight;
+#else
+    float h01 = worldPos.y / u_MaxHeight;
+#endif
+
+    vec3 col = vec3(0.0f);
+    vec3 detailNormal = vec3(0.0f, 0.0f, 1.0f);
+    for (int i = 0; i < u_LayerCount.x; ++i)
+    {
+      MaterialRule rule = u_Rules[i];
+      float weight = i == 0 ? 1.0f : getRuleWeight(rule.height.xyz, h01) * getRuleWeight(rule.slope.xyz, slope);
+      if (weight <= 0.0f)
+        continue;
+
+      vec3 uv = vec3(worldPos.xz / rule.height.w, float(i));
+      vec3 albedo = texture(u_AlbedoArray, uv).rgb * rule.tint.rgb * 2.0f;
+      col = mix(col, albedo, weight);
+      if (u_FragmentDetail > 0)
+        detailNormal = mix(detailNormal, texture(u_NormalArray, uv).rgb * 2.0f - 1.0f, weight);
+    }
 
-    float h01 = (h / u_MaxHeight) * 0.8f;
-    vec3 heightColor = texture2D(u_GradientMap, vec2(0.0f, h01)).rgb;
-	return mix(col, heightColor, smoothstep(0.2, 0.3, h01));
+    // Tangent space detail with z up onto the y up terrain normal
+    if (u_FragmentDetail > 0)
+      n = normalize(vec3(n.x + detailNormal.x, n.y * detailNormal.z, n.z + detailNormal.y));
+
+    float gradientH = h01 * 0.8f;
+    vec3 heightColor = texture(u_GradientMap, vec2(0.0f, gradientH)).rgb;
+	return mix(col, heightColor, smoothstep(0.2, 0.3, gradientH));
 }
 
 
+// Octahedral normal baked by Heightfield::generateNormals, same uv as the heights
 vec3 getNormalFromTexture(vec2 worldPos)
 {
-  vec2 offset = vec2(1.0f, 0.0f);
-  float h0 = getHeight(worldPos - offset);
-  float h1 = getHeight(worldPos - offset.yx);
-  float h2 = getHeight(worldPos + offset);
-  float h3 = getHeight(worldPos + offset.yx);
+#ifdef TERRAIN_WORLD
+  TerrainInfo terrain = in_Terrains[terrainIndex];
+  vec2 e = texture(u_NormalMap, vec3((worldPos - terrain.center) / terrain.worldSize + 0.5f, terrainIndex)).rg;
+#else
+  vec2 e = texture(u_NormalMap, (worldPos + u_TextureDims * 0.5f) / u_TextureDims).rg;
+#endif
+  vec3 n = vec3(e.x, 1.0f - abs(e.x) - abs(e.y), e.y);
+  if (n.y < 0.0f)
+    n.xz = (1.0f - abs(n.zx)) * vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.z >= 0.0f ? 1.0f : -1.0f);
+  return n;
+}
+
+// Flat shaded normal without any texture fetch for the low detail level
+vec3 getNormalFromDerivatives(vec3 worldPos)
+{
+  vec3 n = cross(dFdy(worldPos), dFdx(worldPos));
+  return n.y < 0.0f ? -n : n;
+}
+
+// Nearest cascade covering the point, cached cascades may lag behind the camera
+// so the finer ones are not assumed to cover the center
+float getShadow(vec3 worldPos, vec3 normal)
+{
+  for (int i = 0; i < u_ShadowCascadeCount; ++i)
+  {
+    // Pushed out along the normal by a texel against acne on the slopes
+    vec4 p = u_ShadowViewProjections[i] * vec4(worldPos + normal * u_ShadowTexelSizes[i] * 1.5f, 1.0f);
+    if (any(greaterThan(abs(p.xyz), vec3(0.98f))))
+      continue;
+
+    vec3 uvz = p.xyz * 0.5f + 0.5f;
+    vec2 texel = 1.0f / vec2(textureSize(u_ShadowMap, 0).xy);
+    float shadow = 0.0f;
+    for (int y = -1; y <= 1; ++y)
+      for (int x = -1; x <= 1; ++x)
+        shadow += texture(u_ShadowMap, vec4(uvz.xy + vec2(x, y) * texel, float(i), uvz.z));
+    return shadow / 9.0f;
+  }
+  return 1.0f;
+}
+
+// Sun visibility, soft around the horizon towards the sun, and ambient occlusion
+// from the part of the sky hidden by the horizons all around
+vec2 getHorizonTerms(vec2 worldPos, vec3 lightDirection)
+{
+  vec2 uv = (worldPos + u_TextureDims * 0.5f) / u_TextureDims;
+  vec4 near = texture(u_HorizonMap, vec3(uv, 0.0f));
+  vec4 far = texture(u_HorizonMap, vec3(uv, 1.0f));
+  float horizons[8] = float[8](near.x, near.y, near.z, near.w, far.x, far.y, far.z, far.w);
+
+  float direction = mod(atan(lightDirection.z, lightDirection.x) / radians(45.0f), 8.0f);
+  int d0 = int(direction) & 7;
+  float horizon = mix(horizons[d0], horizons[(d0 + 1) & 7], fract(direction));
+  float visibility = smoothstep(horizon - 0.05f, horizon + 0.1f, lightDirection.y);
 
-  return vec3(h2 - h0, offset.x * 2.0f, h3 - h1);
+  float occlusion = 0.0f;
+  for (int i = 0; i < 8; ++i)
+    occlusion += horizons[i];
+  return vec2(visibility, 1.0f - occlusion / 8.0f);
 }
 
 const int viewMode = 0;
@@ -80,15 +235,22 @@ const float	fogGradient	= 1.5f;
 const vec3 ld =	normalize(vec3(0.0f, 1.0f, -1.0f));
 void main()
 {
-   vec3 normal = normalize(getNormalFromTexture(worldPos.xz));
+   vec3 normal;
+   if(u_FragmentDetail > 0)
+     normal = normalize(getNormalFromTexture(worldPos.xz));
+   else
+     normal = normalize(getNormalFromDerivatives(worldPos));
    vec3 col = vec3(0.0f);
 
    if(viewMode == 0)
    {   
       float f = smoothstep(abs(normal.y), 0.3f, 0.5f);
-      vec3 albedo = calculateColor(normal, worldPos.y); 
-      col += max(dot(normal, ld), 0.0f) * albedo * 2.0f;
-      col += (normal.y * 0.5 + 0.5f) * vec3(0.16, 0.20, 0.28);
+      vec3 albedo = calculateColor(normal, worldPos); 
+      vec3 lightDirection = u_ShadowCascadeCount > 0 ? u_LightDirection.xyz : ld;
+      float shadow = u_ShadowCascadeCount > 0 ? getShadow(worldPos, normal) : 1.0f;
+      vec2 horizon = u_HorizonMapEnabled > 0 ? getHorizonTerms(worldPos.xz, lightDirection) : vec2(1.0f);
+      col += max(dot(normal, lightDirection), 0.0f) * shadow * horizon.x * albedo * 2.0f;
+      col += (normal.y * 0.5 + 0.5f) * horizon.y * vec3(0.16, 0.20, 0.28);
       float d = length(worldPos - cameraPosition);
       float fog = clamp(exp(-pow(d * fogDensity, fogGradient)), 0.0, 1.0);
       col = mix(vec3(0.5, 0.7, 1.0),col, fog);
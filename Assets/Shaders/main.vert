@@ -2,16 +2,19 @@
 
 /***********************************************************************************************************************************************************/
 #extension GL_ARB_shader_draw_parameters : enable
+#ifdef BINDLESS_TEXTURES
+#extension GL_ARB_bindless_texture : require
+#endif
 /***********************************************************************************************************************************************************/
 
-#define rot(ang) mat2(cos(ang), sin(ang), -sin(ang), cos(ang))
+#define rot(ang) mat2(round(cos(ang)), round(sin(ang)), -round(sin(ang)), round(cos(ang)))
 
 // Structs
+// Packed by TerrainGeometry::PackInstance, tile coordinates are relative to u_InstanceOrigin
 struct TerrainData
 {
-  vec2 translate;
-  vec2 scale;
-  vec2 id;
+  uint position;
+  uint attributes;
 };
 
 /***********************************************************************************************************************************************************/
@@ -40,77 +43,200 @@ layout(std430, binding = 1) restrict readonly buffer Matrices
   TerrainData in_TerrainData[];
 };
 
-layout(binding = 0) uniform sampler2D u_Heightmap;
+#if defined(TERRAIN_WORLD)
+// One layer per terrain of a TerrainWorld
+layout(binding = 5) uniform sampler2DArray u_MorphMap;
+
+// Must match TerrainWorld::TerrainInfo
+struct TerrainInfo
+{
+  vec2 center;
+  float worldSize;
+  float maxHeight;
+};
+
+layout(std430, binding = 4) restrict readonly buffer Terrains
+{
+  TerrainInfo in_Terrains[];
+};
+#elif defined(BINDLESS_TEXTURES)
+// Resident handles written once by Terrain, same order as the bindings below
+layout(std430, binding = 3) restrict readonly buffer TextureHandles
+{
+  uvec2 in_TextureHandles[];
+};
+#define u_MorphMap sampler2D(in_TextureHandles[5])
+#else
+layout(binding = 5) uniform sampler2D u_MorphMap;
+#endif
 
 uniform int u_VertexCount;
-uniform float u_TextureDims;
 uniform float u_MaxHeight;
 uniform float u_UnitSize;
+// Generate footprint from gl_VertexID instead of the position attribute
+uniform int u_VertexPulling;
 // Transition Region Width in percentage
 uniform float u_TransitionRegionWidth;
+// Distance per unit of scale where a level is fully morphed
+uniform float u_LodRange;
+// World position of tile (0, 0) of every level this frame
+uniform vec2 u_InstanceOrigin;
+
+#ifdef SHADOW_CASTER
+// Light view projection of the shadow cascade being drawn, the morphs still follow the camera
+uniform mat4 u_ShadowViewProjection;
+#define VIEW_PROJECTION u_ShadowViewProjection
+#else
+#define VIEW_PROJECTION VP
+#endif
 /***********************************************************************************************************************************************************/
 
 // Outgoing
+// The depth pre-pass and the colour pass are compiled from this file and compared with GL_EQUAL
+invariant gl_Position;
+
+#ifndef DEPTH_ONLY
 layout(location = 0) out vec3 worldPos;
 layout(location = 1) out flat int id;
 layout(location = 2) out flat int clipLevel;
 layout(location = 3) out float morphFactor;
+#else
+// No varyings in the depth pre-pass
+float morphFactor;
+#endif
+
+#ifdef TERRAIN_WORLD
+layout(location = 4) out flat int terrainIndex;
+// Distance to the four edges of the terrain area, enabled by TerrainWorld::draw
+out float gl_ClipDistance[4];
+#endif
 
 /***********************************************************************************************************************************************************/
 
-float getHeightFromTexture(vec2 uv)
+// Dimension of footprint mesh in vertices
+// Must match TerrainGeometry::GetFootprintDimension
+ivec2 getFootprintDimension(int meshId)
 {
-   return texture2D(u_Heightmap, (uv + u_TextureDims * 0.5f) / u_TextureDims).r * u_MaxHeight;
+  int m = (u_VertexCount + 1) / 4;
+  if (meshId == 0)
+    return ivec2(m, m);
+  else if (meshId == 1)
+    return ivec2(m, 2);
+  else if (meshId == 2)
+    return ivec2(m + 1, 2);
+  else if (meshId == 3)
+    return ivec2(2, m);
+  return ivec2(u_VertexCount, u_VertexCount - 1);
 }
 
-// The height calculation should be done in such a way that at the edges
-// it includes the sample from the next level
+// Every footprint is a non-indexed triangle list of quads emitted in the
+// same order and winding as GeometryGenerator::GenerateGrid/GenerateLTrim
+const ivec2 gridCorners[6] = ivec2[6](ivec2(0, 0), ivec2(0, 1), ivec2(1, 1), ivec2(0, 0), ivec2(1, 1), ivec2(1, 0));
+const ivec2 trimCorners[6] = ivec2[6](ivec2(0, 0), ivec2(1, 1), ivec2(1, 0), ivec2(0, 0), ivec2(0, 1), ivec2(1, 1));
 
-float getHeight(vec2 worldPos, float scale, float morphFactor)
+vec2 getFootprintPosition(int meshId)
 {
-  // Get the height at current level
-  vec2 ownPos = worldPos;
-  float ownHeight = getHeightFromTexture(ownPos);
-
-  // Calcualte the offset of vertex for next heigher grid level 
-  // This is generally in multiple of scale of next gridSize
-  vec2 modPos = mod(worldPos, scale * 2.0f * u_UnitSize);
+  int quad = gl_VertexID / 6;
+  int corner = gl_VertexID % 6;
+  ivec2 dim = getFootprintDimension(meshId);
 
-  // Check if the offset lies in currentGridLevel or not
-  if (length(modPos) > 0.5f)
+  ivec2 vertex;
+  if (meshId == 4)
   {
-    vec2 n1 = worldPos + modPos;
-    vec2 n2 = worldPos - modPos;
-    float h1 = getHeightFromTexture(n1);
-    float h2 = getHeightFromTexture(n2);
-
-    float h = (h1 + h2) * 0.5f;
-    ownHeight = (1.0f - morphFactor) * ownHeight + morphFactor * h;
+    // L-Trim, horizontal strip followed by vertical strip
+    int horizontalQuads = dim.x - 1;
+    if (quad < horizontalQuads)
+      vertex = ivec2(quad, 0) + gridCorners[corner];
+    else
+      vertex = ivec2(0, 1 + quad - horizontalQuads) + trimCorners[corner];
   }
-  
-  return ownHeight;
+  else
+    vertex = ivec2(quad % (dim.x - 1), quad / (dim.x - 1)) + gridCorners[corner];
+
+  return vec2(vertex) * u_UnitSize;
+}
+
+// Height (zf) and difference to the coarser level (zd) baked by Heightfield::generateMorphLevels,
+// mip level L holds the vertices of the clip level with scale 2^L. terrain is the
+// TerrainWorld layer, a single terrain has none
+vec2 getMorphData(vec2 worldPos, float scale, int terrain)
+{
+  int lod = min(findMSB(int(scale)), textureQueryLevels(u_MorphMap) - 1);
+#ifdef TERRAIN_WORLD
+  // Relative to the terrain center, vertices past its edge repeat the border
+  vec2 size = vec2(textureSize(u_MorphMap, lod).xy);
+  vec2 texel = clamp(round((worldPos - in_Terrains[terrain].center) / (scale * u_UnitSize)), -size * 0.5f, size * 0.5f - 1.0f);
+  return texelFetch(u_MorphMap, ivec3(mod(texel, size), terrain), lod).rg;
+#else
+  vec2 size = vec2(textureSize(u_MorphMap, lod));
+  ivec2 texel = ivec2(mod(round(worldPos / (scale * u_UnitSize)), size));
+  return texelFetch(u_MorphMap, texel, lod).rg;
+#endif
+}
+
+// Vertices shared with the coarser level have zd = 0, the others blend towards
+// the average of their two coarser neighbours as they approach the level edge
+float getHeight(vec2 worldPos, float scale, float morphFactor, int terrain)
+{
+  vec2 morph = getMorphData(worldPos, scale, terrain);
+#ifdef TERRAIN_WORLD
+  return (morph.x + morphFactor * morph.y) * in_Terrains[terrain].maxHeight;
+#else
+  return (morph.x + morphFactor * morph.y) * u_MaxHeight;
+#endif
 }
 
 
 void main()
 {
     TerrainData	terrainData	= in_TerrainData[gl_BaseInstanceARB + gl_InstanceID];
-    mat2 rotate = rot(terrainData.id.y);
-    vec2 worldPosition = rotate * (position * terrainData.scale) + terrainData.translate;
-
-    const float gridSize = u_VertexCount * terrainData.scale.x * u_UnitSize;
+    ivec2 tile = ivec2(bitfieldExtract(int(terrainData.position), 0, 16), bitfieldExtract(int(terrainData.position), 16, 16));
+    int level = int(bitfieldExtract(terrainData.attributes, 0, 4));
+    int meshId = int(bitfieldExtract(terrainData.attributes, 4, 3));
+    float rotation = float(bitfieldExtract(terrainData.attributes, 7, 2)) * 1.57079633;
+    float scale = float(1 << level);
+    int terrain = int(bitfieldExtract(terrainData.attributes, 9, 6));
+
+    mat2 rotate = rot(rotation);
+    vec2 localPosition = u_VertexPulling != 0 ? getFootprintPosition(meshId) : position;
+    vec2 worldPosition = rotate * (localPosition * scale) + u_InstanceOrigin + vec2(tile) * scale * u_UnitSize;
+
+    const float gridSize = u_VertexCount * scale * u_UnitSize;
     const float transitionWidth = gridSize * u_TransitionRegionWidth;
 
-    vec2 alpha = (abs(worldPosition - cameraPosition.xz) - (gridSize * 0.5f - transitionWidth - 1.0f)) / transitionWidth;
+    // Morph has to be complete at the outer edge of the level, see TerrainGeometry::GetLodRange
+    const float morphEnd = u_LodRange * scale - 1.0f;
+
+    vec2 alpha = (abs(worldPosition - cameraPosition.xz) - (morphEnd - transitionWidth)) / transitionWidth;
     alpha = clamp(alpha, 0.0, 1.0);
 
     morphFactor = max(alpha.x, alpha.y);
 
-    float height = getHeight(worldPosition, terrainData.scale.x, morphFactor);
-    gl_Position = VP * vec4(worldPosition.x, height, worldPosition.y, 1.0f);
+    // Fully morphed vertices lie on an edge of the coarser level, collapse them onto
+    // its vertex so both levels rasterize the same edge instead of a T-junction
+    if (morphFactor >= 1.0f)
+      worldPosition -= mod(worldPosition, scale * 2.0f * u_UnitSize);
+
+    float height = getHeight(worldPosition, scale, morphFactor, terrain);
+    gl_Position = VIEW_PROJECTION * vec4(worldPosition.x, height, worldPosition.y, 1.0f);
 
-    id =        int(terrainData.id.x);
-    clipLevel = int(terrainData.id.y);
+#ifndef DEPTH_ONLY
+    id =        meshId;
+    clipLevel = level;
     worldPos = vec3(worldPosition.x, height, worldPosition.y);
+#endif
+#ifdef TERRAIN_WORLD
+    terrainIndex = terrain;
+
+    // Blocks overlapping several terrains are drawn once for each, each copy keeps
+    // its own area. Clipped before rasterization, main.frag needs no discard that
+    // would turn off early depth testing
+    vec2 terrainOffset = worldPosition - in_Terrains[terrain].center;
+    float halfSize = in_Terrains[terrain].worldSize * 0.5f;
+    gl_ClipDistance[0] = halfSize + terrainOffset.x;
+    gl_ClipDistance[1] = halfSize - terrainOffset.x;
+    gl_ClipDistance[2] = halfSize + terrainOffset.y;
+    gl_ClipDistance[3] = halfSize - terrainOffset.y;
+#endif
 
 }
\ No newline at end of file
@@ -0,0 +1,49 @@
+#version 450
+
+/***********************************************************************************************************************************************************/
+#ifdef BINDLESS_TEXTURES
+#extension GL_ARB_bindless_texture : require
+#endif
+/***********************************************************************************************************************************************************/
+
+// Uniforms
+
+#ifdef BINDLESS_TEXTURES
+// Resident handles written once by Terrain, same order as the bindings below
+layout(std430, binding = 3) restrict readonly buffer TextureHandles
+{
+  uvec2 in_TextureHandles[];
+};
+#define u_Heightmap sampler2D(in_TextureHandles[0])
+#else
+layout(binding = 0) uniform sampler2D u_Heightmap;
+#endif
+
+uniform float u_TextureDims;
+uniform float u_MaxHeight;
+uniform vec2 u_PatchOrigin;
+uniform float u_PatchSize;
+uniform int u_PatchGridSize;
+
+/***********************************************************************************************************************************************************/
+
+// Outgoing
+layout(location = 0) out vec3 patchCorner;
+
+/***********************************************************************************************************************************************************/
+
+float getHeightFromTexture(vec2 uv)
+{
+   return textureLod(u_Heightmap, (uv + u_TextureDims * 0.5f) / u_TextureDims, 0.0f).r * u_MaxHeight;
+}
+
+// Four vertices per patch, corners (0, 0), (1, 0), (0, 1), (1, 1)
+void main()
+{
+    int patchIndex = gl_VertexID / 4;
+    int corner = gl_VertexID % 4;
+    ivec2 cell = ivec2(patchIndex % u_PatchGridSize, patchIndex / u_PatchGridSize) + ivec2(corner & 1, corner >> 1);
+
+    vec2 position = u_PatchOrigin + vec2(cell) * u_PatchSize;
+    patchCorner = vec3(position.x, getHeightFromTexture(position), position.y);
+}
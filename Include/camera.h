@@ -67,6 +67,8 @@ public:
 
 	glm::vec3 getUp()               const override { return up_; }
 
+	glm::vec3 getOrientation()      const { return orientation_; }
+
 	void setFOV(float fov) { fov_ = fov; }
 
 	void setAspect(float aspect) { aspect_ = aspect; }
@@ -77,11 +79,16 @@ public:
 
 	void update(float dt);
 
+	// Place the camera directly, used to replay a recorded path
+	void setPose(const glm::vec3& position, const glm::vec3& orientation);
+
 	std::shared_ptr<Frustum> getFrustum() const override { return frustum_; }
 
 private:
 	void generateProjectionMatrix();
 
+	void updateViewMatrix();
+
 private:
 	glm::mat4        projectionMatrix_;
 	glm::mat4        viewMatrix_;
@@ -0,0 +1,66 @@
+#ifndef CAMERA_PATH_H
+#define CAMERA_PATH_H
+
+#include "math_helper.h"
+
+#include <vector>
+
+class FirstPersonCamera;
+
+/*****************************************************************************************************************************************/
+
+struct CameraKeyframe
+{
+	float time;
+	glm::vec3 position;
+	// Pitch, yaw and roll as used by FirstPersonCamera
+	glm::vec3 orientation;
+};
+
+/*****************************************************************************************************************************************/
+// Timestamped camera keyframes interpolated with a Catmull-Rom spline.
+// Text format, one keyframe per line: time px py pz pitch yaw roll
+
+class CameraPath
+{
+public:
+
+	CameraPath() = default;
+
+	bool load(const char* filename);
+
+	bool save(const char* filename) const;
+
+	void addKeyframe(const CameraKeyframe& keyframe) { keyframes_.push_back(keyframe); }
+
+	CameraKeyframe evaluate(float time) const;
+
+	float getDuration() const { return keyframes_.empty() ? 0.0f : keyframes_.back().time; }
+
+	bool empty() const { return keyframes_.empty(); }
+
+private:
+	std::vector<CameraKeyframe> keyframes_;
+};
+
+/*****************************************************************************************************************************************/
+// Samples a live camera at a fixed interval
+
+class CameraPathRecorder
+{
+public:
+
+	explicit CameraPathRecorder(float interval = 0.1f) : interval_(interval) {}
+
+	void record(float dt, const FirstPersonCamera& camera);
+
+	const CameraPath& getPath() const { return path_; }
+
+private:
+	CameraPath path_;
+	float interval_;
+	float time_ = 0.0f;
+	float nextSample_ = 0.0f;
+};
+
+#endif
@@ -2,24 +2,100 @@
 #define DEBUGDRAW_H
 
 #include "math_helper.h"
-#include <vector>
+
+#include <memory>
+#include <stdint.h>
+#include <glad/glad.h>
+
+class GLBuffer;
+class GLProgram;
+
+/*****************************************************************************************************************************************/
+
+enum class DebugCategory : uint32_t
+{
+	// Bounds of every generated terrain instance
+	Instances,
+	// Bounds of the instances that survived culling
+	Visible,
+	Frustum,
+	Misc,
+	Count
+};
+
+/*****************************************************************************************************************************************/
+// Batched line renderer. Lines are written straight into a persistently mapped
+// buffer split in regions, each frame draws its region with a single glDrawArrays
+// and fences it so that the CPU never writes to a region the GPU still reads.
 
 class GLDebugDraw
 {
 public:
 	GLDebugDraw() {}
 
-	static void addLine(glm::vec3 start, glm::vec3 end) {
-		points_.push_back(start);
-		points_.push_back(end);
+	// Requires a current context, lines added before are ignored
+	static void Initialize();
+
+	static void Shutdown();
+
+	static void addLine(const glm::vec3& start, const glm::vec3& end, DebugCategory category = DebugCategory::Misc);
+
+	static void addAABB(const glm::vec3& min, const glm::vec3& max, DebugCategory category = DebugCategory::Misc);
+
+	static void addFrustum(glm::vec3* points, DebugCategory category = DebugCategory::Frustum);
+
+	static void setCategoryEnabled(DebugCategory category, bool enabled);
+
+	static bool isCategoryEnabled(DebugCategory category) { return (categoryMask_ & GetCategoryBit(category)) != 0; }
+
+	// Debug views are switched on or off once per frame, before anything is added
+	static void setFrameEnabled(bool enabled) { frameEnabled_ = enabled; }
+
+	// Categories to record this frame. Hot paths read it once and test the bits
+	// before building any line, without TERRAIN_DEBUG_DRAW it is a constant 0
+	// so the calls are compiled out
+	static uint32_t getFrameMask()
+	{
+#ifdef TERRAIN_DEBUG_DRAW
+		return frameEnabled_ ? categoryMask_ : 0;
+#else
+		return 0;
+#endif
 	}
 
-	static void addAABB(const glm::vec3& min, const glm::vec3& max);
-	static void addFrustum(glm::vec3* points);
+	static uint32_t GetCategoryBit(DebugCategory category) { return 1u << static_cast<uint32_t>(category); }
 
 	static void draw(float* P, float* V);
+
+	// Drop the lines of this frame without drawing them
+	static void clear() { vertexCount_ = 0; }
+
 private:
-	static std::vector<glm::vec3> points_;
+
+	struct DebugVertex
+	{
+		glm::vec3 position;
+		// RGBA8
+		uint32_t color;
+	};
+
+	// Returns nullptr if the category is disabled or the region is full
+	static DebugVertex* allocate(uint32_t vertexCount, DebugCategory category, uint32_t& color);
+
+	static const uint32_t kRegionCount = 3;
+	static const uint32_t kMaxVertexCount = 1 << 17;
+
+	static std::shared_ptr<GLBuffer> buffer_;
+	static std::shared_ptr<GLProgram> program_;
+	static uint32_t vao_;
+
+	static DebugVertex* vertices_;
+	static uint32_t vertexCount_;
+	static uint32_t region_;
+	static GLsync fences_[kRegionCount];
+
+	static uint32_t categoryMask_;
+	static bool frameEnabled_;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -10,6 +10,10 @@ public:
 	static void GenerateGrid(glm::ivec2 vertexCount, float unitSize, MeshData& outMeshData);
 
 	static void GenerateLTrim(glm::ivec2 vertexCount, float unitSize, MeshData& meshData);
+
+	// Bounds of the L-Trim GenerateLTrim builds, the vertical strip starts one unit
+	// above the horizontal one
+	static BoundingBox GetLTrimBounds(glm::ivec2 vertexCount, float unitSize);
 };
 
 #endif
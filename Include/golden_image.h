@@ -0,0 +1,86 @@
+#ifndef GOLDEN_IMAGE_H
+#define GOLDEN_IMAGE_H
+
+#include "camera_path.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+class Terrain;
+
+/*****************************************************************************************************************************************/
+
+struct GoldenImageConfig
+{
+	// Reference images are stored as <referenceDir>/<heightmap>_<pose>.png. They are
+	// not shipped, a missing one is created from the current output and the other
+	// checks still run
+	std::string referenceDir = "Assets/Golden";
+
+	// Overwrite the references with the current output instead of comparing
+	bool update = false;
+
+	// RMSE over 8 bit RGB channels allowed against the reference
+	float rmseTolerance = 2.0f;
+
+	// RMSE allowed between two frames on either side of a clip level snap
+	float popTolerance = 6.0f;
+
+	// RMSE allowed between the indexed and the vertex pulling path
+	float pathTolerance = 0.5f;
+
+	// Clear color pixels visible through top down views, anything above is a crack
+	int maxCrackPixels = 0;
+};
+
+/*****************************************************************************************************************************************/
+// Renders fixed camera poses over the shipped heightmaps and checks the output
+// against references stored by the first run on the same renderer and size, for
+// cracks between clip levels and for popping when the rings snap. The render callback owns all GL state and must return
+// tightly packed RGBA8 pixels, bottom row first.
+
+class GoldenImageHarness
+{
+public:
+
+	using RenderFunc = std::function<void(Terrain* terrain, const CameraKeyframe& pose, std::vector<uint8_t>& pixels)>;
+
+	GoldenImageHarness(const GoldenImageConfig& config, int width, int height);
+
+	// Returns false if any check failed
+	bool run(const RenderFunc& render);
+
+	// Root mean square error over the RGB channels of two RGBA8 images
+	static float ComputeRMSE(const std::vector<uint8_t>& a, const std::vector<uint8_t>& b);
+
+	// Number of RGBA8 pixels whose RGB matches color exactly
+	static int CountPixels(const std::vector<uint8_t>& pixels, const uint8_t color[3]);
+
+private:
+
+	struct GoldenPose
+	{
+		const char* name;
+		CameraKeyframe pose;
+		// Top down poses see no sky so every clear color pixel is a hole
+		bool topDown;
+	};
+
+	bool checkReference(const std::string& name, const std::vector<uint8_t>& pixels);
+
+	bool checkCracks(const std::string& name, const std::vector<uint8_t>& pixels);
+
+	void report(bool passed, const std::string& name, const char* check, const char* format, ...);
+
+	std::string getReferencePath(const std::string& name, const char* suffix) const;
+
+	GoldenImageConfig config_;
+	int width_;
+	int height_;
+	int failureCount_ = 0;
+	int createdCount_ = 0;
+};
+
+#endif
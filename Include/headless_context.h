@@ -0,0 +1,32 @@
+#ifndef HEADLESS_CONTEXT_H
+#define HEADLESS_CONTEXT_H
+
+/*****************************************************************************************************************************************/
+// Offscreen OpenGL context without any window or display.
+// Uses EGL with the Mesa surfaceless platform so it also runs on llvmpipe,
+// only available when built with TERRAIN_HEADLESS
+
+class HeadlessContext
+{
+public:
+
+	HeadlessContext() = default;
+
+	HeadlessContext(const HeadlessContext&) = delete;
+
+	bool create(int majorVersion, int minorVersion);
+
+	void destroy();
+
+	static bool IsSupported();
+
+	static void* GetProcAddress(const char* name);
+
+	~HeadlessContext() { destroy(); }
+
+private:
+	void* display_ = nullptr;
+	void* context_ = nullptr;
+};
+
+#endif
@@ -1,8 +1,8 @@
 #ifndef IMAGE_UTILS_H
 #define IMAGE_UTILS_H
 
-#define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
+#include <cstdio>
 
 struct ImageHeader {
 	int width;
@@ -39,6 +39,9 @@ public:
 	{
 		stbi_image_free(data);
 	}
+
+	// Uncompressed (stored deflate) 8 bit PNG, flipY for data read back from OpenGL
+	static bool WritePNG(const char* filename, int width, int height, int nChannel, const unsigned char* data, bool flipY);
 };
 
-#endif
\ No newline at end of file
+#endif
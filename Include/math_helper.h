@@ -121,8 +121,22 @@ public:
 
 	void generate(Camera* camera);
 
+	// Frustum of any view, e.g. a light or a second eye that has no Camera
+	void generate(const glm::mat4& viewProjection);
+
 	bool intersect(const BoundingBox& boundingBox);
 
+	enum class Containment
+	{
+		Outside,
+		Inside,
+		Intersect
+	};
+
+	// Like intersect but also tells whether the box is entirely inside, so that
+	// everything within an accepted bound can skip its own test
+	Containment classify(const BoundingBox& boundingBox);
+
 	glm::vec3 frustumPoints_[8] = {};
 	Plane frustumPlanes_[6] = {};
 
@@ -147,6 +161,10 @@ public:
 		Top,
 		Bottom
 	};
+
+private:
+
+	void generatePlanes(const glm::mat4& viewProjection);
 };
 
 /*****************************************************************************************************************************************/
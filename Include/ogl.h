@@ -20,6 +20,13 @@ struct DrawElementsIndirectCommand {
 	GLuint baseInstance_;
 };
 
+struct DrawArraysIndirectCommand {
+	GLuint count_;
+	GLuint instanceCount_;
+	GLuint first_;
+	GLuint baseInstance_;
+};
+
 extern float gOGLVersion;
 
 /*************************************************************************************************************************************************/
@@ -31,6 +38,9 @@ public:
 
 	explicit GLShader(const char* filename);
 
+	// Every define is inserted as #define after the #version line
+	GLShader(const char* filename, const std::vector<std::string>& defines);
+
 	GLShader(GLenum type, const char* shaderCode);
 
 	inline GLenum getType() { return type_; }
@@ -54,6 +64,9 @@ public:
 
 	GLProgram(GLShader a, GLShader b, GLShader c);
 
+	// Vertex, tessellation control, tessellation evaluation and fragment
+	GLProgram(GLShader a, GLShader b, GLShader c, GLShader d);
+
 	~GLProgram() { glDeleteProgram(handle_); }
 
 	void useProgram() const { glUseProgram(handle_); }
@@ -66,6 +79,9 @@ public:
 
 	void setVec2(std::string name, float x, float y);
 
+	// Column major 4x4 matrix
+	void setMat4(std::string name, const float* matrix);
+
 protected:
 
 	GLuint        handle_;
@@ -120,10 +136,13 @@ public:
 
 	GLMesh(const MeshData& meshData);
 
-	void draw() const;
+	// Instances of the commands start at firstInstance, one after the other
+	void draw(uint32_t firstInstance = 0) const;
 
 	unsigned int getMeshCount() { return meshCount_; }
 
+	size_t getCommandBufferSize() const { return drawCommands.size(); }
+
 	virtual ~GLMesh() { glDeleteVertexArrays(1, &vao_); }
 
 	DrawElementsIndirectCommand* commands = nullptr;
@@ -141,11 +160,45 @@ private:
 	std::vector<uint8_t>    drawCommands;
 };
 
+/*************************************************************************************************************************************************/
+// Procedural Mesh
+// Mesh without any vertex or index storage, the vertex shader generates the
+// vertices from gl_VertexID so only the indirect commands live on the GPU
+
+class GLProceduralMesh
+{
+
+public:
+
+	explicit GLProceduralMesh(unsigned int meshCount);
+
+	void setVertexCount(unsigned int meshIndex, unsigned int vertexCount) { commands[meshIndex].count_ = vertexCount; }
+
+	void draw(uint32_t firstInstance = 0) const;
+
+	unsigned int getMeshCount() { return meshCount_; }
+
+	size_t getCommandBufferSize() const { return drawCommands.size(); }
+
+	virtual ~GLProceduralMesh() { glDeleteVertexArrays(1, &vao_); }
+
+	DrawArraysIndirectCommand* commands = nullptr;
+
+private:
+	uint32_t                vao_;
+
+	GLBuffer                bufferIndirect_;
+
+	unsigned int            meshCount_;
+	std::vector<uint8_t>    drawCommands;
+};
+
 enum class TextureFilter
 {
 	Linear, 
 	LinearMipmap,
-	Nearest
+	Nearest,
+	NearestMipmap
 };
 
 enum class TextureWrap
@@ -158,11 +211,22 @@ enum class TextureFormat{
 	RGB8,
 	RGBA8,
 	R16F,
+	RG16_SNORM,
+	RG32F,
+};
+
+enum class TextureType
+{
+	Texture2D,
+	Texture2DArray
 };
 
 struct TextureParams
 {
 	int width, height;
+	// Layer count of a Texture2DArray
+	int depth = 1;
+	TextureType type = TextureType::Texture2D;
 
 	TextureFilter minFilter = TextureFilter::Linear;
 	TextureFilter magFilter = TextureFilter::Linear;
@@ -182,8 +246,23 @@ class GLTexture
 {
 public:
 
+	// Data is the first layer for a texture array, the other layers are set with setLayer
 	explicit GLTexture(const void* data, const TextureParams& params);
 
+	void setLayer(int layer, const void* data);
+
+	// Fills the mip chain, storage has one only with a mipmap min filter
+	void generateMipmaps();
+
+	// Uploads one mip level of a Texture2D or of one layer of a Texture2DArray
+	void setMipLevel(int level, const void* data, int layer = 0);
+
+	// Uploads a rectangle of a mip level from tightly packed data
+	void setRegion(int x, int y, int width, int height, const void* data, int layer = 0, int level = 0);
+
+	// ARB_bindless_texture handle, made resident on the first call
+	uint64_t getBindlessHandle();
+
 	unsigned int getHandle() const { return handle_; }
 
 	TextureFormatInfo getTextureFormatInfo() const { return  formatInfo_; }
@@ -192,13 +271,52 @@ public:
 
 	int getHeight() const { return height_; }
 
-	virtual ~GLTexture() { glDeleteTextures(1, &handle_); }
+	virtual ~GLTexture();
 
 private:
 	unsigned int handle_;
 	int width_;
 	int height_;
+	int depth_;
+	GLenum target_;
+	uint64_t bindlessHandle_ = 0;
 	TextureFormatInfo formatInfo_;
 };
 
+/*************************************************************************************************************************************************/
+// Framebuffer
+// RGBA8 color texture with a depth-stencil renderbuffer, used for offscreen rendering
+
+class GLFramebuffer
+{
+public:
+
+	GLFramebuffer(int width, int height);
+
+	void bind() const;
+
+	// Tightly packed RGBA8, bottom row first as returned by OpenGL
+	void readPixels(std::vector<uint8_t>& pixels) const;
+
+	// One byte per pixel, same row order as readPixels
+	void readStencil(std::vector<uint8_t>& stencil) const;
+
+	unsigned int getHandle() const { return handle_; }
+
+	unsigned int getColorTexture() const { return colorTexture_; }
+
+	int getWidth()  const { return width_; }
+
+	int getHeight() const { return height_; }
+
+	~GLFramebuffer();
+
+private:
+	unsigned int handle_;
+	unsigned int colorTexture_;
+	unsigned int depthStencil_;
+	int width_;
+	int height_;
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,104 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdint.h>
+
+/*****************************************************************************************************************************************/
+// Scoped CPU/GPU profiler
+// CPU scopes are written into a per-thread ring buffer without any lock, GPU
+// scopes use pairs of GL_TIMESTAMP queries, nest like the CPU ones and are
+// resolved a few frames later.
+// Everything is written out as a Chrome trace (chrome://tracing, Perfetto)
+
+struct ProfileEvent
+{
+	const char* name;
+	int64_t start;      // microseconds since the profiler started
+	int64_t duration;   // microseconds
+};
+
+class Profiler
+{
+public:
+	Profiler() = delete;
+	Profiler(const Profiler&) = delete;
+
+	static void SetEnabled(bool enabled) { enabled_ = enabled; }
+
+	static bool IsEnabled() { return enabled_; }
+
+	// Name shown for the calling thread in the trace, allocates nothing until the
+	// thread records its first event
+	static void SetThreadName(const char* name);
+
+	static int64_t Now();
+
+	static void RecordCpu(const char* name, int64_t start, int64_t end);
+
+	// Must be called from the thread owning the GL context
+	static void BeginGpu(const char* name);
+
+	static void EndGpu();
+
+	// Collects finished GPU queries, call once per frame on the GL thread
+	static void EndFrame();
+
+	static bool WriteChromeTrace(const char* filename);
+
+	// Releases GPU queries and the event buffers of the threads that are gone, must be
+	// called before the context is destroyed
+	static void Shutdown();
+
+private:
+	static bool enabled_;
+};
+
+/*****************************************************************************************************************************************/
+
+class ProfileScope
+{
+public:
+	explicit ProfileScope(const char* name) :
+		name_(name),
+		start_(Profiler::IsEnabled() ? Profiler::Now() : -1)
+	{
+	}
+
+	~ProfileScope()
+	{
+		if (start_ >= 0)
+			Profiler::RecordCpu(name_, start_, Profiler::Now());
+	}
+
+private:
+	const char* name_;
+	int64_t start_;
+};
+
+class GpuProfileScope
+{
+public:
+	explicit GpuProfileScope(const char* name) :
+		active_(Profiler::IsEnabled())
+	{
+		if (active_)
+			Profiler::BeginGpu(name);
+	}
+
+	~GpuProfileScope()
+	{
+		if (active_)
+			Profiler::EndGpu();
+	}
+
+private:
+	bool active_;
+};
+
+#define PROFILE_CONCAT_IMPL(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_IMPL(a, b)
+
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#define PROFILE_GPU_SCOPE(name) GpuProfileScope PROFILE_CONCAT(gpuProfileScope, __LINE__)(name)
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef CLIPMAP_VALIDATOR_H
+#define CLIPMAP_VALIDATOR_H
+
+#include "math_helper.h"
+#include "terrain_params.h"
+#include "terrain_geometry.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/*****************************************************************************************************************************************/
+
+struct ClipmapValidationResult
+{
+	// Blocks overlapping, leaving gaps or not lying on the level grid
+	int coverageErrors = 0;
+
+	// Vertices on the outer edge of a level that don't lie on the coarser level after morphing
+	int seamErrors = 0;
+	float maxSeamError = 0.0f;
+
+	// Description of the first error found
+	std::string message;
+
+	bool isValid() const { return coverageErrors == 0 && seamErrors == 0; }
+};
+
+/*****************************************************************************************************************************************/
+// CPU check of the clipmap ring layout produced by TerrainGeometry::GenerateLocations.
+// Every level must tile the square around the camera exactly once except for the
+// hole filled by the finer level, and the outer edge of each level must match the
+// coarser level once heights are morphed the same way as main.vert does.
+
+class ClipmapValidator
+{
+public:
+
+	// World height of a xz position, stands in for the heightmap lookup of main.vert
+	using HeightFunc = std::function<float(const glm::vec2& position)>;
+
+	ClipmapValidator(const TerrainParams& params, HeightFunc heightFunc);
+
+	// finestLevel as passed to TerrainGeometry::GenerateLocations
+	ClipmapValidationResult validate(const glm::vec3& cameraPosition, int finestLevel = 0);
+
+	// Validate random camera positions within [-range, range] with a random finest level
+	// among the first few, returns the number of failing positions
+	int fuzz(int iterationCount, uint32_t seed, float range);
+
+	// Same morph as main.vert, scale is the clip level scale of the vertex
+	float getMorphedHeight(const glm::vec2& position, float scale, const glm::vec3& cameraPosition) const;
+
+private:
+
+	// Axis aligned rectangle in level 0 grid units
+	struct GridRect
+	{
+		int64_t minX, minY, maxX, maxY;
+	};
+
+	bool expandInstance(const TerrainGeometry::TerrainData& instance, std::vector<GridRect>& rects, ClipmapValidationResult& result) const;
+
+	void validateLevel(int level, const std::vector<GridRect>& rects, const GridRect* hole, GridRect& bounds, ClipmapValidationResult& result) const;
+
+	void validateSeam(int level, const GridRect& bounds, const glm::vec3& cameraPosition, ClipmapValidationResult& result) const;
+
+	TerrainParams params_;
+	HeightFunc heightFunc_;
+	std::vector<TerrainGeometry::TerrainData> instances_;
+	std::vector<std::vector<GridRect>> levelRects_;
+};
+
+#endif
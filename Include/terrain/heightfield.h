@@ -0,0 +1,104 @@
+#ifndef HEIGHTFIELD_H
+#define HEIGHTFIELD_H
+
+#include <vector>
+#include <stdint.h>
+
+/*****************************************************************************************************************************************/
+// CPU copy of the heightmap, heights normalized to 0-1 as uploaded to the GPU.
+// Texel lookups wrap like the heightmap texture (GL_REPEAT)
+
+class Heightfield
+{
+public:
+
+	Heightfield() = default;
+
+	// First channel of any 8 or 16 bit image
+	bool load(const char* filename);
+
+	// width x height texels all at the same height
+	void fill(int width, int height, float height01);
+
+	int getWidth() const { return width_; }
+
+	int getHeight() const { return height_; }
+
+	const float* getData() const { return data_.data(); }
+
+	float getTexel(int x, int y) const;
+
+	// Bilinear lookup in texel units, matches GL_LINEAR filtering
+	float sample(float x, float y) const;
+
+	// Bilinear resample to another resolution, drops the min/max pyramid
+	void resize(int width, int height);
+
+	// Octahedral encoded normals, two snorm16 per texel for a RG16_SNORM texture.
+	// maxHeight scales the 0-1 heights and texelWorldSize is the world distance
+	// between two texels. Rows are split over all hardware threads
+	void generateNormals(float maxHeight, float texelWorldSize, std::vector<int16_t>& normals) const;
+
+	// Geomorph data of every clip level for main.vert, two floats per texel for a RG32F
+	// mip chain. Level L has a texel per vertex of a clip level with spacing unitSize * 2^L,
+	// texel i being the vertex at world i * spacing, wrapped over worldSize. It stores the
+	// height (zf) and the coarser level height interpolated at that vertex minus zf (zd)
+	void generateMorphLevels(float worldSize, float unitSize, int levelCount, std::vector<std::vector<float>>& levels) const;
+
+	// Texels [x0, x1) x [y0, y1)
+	struct TexelRect
+	{
+		int x0, y0, x1, y1;
+	};
+
+	static const int kHorizonDirections = 8;
+
+	// Sine of the horizon elevation of every texel of the tiles, one byte per direction,
+	// direction d at d * 45 degrees from +x towards +y. Written into two RGBA8 layers of
+	// width x height, directions 0-3 in the first. heightScale is the height of 1.0 in
+	// texels and the horizon is searched up to maxDistance texels away. Tiles are split
+	// over up to maxThreads threads, all hardware threads with 0
+	void generateHorizons(const std::vector<TexelRect>& tiles, float heightScale, float maxDistance, uint8_t* horizons, int maxThreads = 0) const;
+
+	// Min/max pyramid for getHeightRange
+	void buildMinMaxPyramid();
+
+	// Conservative range of the heights a bilinear lookup can return inside the
+	// texel rectangle [x0, x1] x [y0, y1], wrapped like getTexel. Falls back to
+	// the full 0-1 range when the pyramid is not built
+	void getHeightRange(float x0, float y0, float x1, float y1, float& minHeight, float& maxHeight) const;
+
+private:
+
+	void generateNormalRows(int startRow, int endRow, float heightScale, int16_t* normals) const;
+
+	// Interior tiles only sample texels inside the heightfield and skip the border check
+	template<bool Interior>
+	void generateHorizonTile(const TexelRect& tile, const std::vector<float>& distances, float heightScale, uint8_t* horizons) const;
+
+	void generateMorphRows(int startRow, int endRow, int size, float spacing, float worldSize, std::vector<float>& level) const;
+
+	// Runs rowFunc(startRow, endRow) over up to maxThreads threads, all hardware threads
+	// with 0. A single thread runs on the caller
+	template<typename RowFunc>
+	static void ParallelRows(int rowCount, RowFunc rowFunc, int maxThreads = 0);
+
+	// Interleaved min and max per texel, level 0 is the heightmap itself. A texel of
+	// level k covers 2^k x 2^k texels of level 0, the last row or column may cover less
+	struct PyramidLevel
+	{
+		std::vector<float> minMax;
+		int width;
+		int height;
+	};
+
+	static void GetPyramidRange(const PyramidLevel& level, int shift, int x0, int y0, int x1, int y1, float& minHeight, float& maxHeight);
+
+	std::vector<PyramidLevel> pyramid_;
+
+	std::vector<float> data_;
+	int width_ = 0;
+	int height_ = 0;
+};
+
+#endif
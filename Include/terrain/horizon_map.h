@@ -0,0 +1,90 @@
+#ifndef HORIZON_MAP_H
+#define HORIZON_MAP_H
+
+#include "terrain/heightfield.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+class GLTexture;
+
+/*****************************************************************************************************************************************/
+// Horizon angles of a static Heightfield, main.frag derives soft sun shadows and ambient
+// occlusion from them without drawing any shadow map. The bake runs in tiles, so that
+// a streamed or edited area only bakes the tiles that can see it again. Tiles bake in
+// batches on a worker thread that lives as long as the map and are uploaded once their
+// batch is done, the heights must not change while a batch bakes
+
+class HorizonMap
+{
+public:
+
+	static const int kTileSize = 64;
+
+	// maxHeight and texelWorldSize as for Heightfield::generateNormals. Horizons are
+	// searched up to maxDistance texels away, every tile starts out to be baked
+	HorizonMap(std::shared_ptr<const Heightfield> heightfield, float maxHeight, float texelWorldSize, float maxDistance = 128.0f);
+
+	HorizonMap(const HorizonMap&) = delete;
+
+	// Waits for the batch being baked
+	~HorizonMap();
+
+	// Heights of the texels [x0, x1) x [y0, y1) changed, the tiles within the search
+	// distance are baked again. Wraps like the heightfield
+	void invalidate(int x0, int y0, int x1, int y1);
+
+	// Uploads the batch baked in the background once it is done and starts baking up to
+	// maxTiles of the tiles left. Returns how many tiles are not uploaded yet
+	int update(int maxTiles);
+
+	// Bakes and uploads every tile left on all hardware threads before returning
+	void bake();
+
+	int getPendingTileCount() const { return pendingTileCount_ + inFlightTileCount_; }
+
+	// Two RGBA8 layers, see Heightfield::generateHorizons
+	const GLTexture* getTexture() const { return texture_.get(); }
+
+private:
+
+	// Tiles still to bake, the first maxTiles of them at most
+	std::vector<Heightfield::TexelRect> takePendingTiles(int maxTiles);
+
+	void uploadTiles(const std::vector<Heightfield::TexelRect>& tiles);
+
+	// Bakes the batches handed over by update until the map goes away
+	void runWorker();
+
+	std::shared_ptr<const Heightfield> heightfield_;
+	float heightScale_;
+	float maxDistance_;
+
+	int tileCountX_;
+	int tileCountY_;
+	std::vector<uint8_t> pendingTiles_;
+	int pendingTileCount_ = 0;
+
+	std::vector<uint8_t> horizons_;
+	std::vector<uint8_t> upload_;
+	std::shared_ptr<GLTexture> texture_;
+
+	// Tiles handed to the worker and not uploaded yet
+	int inFlightTileCount_ = 0;
+
+	// The worker only writes the tiles of its batch into horizons_. Batches go in
+	// through bakingTiles_ and come back through bakedTiles_, both under mutex_
+	std::mutex mutex_;
+	std::condition_variable condition_;
+	std::vector<Heightfield::TexelRect> bakingTiles_;
+	std::vector<Heightfield::TexelRect> bakedTiles_;
+	bool stopping_ = false;
+	// Last so that everything it uses is constructed before it starts
+	std::thread worker_;
+};
+
+#endif
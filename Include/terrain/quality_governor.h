@@ -0,0 +1,93 @@
+#ifndef QUALITY_GOVERNOR_H
+#define QUALITY_GOVERNOR_H
+
+#include <array>
+#include <vector>
+#include <fstream>
+#include <string>
+#include <stdint.h>
+
+class Terrain;
+
+/*****************************************************************************************************************************************/
+
+struct QualityLevel
+{
+	int maxClipLevelCount;
+	int vertexCount;
+	float transitionRegionWidth;
+	int fragmentDetail;
+};
+
+struct QualityGovernorConfig
+{
+	// Frame budget in milliseconds
+	float targetFrameTime = 8.3f;
+
+	// Percentile of the rolling window compared against the budget
+	float percentile = 0.9f;
+
+	// Hysteresis band, degrade above target * upper and improve below target * lower
+	float upperThreshold = 1.1f;
+	float lowerThreshold = 0.75f;
+
+	// Frames kept in the rolling histogram and frames to wait after a change
+	int windowSize = 120;
+	int cooldownFrames = 60;
+
+	// Ordered from the lowest to the highest quality
+	std::vector<QualityLevel> levels = {
+		QualityLevel{  8, 127, 0.15f, 0 },
+		QualityLevel{ 10, 127, 0.10f, 0 },
+		QualityLevel{ 10, 255, 0.10f, 1 },
+		QualityLevel{ 12, 255, 0.10f, 1 },
+	};
+
+	// Every decision is appended as csv for offline analysis
+	std::string logFile = "quality_governor.csv";
+};
+
+/*****************************************************************************************************************************************/
+
+class QualityGovernor
+{
+public:
+
+	explicit QualityGovernor(Terrain* terrain, const QualityGovernorConfig& config = QualityGovernorConfig{});
+
+	// dt in seconds as measured by the main loop
+	void update(float dt);
+
+	int getLevel() const { return currentLevel_; }
+
+	float getFrameTimePercentile() const;
+
+private:
+
+	void addSample(float frameTime);
+
+	void resetHistory();
+
+	void applyLevel(int level, const char* reason, float frameTime);
+
+	// 0.25ms buckets, everything above 64ms lands in the last one
+	static constexpr float kBucketWidth = 0.25f;
+	static const int kBucketCount = 256;
+
+	Terrain* terrain_;
+	QualityGovernorConfig config_;
+
+	std::array<int, kBucketCount> histogram_ = {};
+	std::vector<int> samples_;
+	int sampleHead_ = 0;
+	int sampleCount_ = 0;
+
+	int currentLevel_;
+	int cooldown_ = 0;
+	uint64_t frameIndex_ = 0;
+	double elapsedTime_ = 0.0;
+
+	std::ofstream log_;
+};
+
+#endif
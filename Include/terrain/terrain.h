@@ -2,33 +2,172 @@
 #define TERRAIN_H
 
 #include "terrain_params.h"
+#include "terrain_stats.h"
+#include "math_helper.h"
+#include <future>
 #include <memory>
+#include <vector>
 
 class Camera;
 class GLProgram;
 class TerrainGeometry;
 class GLTexture;
+class GLBuffer;
+class TerrainMaterial;
+class Heightfield;
+class TerrainTessellation;
+class TerrainShadows;
+class HorizonMap;
 
 class Terrain
 {
 public:
 
-	explicit Terrain(int vertexCount, float unitSize);
+	explicit Terrain(int vertexCount, float unitSize, bool vertexPulling = false,
+		const char* heightmapFile = "Assets/Textures/heightmap1.png");
 
-	void update(Camera* camera, float dt);
+	// viewportSize is the size in pixels the camera renders at
+	void update(Camera* camera, const glm::ivec2& viewportSize, float dt);
 
 	void draw();
 
+	// One placement for the camera culled against several views at once, e.g. the
+	// shadow cascades of a light. Each view is then drawn with drawView while its
+	// view projection is bound, draw is drawView(0)
+	void updateViews(Camera* camera, const glm::ivec2& viewportSize, const std::vector<glm::mat4>& viewProjections, float dt);
+
+	void drawView(int viewIndex);
+
+	// Clipmap blocks visible in one view of the last update
+	uint32_t getViewInstanceCount(int viewIndex) const;
+
+	// The same blocks as packed for the GPU, one key per block with the tile
+	// position in the low and the attributes in the high 32 bits
+	void getViewInstances(int viewIndex, std::vector<uint64_t>& keys) const;
+
+	// Change the clipmap resolution at runtime, vertexCount must be 2^n - 1.
+	// The previous footprint keeps rendering until the new one is available. A
+	// new unit size first bakes its morph map in the background, the footprint
+	// is only requested once it is uploaded so that both switch together
+	void reconfigure(int vertexCount, float unitSize, int maxClipLevelCount);
+
+	// Build footprints ahead of time so that reconfigure never waits on a rebuild
+	void precomputeFootprints(const std::vector<int>& vertexCounts);
+
+	void setTransitionRegionWidth(float width) { terrainParams_.transitionRegionWidth = width; }
+
+	void setFragmentDetail(int detail) { terrainParams_.fragmentDetail = detail; }
+
+	const TerrainParams& getParams() const { return terrainParams_; }
+
+	// Counters of the active render mode for the last update and draw
+	const TerrainStats& getStats() const { return stats_; }
+
+	void setRenderMode(TerrainRenderMode mode) { terrainParams_.renderMode = mode; }
+
+	void setHierarchicalCulling(bool enabled) { terrainParams_.hierarchicalCulling = enabled; }
+
+	void setFrontToBack(bool enabled) { terrainParams_.frontToBack = enabled; }
+
+	void setDepthPrepass(bool enabled) { terrainParams_.depthPrepass = enabled; }
+
+	// Cascaded sun shadows of the clipmap and quadtree modes, off by default
+	void setShadows(bool enabled);
+
+	// Null while shadows are off
+	TerrainShadows* getShadows() const { return shadows_.get(); }
+
+	// Sun visibility and ambient occlusion from baked horizons, off by default. The
+	// bake runs a few tiles per update, unbaked tiles are lit and unoccluded
+	void setHorizonMap(bool enabled);
+
+	// Null while the horizon map is off
+	HorizonMap* getHorizonMap() const { return horizonMap_.get(); }
+
+	// Textures are fetched through ARB_bindless_texture handles when supported
+	bool usesBindlessTextures() const { return textureHandleBuffer_ != nullptr; }
+
+	// CPU copy of the heightmap the terrain renders
+	const Heightfield& getHeightfield() const { return *heightfield_; }
+
 	~Terrain();
 
 private:
+
+	void drawClipmap(int viewIndex);
+
+	void setClipmapUniforms(GLProgram* shader);
+
+	// Cascades picked by the last update, drawn before the camera view
+	void drawShadowCascades();
+
+	// Switches to the morph map of the unit size the geometry changed to
+	void updateMorphMap();
+
+	// Uploads finished morph levels a few rows per update and requests the footprint
+	// waiting for them once they are all uploaded
+	void updatePendingMorphMap();
+
+	// Morph map of unitSize baked and uploaded, current or next
+	bool isMorphMapReady(float unitSize) const;
+
+	// Storage for every level, uploaded by the caller
+	static std::shared_ptr<GLTexture> CreateMorphMap(float unitSize);
+
+	static std::vector<std::vector<float>> GenerateMorphLevels(std::shared_ptr<const Heightfield> heightfield, float unitSize);
+
+	void createTextureHandleBuffer();
+
+	static const int kPrimitiveQueryCount = 4;
+
+	// Morph map texels uploaded per update, 4MB of RG32F
+	static const int kMorphUploadTexelsPerUpdate = 1 << 19;
+
+	// Horizon map tiles per background batch
+	static const int kHorizonTilesPerUpdate = 4;
+
 	TerrainParams terrainParams_;
+	TerrainStats stats_ = {};
 
 	std::shared_ptr<GLProgram> shader_;
+	std::shared_ptr<GLProgram> depthShader_;
+	std::shared_ptr<GLProgram> shadowShader_;
 	std::shared_ptr<TerrainGeometry> terrainGeometry_;
+	std::shared_ptr<TerrainTessellation> tessellation_;
+	std::shared_ptr<TerrainShadows> shadows_;
+	std::vector<int> pendingCascades_;
+	std::shared_ptr<HorizonMap> horizonMap_;
 
+	std::shared_ptr<Heightfield> heightfield_;
 	std::shared_ptr<GLTexture> heightMap_;
+	std::shared_ptr<GLTexture> normalMap_;
+	std::shared_ptr<GLTexture> morphMap_;
+	// Unit size the morph map is baked for
+	float morphUnitSize_ = 0.0f;
+	// Uploaded for the unit size of a footprint request and swapped in once the
+	// geometry switches to it
+	std::shared_ptr<GLTexture> nextMorphMap_;
+	float nextMorphUnitSize_ = 0.0f;
+	std::future<std::vector<std::vector<float>>> pendingMorphLevels_;
+	float pendingMorphUnitSize_ = 0.0f;
+	// Levels of nextMorphMap_ still being uploaded, from morphUploadLevel_ and row on
+	std::vector<std::vector<float>> morphUploadLevels_;
+	int morphUploadLevel_ = 0;
+	int morphUploadRow_ = 0;
+	// Last reconfigure, held back until its morph map is uploaded
+	int requestedVertexCount_ = 0;
+	float requestedUnitSize_ = 0.0f;
 	std::shared_ptr<GLTexture> gradientMap_;
+	std::shared_ptr<TerrainMaterial> material_;
+
+	// Resident handles of every texture above, same order as the bindings
+	std::shared_ptr<GLBuffer> textureHandleBuffer_;
+
+	// GL_PRIMITIVES_GENERATED ring, read back without stalling
+	unsigned int primitiveQueries_[kPrimitiveQueryCount] = {};
+	int primitiveQueryIndex_ = 0;
+	uint64_t primitiveQueryFrame_ = 0;
+	uint64_t primitivesGenerated_ = 0;
 };
 
 
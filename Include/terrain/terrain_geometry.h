@@ -4,13 +4,20 @@
 
 #include "math_helper.h"
 #include "terrain_params.h"
+#include "terrain_stats.h"
+#include "geometry/vertex_data.h"
 
 #include <vector>
 #include <memory>
+#include <map>
+#include <future>
 
 class GLMesh;
+class GLProceduralMesh;
 class GLBuffer;
 class Camera;
+class Frustum;
+class Heightfield;
 
 class TerrainGeometry
 {
@@ -18,37 +25,201 @@ public:
 
 	explicit TerrainGeometry(TerrainParams* params);
 
-	void update(Camera* camera);
+	// viewportSize is the size in pixels the camera renders at
+	void update(Camera* camera, const glm::ivec2& viewportSize);
 
 	void draw();
 
-private:
+	// Placement and LOD follow the camera, the blocks are then culled against every
+	// view in one pass and each view gets its own command set. Views are the view
+	// projections of e.g. shadow cascades or the eyes of a stereo pair
+	void updateViews(Camera* camera, const glm::ivec2& viewportSize, const std::vector<glm::mat4>& viewProjections);
 
-	void generateFootprintGeometry(int vertexCount, float unitSize);
+	// Draws what one view of the last update sees, update alone only has view 0.
+	// The view projection of PerFrameData has to match
+	void drawView(int viewIndex);
 
-	void generateLocations(const glm::vec3& cameraPosition);
+	int getViewCount() const { return static_cast<int>(views_.size()); }
 
-	void generateLocationFor(int clipLevel, const glm::vec3& cameraPosition);
+	// Instances visible in one view of the last update
+	uint32_t getViewInstanceCount(int viewIndex) const;
 
-	void updateDrawCommands(Camera* camera);
+	static const int kMaxViewCount = 8;
 
-	std::shared_ptr<GLMesh> mesh_;
+	// Switch to another footprint resolution, a footprint that is not cached
+	// is built on a worker thread and swapped in once it is uploaded
+	void requestFootprint(int vertexCount, float unitSize);
 
-	int m_;
-	TerrainParams* params_;
+	// Build and upload a footprint so that a later request swaps instantly
+	void precomputeFootprint(int vertexCount, float unitSize);
+
+	// Counters of the last update/draw
+	const TerrainStats& getStats() const { return stats_; }
 
+	// Tightens the quadtree node bounds, worldSize is the extent of one heightmap repeat
+	void setHeightfield(const Heightfield* heightfield, float worldSize);
 
+	// Per instance data, same layout as TerrainData in main.vert
 	struct TerrainData
 	{
 		glm::vec2 translate;
 		glm::vec2 scale;
+		// Footprint mesh id and rotation in radians
 		glm::vec2 id;
+		// Terrain of a TerrainWorld the instance is drawn for
+		int terrainIndex = 0;
 
 		BoundingBox generateBoundingBox();
 	};
 
+	// GPU copy of TerrainData, same layout as TerrainData in main.vert. Translate is
+	// stored in tiles of the instance level relative to a per frame origin
+	//   position:   tile x (int16) | tile y (int16) << 16
+	//   attributes: level (4 bits) | mesh id << 4 (3 bits) | quarter turns << 7 (2 bits) | terrain << 9 (6 bits)
+	struct PackedTerrainData
+	{
+		uint32_t position;
+		uint32_t attributes;
+	};
+
+	static PackedTerrainData PackInstance(const TerrainData& instance, const glm::vec2& origin, float unitSize);
+
+	// Decodes as main.vert does
+	static TerrainData UnpackInstance(const PackedTerrainData& packed, const glm::vec2& origin, float unitSize);
+
+	// Origin of the packed tile coordinates, on the grid of the coarsest level so that
+	// every level lands on whole tiles. u_InstanceOrigin in main.vert
+	static glm::vec2 GetInstanceOrigin(const TerrainParams& params, const glm::vec3& cameraPosition);
+
+	const glm::vec2& getInstanceOrigin() const { return instanceOrigin_; }
+
+	// Instances visible in one view of the last update as uploaded, in draw order
+	void getViewInstances(int viewIndex, std::vector<PackedTerrainData>& instances) const;
+
+	// Area and height range of one terrain of a TerrainWorld
+	struct TerrainRegion
+	{
+		glm::vec2 min;
+		glm::vec2 max;
+		float minHeight;
+		float maxHeight;
+	};
+
+	// With regions, every visible block is drawn once per region it overlaps with
+	// the region index as terrainIndex. Without any, blocks are drawn once
+	void setRegions(const std::vector<TerrainRegion>& regions) { regions_ = regions; }
+
+	static const int kMaxTerrainCount = 64;
+
+	// Placement of every clip level for a camera position, needs no GL context.
+	// Levels finer than finestLevel are left out and finestLevel fills the center
+	static void GenerateLocations(const TerrainParams& params, const glm::vec3& cameraPosition,
+		std::vector<TerrainData>& instances, TerrainStats* stats = nullptr, int finestLevel = 0);
+
+	// Finest clip level whose vertex spacing covers at least params.clipLevelSkipPixels
+	// at the nearest distance the level can be seen from, the camera height above the
+	// highest point under that level. pixelScale is projection[1][1] * viewportHeight / 2
+	static int GetFinestClipLevel(const TerrainParams& params, const glm::vec3& cameraPosition,
+		const Heightfield* heightfield, float worldSize, float pixelScale);
+
+	// CDLOD alternative to GenerateLocations, MxM footprints as the leaves of a quadtree
+	// refined around the camera. Subtrees outside the frustum are skipped, their bounds
+	// come from the min/max pyramid of the heightfield when there is one
+	static void GenerateQuadtreeNodes(const TerrainParams& params, const glm::vec3& cameraPosition, Frustum* frustum,
+		const Heightfield* heightfield, float worldSize, std::vector<TerrainData>& instances, TerrainStats* stats = nullptr);
+
+	// Distance per unit of scale at which a level is fully morphed into the next, u_LodRange in main.vert
+	static float GetLodRange(const TerrainParams& params);
+
+	static glm::ivec2 GetFootprintDimension(int meshId, int m, int vertexCount);
+
+	static const int kFootprintMeshCount = 5;
+
+private:
+
+	using FootprintKey = std::pair<int, float>;
+
+	static MeshData GenerateFootprintGeometry(int vertexCount, float unitSize);
+
+	void activateFootprint(const FootprintKey& key);
+
+	void updatePendingFootprint();
+
+	void generateProceduralFootprint(int vertexCount, float unitSize);
+
+	// Instance count of each command and the first instance of a view
+	struct ViewCommands
+	{
+		uint32_t firstInstance = 0;
+		uint32_t instanceCounts[kFootprintMeshCount] = {};
+	};
+
+	void addViewStats(const ViewCommands& view);
+
+	void generatePlacement(Camera* camera, const glm::ivec2& viewportSize, Frustum* frustum);
+
+	static void GenerateLocationFor(const TerrainParams& params, int clipLevel, bool finest, const glm::vec3& cameraPosition,
+		std::vector<TerrainData>& instances);
+
+	void updateDrawCommands(Camera* camera);
+
+	// Marks the instances outside the frustum with a negative id
+	void cullInstances(Camera* camera);
+
+	// One bit per view in visibilityMasks_ for every instance
+	void cullViews(Camera* camera);
+
+	// By mesh id, then front to back when enabled. masks, one per instance, are reordered along
+	void sortInstances(std::vector<TerrainData>& instances, const glm::vec3& cameraPosition, std::vector<uint32_t>* masks = nullptr);
+
+	// Packs the instances into the start of the instance buffer
+	void uploadInstances(const std::vector<TerrainData>& instances, const glm::vec3& cameraPosition);
+
+	bool testInstance(Frustum* frustum, TerrainData& transform, bool drawVisibleBounds);
+
+	BoundingBox getInstanceBounds(const TerrainData& transform);
+
+	// Replaces the visible blocks with one copy per region they are visible in
+	void assignRegions(Camera* camera);
+
+	static const int kMaxInstanceCount = 4000;
+
+	std::shared_ptr<GLMesh> mesh_;
+	std::map<FootprintKey, std::shared_ptr<GLMesh>> footprintCache_;
+
+	std::future<MeshData> pendingFootprint_;
+	FootprintKey pendingKey_;
+	FootprintKey requestedKey_;
+
+	std::shared_ptr<GLProceduralMesh> proceduralMesh_;
+	std::vector<BoundingBox> footprintBounds_;
+
+	int m_;
+	int footprintVertexCount_;
+	float footprintUnitSize_;
+	TerrainParams* params_;
+
+	const Heightfield* heightfield_ = nullptr;
+	float heightfieldWorldSize_ = 0.0f;
+
 	std::vector<TerrainData> transformData_;
+	std::vector<TerrainData> regionData_;
+	std::vector<TerrainRegion> regions_;
+	std::vector<PackedTerrainData> packedData_;
+	// Distance and index of every instance, kept to sort without allocating
+	std::vector<std::pair<float, uint32_t>> sortKeys_;
+	std::vector<TerrainData> sortedData_;
+	std::vector<uint32_t> sortedMasks_;
+
+	std::vector<ViewCommands> views_;
+	std::vector<Frustum> viewFrusta_;
+	std::vector<uint32_t> visibilityMasks_;
+	std::vector<TerrainData> viewData_;
+
+	glm::vec2 instanceOrigin_ = glm::vec2(0.0f);
 	std::shared_ptr<GLBuffer> transformBuffer_;
+
+	TerrainStats stats_ = {};
 };
 
 #endif
@@ -0,0 +1,78 @@
+#ifndef TERRAIN_MATERIAL_H
+#define TERRAIN_MATERIAL_H
+
+#include "math_helper.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+class GLBuffer;
+class GLTexture;
+
+/*****************************************************************************************************************************************/
+
+struct MaterialLayer
+{
+	// RGB(A) images, all layers must share the same size. An empty or missing
+	// albedo is generated from the noise texture and a missing normal map is
+	// derived from the albedo luminance
+	std::string albedoFile;
+	std::string normalFile;
+
+	glm::vec3 tint;
+
+	// World units covered by one repeat of the layer textures
+	float tiling;
+
+	// Splat rule, the layer weight is the product of a height window (0-1 of the
+	// max height) and a slope window (1 - normal.y) with soft edges of blend width
+	float minHeight, maxHeight;
+	float minSlope, maxSlope;
+	float blend;
+};
+
+/*****************************************************************************************************************************************/
+// Albedo and normal layers stored in two GL_TEXTURE_2D_ARRAYs with the splat
+// rules in a uniform buffer, so that any number of layers costs the same two
+// texture bindings (or none with bindless handles)
+
+class TerrainMaterial
+{
+public:
+
+	explicit TerrainMaterial(const std::vector<MaterialLayer>& layers = DefaultLayers());
+
+	static std::vector<MaterialLayer> DefaultLayers();
+
+	// Layers sampled by main.frag, must match MaterialRules
+	static const int kMaxLayerCount = 8;
+
+	std::shared_ptr<GLTexture> getAlbedoArray() const { return albedoArray_; }
+
+	std::shared_ptr<GLTexture> getNormalArray() const { return normalArray_; }
+
+	// Uniform buffer bound to MaterialRules
+	unsigned int getRuleBuffer() const;
+
+	int getLayerCount() const { return layerCount_; }
+
+	~TerrainMaterial();
+
+private:
+
+	// RGBA8 layer images
+	static bool LoadLayerImage(const std::string& filename, int width, int height, std::vector<uint8_t>& pixels);
+
+	static void GenerateAlbedo(const std::vector<uint8_t>& noise, int channel, std::vector<uint8_t>& pixels);
+
+	static void GenerateNormal(const std::vector<uint8_t>& albedo, int width, int height, std::vector<uint8_t>& pixels);
+
+	std::shared_ptr<GLTexture> albedoArray_;
+	std::shared_ptr<GLTexture> normalArray_;
+	std::shared_ptr<GLBuffer> ruleBuffer_;
+	int layerCount_;
+};
+
+#endif
@@ -1,6 +1,16 @@
 #ifndef TERRAIN_PARAMS_H
 #define TERRAIN_PARAMS_H
 
+enum class TerrainRenderMode
+{
+	// Nested grids of fixed footprints around the camera
+	Clipmap,
+	// Coarse patch grid refined by the tessellator
+	Tessellation,
+	// CDLOD quadtree of MxM footprints, same meshes and morphing as the clipmap
+	Quadtree
+};
+
 struct TerrainParams
 {
 	int vertexCount;
@@ -10,6 +20,34 @@ struct TerrainParams
 	float maxHeight;
 	float minHeight;
 	float transitionRegionWidth;
+
+	// Generate footprint vertices in the vertex shader instead of storing them
+	bool vertexPulling = false;
+
+	// 0 uses screen space derivative normals, 1 samples the heightmap
+	int fragmentDetail = 1;
+
+	// Clip levels whose vertex spacing projects below this many pixels, even at the
+	// closest they can get to the camera, are skipped. 0 always starts at level 0
+	float clipLevelSkipPixels = 1.0f;
+
+	// Test each ring and its quadrants before their blocks
+	bool hierarchicalCulling = true;
+
+	// Sort the instances of each mesh type nearest first
+	bool frontToBack = true;
+
+	// Clipmap and quadtree modes lay down depth with a position only shader first
+	// and shade with GL_EQUAL, so that main.frag runs once per pixel
+	bool depthPrepass = false;
+
+	TerrainRenderMode renderMode = TerrainRenderMode::Clipmap;
+
+	// Tessellation mode, patches per side of the grid, world size of a patch and
+	// projected length in pixels a tessellated edge aims for
+	int patchGridSize = 64;
+	float patchSize = 64.0f;
+	float tessellationPixels = 8.0f;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,105 @@
+#ifndef TERRAIN_SHADOWS_H
+#define TERRAIN_SHADOWS_H
+
+#include "math_helper.h"
+
+#include <memory>
+#include <vector>
+
+class Camera;
+class GLBuffer;
+
+/*****************************************************************************************************************************************/
+// Sun shadows of a Terrain in cascades of growing extent around the camera. Like a clip
+// level, a cascade only moves in whole steps of its snap size, so its texels stay put
+// and the depth it holds stays valid while the camera moves inside one step. The
+// nearest cascade follows the morphs of the finest levels and is drawn every frame,
+// the others are cached and only drawn again once the sun turns or their origin snaps
+
+class TerrainShadows
+{
+public:
+
+	static const int kCascadeCount = 4;
+
+	// Cascade i covers nearestExtent * 4^i across, resolution x resolution texels
+	explicit TerrainShadows(int resolution = 2048, float nearestExtent = 256.0f);
+
+	// Direction towards the sun, every cached cascade is drawn again
+	void setLightDirection(const glm::vec3& direction);
+
+	const glm::vec3& getLightDirection() const { return lightDirection_; }
+
+	// Picks the cascades to draw this frame and moves them to the camera. A cascade
+	// that was never drawn is always picked, at most one stale cached cascade is
+	// redrawn per frame, oldest first, the others keep shading with their old matrix
+	const std::vector<int>& update(Camera* camera);
+
+	// Light view projection a cascade is drawn and sampled with
+	const glm::mat4& getViewProjection(int cascade) const { return cascades_[cascade].viewProjection; }
+
+	// Render target of one cascade, depth only and cleared. endCascade restores
+	// the framebuffer, viewport and raster state of the caller
+	void beginCascade(int cascade);
+
+	void endCascade();
+
+	// Shadow map and cascade matrices for main.frag, texture unit 6 and uniform block 3
+	void bind() const;
+
+	// Cascades drawn since the start, for the per frame average
+	uint64_t getRenderedCascadeCount() const { return renderedCascadeCount_; }
+
+	~TerrainShadows();
+
+private:
+
+	struct Cascade
+	{
+		float extent;
+		// Light space position of the cascade center, a multiple of the snap size
+		glm::vec2 origin;
+		float depthOrigin;
+		glm::mat4 viewProjection;
+		bool valid;
+		bool stale;
+		uint64_t drawnFrame;
+	};
+
+	// Same layout as ShadowData in main.frag, std140
+	struct ShadowData
+	{
+		glm::mat4 viewProjections[kCascadeCount];
+		glm::vec4 lightDirection;
+		// Texel size in world units per cascade
+		glm::vec4 texelSizes;
+	};
+
+	// Light space basis, x and y span the shadow map and z points to the sun
+	glm::mat3 getLightBasis() const;
+
+	void updateCascade(Cascade& cascade, const glm::vec2& origin, float depthOrigin);
+
+	int resolution_;
+	glm::vec3 lightDirection_;
+	Cascade cascades_[kCascadeCount] = {};
+	std::vector<int> drawList_;
+	uint64_t frame_ = 0;
+	uint64_t renderedCascadeCount_ = 0;
+
+	unsigned int depthArray_ = 0;
+	unsigned int framebuffers_[kCascadeCount] = {};
+	std::shared_ptr<GLBuffer> shadowDataBuffer_;
+
+	// State of the caller between beginCascade and endCascade
+	int savedFramebuffer_ = 0;
+	int savedViewport_[4] = {};
+	int savedPolygonMode_[2] = {};
+	bool savedCullFace_ = false;
+	int savedCullFaceMode_ = 0;
+	bool savedPolygonOffset_ = false;
+	float savedPolygonOffsetFactor_ = 0.0f;
+	float savedPolygonOffsetUnits_ = 0.0f;
+};
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef TERRAIN_STATS_H
+#define TERRAIN_STATS_H
+
+#include <stdint.h>
+#include <fstream>
+
+/*****************************************************************************************************************************************/
+// Per frame counters filled by TerrainGeometry or TerrainTessellation
+
+struct TerrainStats
+{
+	static const int kMaxClipLevels = 16;
+	static const int kMeshTypeCount = 5;
+
+	// Instances placed per clip level before culling
+	uint32_t instancesPerLevel[kMaxClipLevels];
+	uint32_t instancesGenerated;
+	uint32_t instancesCulled;
+
+	// Frustum tests of blocks, rings and quadrants
+	uint32_t boundsTested;
+
+	// Triangles submitted per footprint mesh (MxM, Mx2, (M+1)x2, 2xM, L-Trim)
+	uint64_t trianglesPerMesh[kMeshTypeCount];
+
+	// Bytes pushed through glNamedBufferSubData (instances and indirect commands)
+	uint64_t bytesUploaded;
+
+	// Indirect commands with at least one instance
+	uint32_t drawCommandCount;
+
+	// First clip level generated, finer ones were sub-pixel from the camera height
+	uint32_t finestClipLevel;
+
+	// Triangles emitted by the terrain draw, from a GL_PRIMITIVES_GENERATED
+	// query read a few frames late. The only triangle count of the tessellation mode
+	uint64_t primitivesGenerated;
+
+	void reset() { *this = TerrainStats{}; }
+
+	uint64_t getTotalTriangles() const
+	{
+		uint64_t total = 0;
+		for (int i = 0; i < kMeshTypeCount; ++i)
+			total += trianglesPerMesh[i];
+		return total;
+	}
+};
+
+/*****************************************************************************************************************************************/
+// Appends one csv row per frame so geometry load can be correlated with frame time
+
+class TerrainStatsRecorder
+{
+public:
+
+	explicit TerrainStatsRecorder(const char* filename);
+
+	void record(uint64_t frame, float frameTime, const TerrainStats& stats);
+
+private:
+	std::ofstream out_;
+};
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef TERRAIN_TESSELLATION_H
+#define TERRAIN_TESSELLATION_H
+
+#include "math_helper.h"
+#include "terrain_params.h"
+#include "terrain_stats.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class GLProgram;
+class Camera;
+
+/*****************************************************************************************************************************************/
+// Alternative to the clipmap, a grid of quad patches that follows the camera.
+// Patches are generated from gl_VertexID, the control shader culls them against
+// the frustum and picks edge factors from their projected size
+
+class TerrainTessellation
+{
+public:
+
+	TerrainTessellation(TerrainParams* params, const std::vector<std::string>& defines);
+
+	void update(Camera* camera, const glm::ivec2& viewportSize);
+
+	// Textures and buffers shared with the clipmap must already be bound
+	void draw(float textureDims);
+
+	// Counters of the last update
+	const TerrainStats& getStats() const { return stats_; }
+
+	~TerrainTessellation();
+
+private:
+	TerrainParams* params_;
+
+	std::shared_ptr<GLProgram> shader_;
+	// Nothing is sourced from it, core profile just needs one bound
+	uint32_t vao_;
+
+	glm::vec2 patchOrigin_ = glm::vec2(0.0f);
+	// Edge factors are picked in pixels of the viewport of the last update
+	float viewportHeight_ = 0.0f;
+
+	TerrainStats stats_ = {};
+};
+
+#endif
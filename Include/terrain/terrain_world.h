@@ -0,0 +1,88 @@
+#ifndef TERRAIN_WORLD_H
+#define TERRAIN_WORLD_H
+
+#include "math_helper.h"
+#include "terrain_params.h"
+#include "terrain_stats.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class Camera;
+class GLProgram;
+class GLTexture;
+class GLBuffer;
+class TerrainGeometry;
+class TerrainMaterial;
+
+/*****************************************************************************************************************************************/
+
+// One terrain of a TerrainWorld, its heightmap covers a square around center. The
+// center snaps to a multiple of the coarsest tile, 2048 units with 12 levels of 1 unit
+struct TerrainDesc
+{
+	std::string heightmapFile;
+	glm::vec2 center = glm::vec2(0.0f);
+	float maxHeight = 200.0f;
+};
+
+/*****************************************************************************************************************************************/
+// Several terrains (islands, LOD proxies) drawn from a single clipmap. The footprint
+// meshes, placement and instance buffer are shared, heights and normals of every
+// terrain are layers of texture arrays and each visible block is tagged with the
+// terrain it is drawn for, so that all of them go out in one multi-draw.
+// Terrains should not overlap, a block is clipped to the area of its terrain.
+//
+// Texture arrays have one layer per terrain that loaded. A morph layer is RG32F
+// with one texel per unit of the terrain plus its mips, about 43MB for 2048 units
+// at a unit size of 1, the normal layer is RG16 at heightmap resolution. The 64
+// terrains the instance format can address would take close to 3GB that way,
+// worlds of many terrains need smaller terrains or a coarser unit size
+
+class TerrainWorld
+{
+public:
+
+	// Every terrain covers terrainSize x terrainSize. Heightmaps of another resolution
+	// than the first one are resampled to it, the world stays empty if none loads
+	TerrainWorld(int vertexCount, float unitSize, const std::vector<TerrainDesc>& terrains, float terrainSize = 2048.0f);
+
+	// viewportSize is the size in pixels the camera renders at
+	void update(Camera* camera, const glm::ivec2& viewportSize, float dt);
+
+	void draw();
+
+	int getTerrainCount() const { return static_cast<int>(terrains_.size()); }
+
+	const TerrainParams& getParams() const { return terrainParams_; }
+
+	// Counters of the last update and draw
+	const TerrainStats& getStats() const { return stats_; }
+
+private:
+
+	// Per terrain data read by main.vert and main.frag, std430 layout
+	struct TerrainInfo
+	{
+		glm::vec2 center;
+		float worldSize;
+		float maxHeight;
+	};
+
+	TerrainParams terrainParams_;
+	TerrainStats stats_ = {};
+	std::vector<TerrainDesc> terrains_;
+	float terrainSize_;
+
+	std::shared_ptr<GLProgram> shader_;
+	std::shared_ptr<TerrainGeometry> terrainGeometry_;
+	std::shared_ptr<TerrainMaterial> material_;
+
+	std::shared_ptr<GLTexture> gradientMap_;
+	std::shared_ptr<GLTexture> normalMaps_;
+	std::shared_ptr<GLTexture> morphMaps_;
+	std::shared_ptr<GLBuffer> terrainBuffer_;
+};
+
+#endif
@@ -55,6 +55,27 @@ void FirstPersonCamera::update(float dt)
 	static const float halfPI = static_cast<float>(PI_2);
 	orientation_.x = glm::clamp(orientation_.x, -halfPI, halfPI);
 
+	updateViewMatrix();
+}
+
+/*****************************************************************************************************************************************/
+
+void FirstPersonCamera::setPose(const glm::vec3& position, const glm::vec3& orientation)
+{
+	generateProjectionMatrix();
+
+	position_ = position;
+	orientation_ = orientation;
+	velocity_ = glm::vec3(0.0f);
+	angularVelocity_ = glm::vec3(0.0f);
+
+	updateViewMatrix();
+}
+
+/*****************************************************************************************************************************************/
+
+void FirstPersonCamera::updateViewMatrix()
+{
 	glm::mat3 rotationMatrix = glm::yawPitchRoll(orientation_.y, orientation_.x, orientation_.z);
 	up_ = glm::normalize(rotationMatrix * glm::vec3(0.0f, 1.0f, 0.0f));
 	forward_ = glm::normalize(rotationMatrix * target_);
@@ -62,7 +83,6 @@ void FirstPersonCamera::update(float dt)
 	viewMatrix_ = glm::lookAt(position_, position_ + forward_, up_);
 
 	frustum_->generate(this);
-
 }
 
 /*****************************************************************************************************************************************/
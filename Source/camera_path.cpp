@@ -0,0 +1,124 @@
+#include "camera_path.h"
+#include "camera.h"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <algorithm>
+#include <assert.h>
+#include <cstdio>
+
+/*****************************************************************************************************************************************/
+
+bool CameraPath::load(const char* filename)
+{
+	std::ifstream inFile(filename);
+	if (!inFile)
+	{
+		fprintf(stderr, "Failed to load camera path: %s\n", filename);
+		return false;
+	}
+
+	keyframes_.clear();
+
+	std::string line;
+	while (std::getline(inFile, line))
+	{
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		std::istringstream ss(line);
+		CameraKeyframe keyframe = {};
+		ss >> keyframe.time
+			>> keyframe.position.x >> keyframe.position.y >> keyframe.position.z
+			>> keyframe.orientation.x >> keyframe.orientation.y >> keyframe.orientation.z;
+		if (ss.fail())
+			continue;
+		keyframes_.push_back(keyframe);
+	}
+
+	std::stable_sort(keyframes_.begin(), keyframes_.end(), [](const CameraKeyframe& a, const CameraKeyframe& b) {
+		return a.time < b.time;
+		});
+
+	return !keyframes_.empty();
+}
+
+/*****************************************************************************************************************************************/
+
+bool CameraPath::save(const char* filename) const
+{
+	std::ofstream outFile(filename);
+	if (!outFile)
+	{
+		fprintf(stderr, "Failed to save camera path: %s\n", filename);
+		return false;
+	}
+
+	outFile.precision(9);
+	outFile << "# time px py pz pitch yaw roll\n";
+	for (const CameraKeyframe& keyframe : keyframes_)
+	{
+		outFile << keyframe.time << " "
+			<< keyframe.position.x << " " << keyframe.position.y << " " << keyframe.position.z << " "
+			<< keyframe.orientation.x << " " << keyframe.orientation.y << " " << keyframe.orientation.z << "\n";
+	}
+	return true;
+}
+
+/*****************************************************************************************************************************************/
+
+static glm::vec3 CatmullRom(const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, const glm::vec3& p3, float t)
+{
+	float t2 = t * t;
+	float t3 = t2 * t;
+	return 0.5f * ((2.0f * p1) +
+		(-p0 + p2) * t +
+		(2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * t2 +
+		(-p0 + 3.0f * p1 - 3.0f * p2 + p3) * t3);
+}
+
+CameraKeyframe CameraPath::evaluate(float time) const
+{
+	assert(!keyframes_.empty());
+
+	if (time <= keyframes_.front().time)
+		return keyframes_.front();
+	if (time >= keyframes_.back().time)
+		return keyframes_.back();
+
+	// First keyframe after time, segment is [i - 1, i]
+	auto it = std::upper_bound(keyframes_.begin(), keyframes_.end(), time, [](float t, const CameraKeyframe& keyframe) {
+		return t < keyframe.time;
+		});
+	int i = static_cast<int>(it - keyframes_.begin());
+	int last = static_cast<int>(keyframes_.size()) - 1;
+
+	const CameraKeyframe& k0 = keyframes_[std::max(i - 2, 0)];
+	const CameraKeyframe& k1 = keyframes_[i - 1];
+	const CameraKeyframe& k2 = keyframes_[i];
+	const CameraKeyframe& k3 = keyframes_[std::min(i + 1, last)];
+
+	float segment = k2.time - k1.time;
+	float t = segment > 0.0f ? (time - k1.time) / segment : 0.0f;
+
+	CameraKeyframe result = {};
+	result.time = time;
+	result.position = CatmullRom(k0.position, k1.position, k2.position, k3.position, t);
+	result.orientation = CatmullRom(k0.orientation, k1.orientation, k2.orientation, k3.orientation, t);
+	return result;
+}
+
+/*****************************************************************************************************************************************/
+
+void CameraPathRecorder::record(float dt, const FirstPersonCamera& camera)
+{
+	if (time_ >= nextSample_)
+	{
+		path_.addKeyframe(CameraKeyframe{ time_, camera.getPosition(), camera.getOrientation() });
+		nextSample_ += interval_;
+	}
+	time_ += dt;
+}
+
+/*****************************************************************************************************************************************/
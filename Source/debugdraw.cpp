@@ -1,11 +1,120 @@
 #include "debugdraw.h"
+#include "ogl.h"
+#include "profiler.h"
 
-#include <glad/glad.h>
+#include <cstddef>
 
-std::vector<glm::vec3> GLDebugDraw::points_;
+/*****************************************************************************************************************************************/
+
+std::shared_ptr<GLBuffer> GLDebugDraw::buffer_;
+std::shared_ptr<GLProgram> GLDebugDraw::program_;
+uint32_t GLDebugDraw::vao_ = 0;
+
+GLDebugDraw::DebugVertex* GLDebugDraw::vertices_ = nullptr;
+uint32_t GLDebugDraw::vertexCount_ = 0;
+uint32_t GLDebugDraw::region_ = 0;
+GLsync GLDebugDraw::fences_[kRegionCount] = {};
+
+// Bounds of all instances are opt-in, drawn first they would hide the visible ones
+uint32_t GLDebugDraw::categoryMask_ = ~0u & ~(1u << static_cast<uint32_t>(DebugCategory::Instances));
+bool GLDebugDraw::frameEnabled_ = false;
+
+// RGBA8 packed as little endian ABGR
+static const uint32_t kCategoryColors[] = {
+	0xff404040, // Instances
+	0xff1a1aa8, // Visible
+	0xff1ad8d8, // Frustum
+	0xffd8d8d8, // Misc
+};
+
+static_assert(sizeof(kCategoryColors) / sizeof(kCategoryColors[0]) == static_cast<size_t>(DebugCategory::Count), "Missing category color");
+
+/*****************************************************************************************************************************************/
 
-void GLDebugDraw::addAABB(const glm::vec3& min, const glm::vec3& max)
+void GLDebugDraw::Initialize()
 {
+	uint32_t size = kRegionCount * kMaxVertexCount * sizeof(DebugVertex);
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+	buffer_ = std::make_shared<GLBuffer>(nullptr, size, flags);
+	vertices_ = static_cast<DebugVertex*>(glMapNamedBufferRange(buffer_->getHandle(), 0, size, flags));
+	assert(vertices_ != nullptr);
+
+	glCreateVertexArrays(1, &vao_);
+	glVertexArrayVertexBuffer(vao_, 0, buffer_->getHandle(), 0, sizeof(DebugVertex));
+
+	glEnableVertexArrayAttrib(vao_, 0);
+	glVertexArrayAttribFormat(vao_, 0, 3, GL_FLOAT, GL_FALSE, offsetof(DebugVertex, position));
+	glVertexArrayAttribBinding(vao_, 0, 0);
+
+	glEnableVertexArrayAttrib(vao_, 1);
+	glVertexArrayAttribFormat(vao_, 1, 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(DebugVertex, color));
+	glVertexArrayAttribBinding(vao_, 1, 0);
+
+	program_ = std::make_shared<GLProgram>(GLShader("Assets/Shaders/debug.vert"), GLShader("Assets/Shaders/debug.frag"));
+
+	vertexCount_ = 0;
+	region_ = 0;
+}
+
+/*****************************************************************************************************************************************/
+
+void GLDebugDraw::Shutdown()
+{
+	for (GLsync& fence : fences_)
+	{
+		if (fence)
+			glDeleteSync(fence);
+		fence = nullptr;
+	}
+
+	if (buffer_)
+		glUnmapNamedBuffer(buffer_->getHandle());
+	vertices_ = nullptr;
+	vertexCount_ = 0;
+
+	glDeleteVertexArrays(1, &vao_);
+	vao_ = 0;
+	program_.reset();
+	buffer_.reset();
+}
+
+/*****************************************************************************************************************************************/
+
+GLDebugDraw::DebugVertex* GLDebugDraw::allocate(uint32_t vertexCount, DebugCategory category, uint32_t& color)
+{
+	if (vertices_ == nullptr || !isCategoryEnabled(category) || vertexCount_ + vertexCount > kMaxVertexCount)
+		return nullptr;
+
+	color = kCategoryColors[static_cast<uint32_t>(category)];
+
+	DebugVertex* vertices = vertices_ + region_ * kMaxVertexCount + vertexCount_;
+	vertexCount_ += vertexCount;
+	return vertices;
+}
+
+/*****************************************************************************************************************************************/
+
+void GLDebugDraw::addLine(const glm::vec3& start, const glm::vec3& end, DebugCategory category)
+{
+	uint32_t color;
+	DebugVertex* vertices = allocate(2, category, color);
+	if (vertices == nullptr)
+		return;
+
+	vertices[0] = DebugVertex{ start, color };
+	vertices[1] = DebugVertex{ end, color };
+}
+
+/*****************************************************************************************************************************************/
+
+void GLDebugDraw::addAABB(const glm::vec3& min, const glm::vec3& max, DebugCategory category)
+{
+	uint32_t color;
+	DebugVertex* vertices = allocate(24, category, color);
+	if (vertices == nullptr)
+		return;
+
 	glm::vec3 v0 = min;
 	glm::vec3 v1 = glm::vec3(max.x, min.y, min.z);
 	glm::vec3 v2 = glm::vec3(max.x, min.y, max.z);
@@ -16,25 +125,25 @@ void GLDebugDraw::addAABB(const glm::vec3& min, const glm::vec3& max)
 	glm::vec3 v6 = max;
 	glm::vec3 v7 = glm::vec3(min.x, max.y, max.z);
 
-	points_.push_back(v0), points_.push_back(v1);
-	points_.push_back(v1), points_.push_back(v2);
-	points_.push_back(v2), points_.push_back(v3);
-	points_.push_back(v3), points_.push_back(v0);
-
-	points_.push_back(v4), points_.push_back(v5);
-	points_.push_back(v5), points_.push_back(v6);
-	points_.push_back(v6), points_.push_back(v7);
-	points_.push_back(v7), points_.push_back(v4);
+	const glm::vec3 points[24] = {
+		v0, v1, v1, v2, v2, v3, v3, v0,
+		v4, v5, v5, v6, v6, v7, v7, v4,
+		v0, v4, v1, v5, v2, v6, v3, v7,
+	};
 
-	points_.push_back(v0), points_.push_back(v4);
-	points_.push_back(v1), points_.push_back(v5);
-	points_.push_back(v2), points_.push_back(v6);
-	points_.push_back(v3), points_.push_back(v7);
+	for (int i = 0; i < 24; ++i)
+		vertices[i] = DebugVertex{ points[i], color };
 }
 
+/*****************************************************************************************************************************************/
 
-void GLDebugDraw::addFrustum(glm::vec3* points)
+void GLDebugDraw::addFrustum(glm::vec3* points, DebugCategory category)
 {
+	uint32_t color;
+	DebugVertex* vertices = allocate(24, category, color);
+	if (vertices == nullptr)
+		return;
+
 	glm::vec3 ntl = points[0];
 	glm::vec3 ntr = points[1];
 	glm::vec3 nbl = points[2];
@@ -45,46 +154,57 @@ void GLDebugDraw::addFrustum(glm::vec3* points)
 	glm::vec3 fbl = points[6];
 	glm::vec3 fbr = points[7];
 
-	points_.push_back(nbl), points_.push_back(nbr);
-	points_.push_back(nbr), points_.push_back(fbr);
-	points_.push_back(fbr), points_.push_back(fbl);
-	points_.push_back(fbl), points_.push_back(nbl);
+	const glm::vec3 lines[24] = {
+		nbl, nbr, nbr, fbr, fbr, fbl, fbl, nbl,
+		ntl, ntr, ntr, ftr, ftr, ftl, ftl, ntl,
+		ntl, nbl, ntr, nbr, ftr, fbr, ftl, fbl,
+	};
 
-	points_.push_back(ntl), points_.push_back(ntr);
-	points_.push_back(ntr), points_.push_back(ftr);
-	points_.push_back(ftr), points_.push_back(ftl);
-	points_.push_back(ftl), points_.push_back(ntl);
+	for (int i = 0; i < 24; ++i)
+		vertices[i] = DebugVertex{ lines[i], color };
+}
 
+/*****************************************************************************************************************************************/
 
-	points_.push_back(ntl), points_.push_back(nbl);
-	points_.push_back(ntr), points_.push_back(nbr);
-	points_.push_back(ftr), points_.push_back(fbr);
-	points_.push_back(ftl), points_.push_back(fbl);
+void GLDebugDraw::setCategoryEnabled(DebugCategory category, bool enabled)
+{
+	if (enabled)
+		categoryMask_ |= GetCategoryBit(category);
+	else
+		categoryMask_ &= ~GetCategoryBit(category);
 }
 
 /*****************************************************************************************************************************************/
 
 void GLDebugDraw::draw(float* P, float* V)
 {
-	glUseProgram(0);
-	if (points_.size() == 0)
+	PROFILE_SCOPE("GLDebugDraw::draw");
+	PROFILE_GPU_SCOPE("GLDebugDraw::draw");
+
+	if (vertexCount_ == 0)
 		return;
 
-	glMatrixMode(GL_PROJECTION);
-	glLoadMatrixf(P);
-	glMatrixMode(GL_MODELVIEW);
-	glLoadMatrixf(V);
+	program_->useProgram();
+	program_->setMat4("u_Projection", P);
+	program_->setMat4("u_View", V);
 
-	glColor3f(0.66f, 0.1f, 0.1f);
+	glBindVertexArray(vao_);
 	glLineWidth(2.0f);
-	glBegin(GL_LINES);
-	for (int i = 0; i < points_.size(); i += 2)
+	glDrawArrays(GL_LINES, region_ * kMaxVertexCount, vertexCount_);
+	glLineWidth(1.0f);
+
+	// The next region was last drawn kRegionCount - 1 frames ago, usually long done
+	fences_[region_] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	region_ = (region_ + 1) % kRegionCount;
+	vertexCount_ = 0;
+
+	GLsync& fence = fences_[region_];
+	if (fence)
 	{
-		glVertex3f(points_[i].x, points_[i].y, points_[i].z);
-		glVertex3f(points_[i + 1].x, points_[i + 1].y, points_[i + 1].z);
+		while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+		glDeleteSync(fence);
+		fence = nullptr;
 	}
-	glEnd();
-	glLineWidth(1.0f);
-	points_.clear();
 }
 
+/*****************************************************************************************************************************************/
@@ -126,13 +126,17 @@ void GeometryGenerator::GenerateLTrim(glm::ivec2 vertexCount, float unitSize, Me
     mesh.indexOffset = indexOffset;
     meshData.meshes.push_back(mesh);
 
-    //@TODO Greatly overestimated bounding box !!!
-    BoundingBox boundingBox = {
-        glm::vec3(0.0f, 0.0f, 0.0f),
-        glm::vec3((vertexCount.x - 1) * unitSize, 1.0f, (vertexCount.y - 1) * unitSize)
-	};
-    meshData.boundingBox.push_back(boundingBox);
+    meshData.boundingBox.push_back(GetLTrimBounds(vertexCount, unitSize));
+}
 
+/***********************************************************************************************************************************/
+
+BoundingBox GeometryGenerator::GetLTrimBounds(glm::ivec2 vertexCount, float unitSize)
+{
+    return BoundingBox{
+        glm::vec3(0.0f, 0.0f, 0.0f),
+        glm::vec3((vertexCount.x - 1) * unitSize, 1.0f, vertexCount.y * unitSize)
+    };
 }
 
 /***********************************************************************************************************************************/
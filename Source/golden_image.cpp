@@ -0,0 +1,285 @@
+#include "golden_image.h"
+#include "terrain/terrain.h"
+#include "image_utils.h"
+#include "ogl.h"
+
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <filesystem>
+#include <assert.h>
+
+/*****************************************************************************************************************************************/
+
+static const char* kGoldenHeightmaps[] = { "heightmap1", "grand_canyon" };
+
+// Pitch, yaw and roll as used by FirstPersonCamera
+static const CameraKeyframe kOverviewPose   = { 0.0f, glm::vec3(-50.0f, 400.0f, 2.0f), glm::vec3(-0.5f, 0.0f, 0.0f) };
+static const CameraKeyframe kGrazingPose    = { 0.0f, glm::vec3(-50.0f, 120.0f, 2.0f), glm::vec3(-0.05f, 0.8f, 0.0f) };
+static const CameraKeyframe kTopDownLowPose = { 0.0f, glm::vec3(10.5f, 250.0f, 20.5f), glm::vec3(-1.5f, 0.0f, 0.0f) };
+static const CameraKeyframe kTopDownHighPose = { 0.0f, glm::vec3(300.5f, 3000.0f, -200.5f), glm::vec3(-1.5f, 0.3f, 0.0f) };
+
+// Sentinel clear color for top down views, never produced by the gradient map
+static const uint8_t kCrackColor[3] = { 255, 0, 255 };
+
+// Every ring up to level 6 snaps at a multiple of 64 units, the pair of poses
+// lands on either side of it so that most levels move between the two frames
+static const float kSnapBoundary = 64.0f;
+static const float kSnapOffset = 0.1f;
+
+/*****************************************************************************************************************************************/
+
+static bool FileExists(const char* filename)
+{
+	FILE* file = fopen(filename, "rb");
+	if (file == nullptr)
+		return false;
+	fclose(file);
+	return true;
+}
+
+/*****************************************************************************************************************************************/
+
+static void FlipRows(std::vector<uint8_t>& pixels, int width, int height)
+{
+	int stride = width * 4;
+	std::vector<uint8_t> row(stride);
+	for (int y = 0; y < height / 2; ++y)
+	{
+		uint8_t* top = &pixels[y * stride];
+		uint8_t* bottom = &pixels[(height - 1 - y) * stride];
+		memcpy(row.data(), top, stride);
+		memcpy(top, bottom, stride);
+		memcpy(bottom, row.data(), stride);
+	}
+}
+
+/*****************************************************************************************************************************************/
+
+GoldenImageHarness::GoldenImageHarness(const GoldenImageConfig& config, int width, int height) :
+	config_(config),
+	width_(width),
+	height_(height)
+{
+	assert(width_ > 0 && height_ > 0);
+}
+
+/*****************************************************************************************************************************************/
+
+bool GoldenImageHarness::run(const RenderFunc& render)
+{
+	const GoldenPose poses[] = {
+		{ "overview",     kOverviewPose,    false },
+		{ "grazing",      kGrazingPose,     false },
+		{ "topdown_low",  kTopDownLowPose,  true },
+		{ "topdown_high", kTopDownHighPose, true },
+	};
+
+	float clearColor[4];
+	glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+
+	failureCount_ = 0;
+	createdCount_ = 0;
+	std::vector<uint8_t> pixels;
+	std::vector<uint8_t> otherPixels;
+
+	for (const char* heightmap : kGoldenHeightmaps)
+	{
+		std::string heightmapFile = std::string("Assets/Textures/") + heightmap + ".png";
+		if (!FileExists(heightmapFile.c_str()))
+		{
+			report(false, heightmap, "load", "missing %s", heightmapFile.c_str());
+			continue;
+		}
+
+		// Both vertex paths must produce the same image for every pose
+		auto indexedTerrain = std::make_shared<Terrain>(255, 1.0f, false, heightmapFile.c_str());
+		auto pullingTerrain = std::make_shared<Terrain>(255, 1.0f, true, heightmapFile.c_str());
+
+		for (const GoldenPose& pose : poses)
+		{
+			std::string name = std::string(heightmap) + "_" + pose.name;
+
+			if (pose.topDown)
+				glClearColor(kCrackColor[0] / 255.0f, kCrackColor[1] / 255.0f, kCrackColor[2] / 255.0f, 1.0f);
+			else
+				glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+
+			render(indexedTerrain.get(), pose.pose, pixels);
+			FlipRows(pixels, width_, height_);
+
+			checkReference(name, pixels);
+			if (pose.topDown)
+				checkCracks(name, pixels);
+
+			render(pullingTerrain.get(), pose.pose, otherPixels);
+			FlipRows(otherPixels, width_, height_);
+
+			float rmse = ComputeRMSE(pixels, otherPixels);
+			report(rmse <= config_.pathTolerance, name, "vertex pulling", "rmse %.3f (tolerance %.3f)", rmse, config_.pathTolerance);
+		}
+
+		// Rings snapping under a moving camera must not change the image by more
+		// than the camera motion itself, morphing hides the level transitions
+		glClearColor(kCrackColor[0] / 255.0f, kCrackColor[1] / 255.0f, kCrackColor[2] / 255.0f, 1.0f);
+		CameraKeyframe before = kTopDownLowPose;
+		before.position.x = kSnapBoundary - kSnapOffset;
+		before.position.z = kSnapBoundary - kSnapOffset;
+		CameraKeyframe after = before;
+		after.position.x = kSnapBoundary + kSnapOffset;
+		after.position.z = kSnapBoundary + kSnapOffset;
+
+		std::string name = std::string(heightmap) + "_snap";
+		render(indexedTerrain.get(), before, pixels);
+		render(indexedTerrain.get(), after, otherPixels);
+
+		float rmse = ComputeRMSE(pixels, otherPixels);
+		report(rmse <= config_.popTolerance, name, "morph pop", "rmse %.3f (tolerance %.3f)", rmse, config_.popTolerance);
+		checkCracks(name, otherPixels);
+
+		// The quadtree shares meshes and morphing with the rings, its level changes must be as tight
+		indexedTerrain->setRenderMode(TerrainRenderMode::Quadtree);
+		for (const GoldenPose& pose : poses)
+		{
+			if (!pose.topDown)
+				continue;
+			render(indexedTerrain.get(), pose.pose, pixels);
+			checkCracks(std::string(heightmap) + "_" + pose.name + "_quadtree", pixels);
+		}
+		render(indexedTerrain.get(), after, pixels);
+		checkCracks(name + "_quadtree", pixels);
+	}
+
+	glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+
+	if (failureCount_ == 0 && createdCount_ > 0)
+		fprintf(stdout, "Golden images: all checks passed, %d reference(s) created, run again to compare\n", createdCount_);
+	else if (failureCount_ == 0)
+		fprintf(stdout, "Golden images: all checks passed\n");
+	else
+		fprintf(stdout, "Golden images: %d check(s) failed\n", failureCount_);
+	return failureCount_ == 0;
+}
+
+/*****************************************************************************************************************************************/
+
+bool GoldenImageHarness::checkReference(const std::string& name, const std::vector<uint8_t>& pixels)
+{
+	std::string referencePath = getReferencePath(name, "");
+
+	if (config_.update)
+	{
+		std::error_code error;
+		std::filesystem::create_directories(config_.referenceDir, error);
+
+		bool written = ImageUtils::WritePNG(referencePath.c_str(), width_, height_, 4, pixels.data(), false);
+		report(written, name, "update", "%s", referencePath.c_str());
+		return written;
+	}
+
+	// References depend on the driver and resolution and are not shipped. The first
+	// run on a renderer stores them, later runs compare against them
+	if (!FileExists(referencePath.c_str()))
+	{
+		std::error_code error;
+		std::filesystem::create_directories(config_.referenceDir, error);
+
+		bool written = ImageUtils::WritePNG(referencePath.c_str(), width_, height_, 4, pixels.data(), false);
+		report(written, name, "bootstrap", "created %s, compared from the next run on", referencePath.c_str());
+		if (written)
+			createdCount_++;
+		return written;
+	}
+
+	ImageHeader header = {};
+	unsigned char* data = ImageUtils::LoadImage(referencePath.c_str(), header);
+	if (data == nullptr || header.width != width_ || header.height != height_ || header.nChannel != 4)
+	{
+		report(false, name, "reference", "%s does not match the %dx%d RGBA output", referencePath.c_str(), width_, height_);
+		if (data)
+			ImageUtils::FreeImage(data);
+		return false;
+	}
+
+	std::vector<uint8_t> reference(data, data + width_ * height_ * 4);
+	ImageUtils::FreeImage(data);
+
+	float rmse = ComputeRMSE(pixels, reference);
+	bool passed = rmse <= config_.rmseTolerance;
+	report(passed, name, "reference", "rmse %.3f (tolerance %.3f)", rmse, config_.rmseTolerance);
+
+	// Keep the failing output next to the reference for inspection
+	if (!passed)
+		ImageUtils::WritePNG(getReferencePath(name, "_actual").c_str(), width_, height_, 4, pixels.data(), false);
+	return passed;
+}
+
+/*****************************************************************************************************************************************/
+
+bool GoldenImageHarness::checkCracks(const std::string& name, const std::vector<uint8_t>& pixels)
+{
+	int crackPixels = CountPixels(pixels, kCrackColor);
+	bool passed = crackPixels <= config_.maxCrackPixels;
+	report(passed, name, "cracks", "%d pixel(s) (tolerance %d)", crackPixels, config_.maxCrackPixels);
+	return passed;
+}
+
+/*****************************************************************************************************************************************/
+
+void GoldenImageHarness::report(bool passed, const std::string& name, const char* check, const char* format, ...)
+{
+	if (!passed)
+		failureCount_++;
+
+	char message[512];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+
+	fprintf(passed ? stdout : stderr, "%s %s [%s] %s\n", passed ? "PASS" : "FAIL", name.c_str(), check, message);
+}
+
+/*****************************************************************************************************************************************/
+
+std::string GoldenImageHarness::getReferencePath(const std::string& name, const char* suffix) const
+{
+	return config_.referenceDir + "/" + name + suffix + ".png";
+}
+
+/*****************************************************************************************************************************************/
+
+float GoldenImageHarness::ComputeRMSE(const std::vector<uint8_t>& a, const std::vector<uint8_t>& b)
+{
+	assert(a.size() == b.size());
+	if (a.empty())
+		return 0.0f;
+
+	double sum = 0.0;
+	for (size_t i = 0; i < a.size(); i += 4)
+	{
+		for (int c = 0; c < 3; ++c)
+		{
+			double diff = double(a[i + c]) - double(b[i + c]);
+			sum += diff * diff;
+		}
+	}
+	return static_cast<float>(std::sqrt(sum / double(a.size() / 4 * 3)));
+}
+
+/*****************************************************************************************************************************************/
+
+int GoldenImageHarness::CountPixels(const std::vector<uint8_t>& pixels, const uint8_t color[3])
+{
+	int count = 0;
+	for (size_t i = 0; i < pixels.size(); i += 4)
+	{
+		if (pixels[i] == color[0] && pixels[i + 1] == color[1] && pixels[i + 2] == color[2])
+			count++;
+	}
+	return count;
+}
+
+/*****************************************************************************************************************************************/
@@ -0,0 +1,139 @@
+#include "headless_context.h"
+
+#include <cstdio>
+
+#ifdef TERRAIN_HEADLESS
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+/*****************************************************************************************************************************************/
+
+bool HeadlessContext::IsSupported()
+{
+	return true;
+}
+
+/*****************************************************************************************************************************************/
+
+bool HeadlessContext::create(int majorVersion, int minorVersion)
+{
+	// Prefer the surfaceless platform, it doesn't need a GPU or a display server
+	EGLDisplay display = EGL_NO_DISPLAY;
+	auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getPlatformDisplay)
+		display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+	if (display == EGL_NO_DISPLAY)
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+	EGLint major = 0, minor = 0;
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+	{
+		fprintf(stderr, "Failed to initialize EGL display\n");
+		return false;
+	}
+
+	if (!eglBindAPI(EGL_OPENGL_API))
+	{
+		fprintf(stderr, "EGL doesn't support desktop OpenGL\n");
+		eglTerminate(display);
+		return false;
+	}
+
+	// Default surface type is window which the surfaceless platform doesn't expose
+	const EGLint configAttribs[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_NONE
+	};
+
+	EGLConfig config = nullptr;
+	EGLint configCount = 0;
+	if (!eglChooseConfig(display, configAttribs, &config, 1, &configCount) || configCount == 0)
+	{
+		fprintf(stderr, "Failed to choose EGL config\n");
+		eglTerminate(display);
+		return false;
+	}
+
+	// Compatibility profile to match the window created by GLFW
+	const EGLint contextAttribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, majorVersion,
+		EGL_CONTEXT_MINOR_VERSION, minorVersion,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+		EGL_NONE
+	};
+
+	EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+	if (context == EGL_NO_CONTEXT)
+	{
+		fprintf(stderr, "Failed to create OpenGL %d.%d EGL context\n", majorVersion, minorVersion);
+		eglTerminate(display);
+		return false;
+	}
+
+	// Everything renders into framebuffer objects, no surface is needed
+	if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+	{
+		fprintf(stderr, "Failed to make surfaceless EGL context current\n");
+		eglDestroyContext(display, context);
+		eglTerminate(display);
+		return false;
+	}
+
+	printf("EGL %d.%d %s\n", major, minor, eglQueryString(display, EGL_VENDOR));
+
+	display_ = display;
+	context_ = context;
+	return true;
+}
+
+/*****************************************************************************************************************************************/
+
+void HeadlessContext::destroy()
+{
+	if (display_ == nullptr)
+		return;
+
+	eglMakeCurrent(display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroyContext(display_, context_);
+	eglTerminate(display_);
+
+	display_ = nullptr;
+	context_ = nullptr;
+}
+
+/*****************************************************************************************************************************************/
+
+void* HeadlessContext::GetProcAddress(const char* name)
+{
+	return (void*)eglGetProcAddress(name);
+}
+
+#else
+
+/*****************************************************************************************************************************************/
+
+bool HeadlessContext::IsSupported()
+{
+	return false;
+}
+
+bool HeadlessContext::create(int /*majorVersion*/, int /*minorVersion*/)
+{
+	fprintf(stderr, "Headless mode requires building with TERRAIN_HEADLESS\n");
+	return false;
+}
+
+void HeadlessContext::destroy()
+{
+}
+
+void* HeadlessContext::GetProcAddress(const char* /*name*/)
+{
+	return nullptr;
+}
+
+#endif
+
+/*****************************************************************************************************************************************/
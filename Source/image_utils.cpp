@@ -0,0 +1,117 @@
+#define STB_IMAGE_IMPLEMENTATION
+#include "image_utils.h"
+
+#include <stdint.h>
+#include <algorithm>
+#include <fstream>
+#include <vector>
+
+/*****************************************************************************************************************************************/
+
+static uint32_t Crc32(const uint8_t* data, size_t size, uint32_t crc = 0)
+{
+	static uint32_t table[256] = {};
+	if (table[1] == 0)
+	{
+		for (uint32_t i = 0; i < 256; ++i)
+		{
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k)
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	}
+
+	crc = ~crc;
+	for (size_t i = 0; i < size; ++i)
+		crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void PushBigEndian(std::vector<uint8_t>& out, uint32_t value)
+{
+	out.push_back(static_cast<uint8_t>(value >> 24));
+	out.push_back(static_cast<uint8_t>(value >> 16));
+	out.push_back(static_cast<uint8_t>(value >> 8));
+	out.push_back(static_cast<uint8_t>(value));
+}
+
+static void WriteChunk(std::ofstream& out, const char* type, const std::vector<uint8_t>& data)
+{
+	std::vector<uint8_t> chunk;
+	PushBigEndian(chunk, static_cast<uint32_t>(data.size()));
+	chunk.insert(chunk.end(), type, type + 4);
+	chunk.insert(chunk.end(), data.begin(), data.end());
+	PushBigEndian(chunk, Crc32(chunk.data() + 4, chunk.size() - 4));
+	out.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+}
+
+/*****************************************************************************************************************************************/
+
+bool ImageUtils::WritePNG(const char* filename, int width, int height, int nChannel, const unsigned char* data, bool flipY)
+{
+	static const uint8_t colorTypes[] = { 0, 0, 4, 2, 6 };
+	if (nChannel < 1 || nChannel > 4)
+		return false;
+
+	std::ofstream out(filename, std::ios::binary);
+	if (!out)
+	{
+		fprintf(stderr, "Failed to write image: %s\n", filename);
+		return false;
+	}
+
+	static const uint8_t signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	out.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+
+	std::vector<uint8_t> header;
+	PushBigEndian(header, width);
+	PushBigEndian(header, height);
+	header.push_back(8);
+	header.push_back(colorTypes[nChannel]);
+	header.push_back(0);
+	header.push_back(0);
+	header.push_back(0);
+	WriteChunk(out, "IHDR", header);
+
+	// Scanlines with filter type 0
+	size_t stride = static_cast<size_t>(width) * nChannel;
+	std::vector<uint8_t> raw;
+	raw.reserve((stride + 1) * height);
+	for (int y = 0; y < height; ++y)
+	{
+		int row = flipY ? height - 1 - y : y;
+		raw.push_back(0);
+		raw.insert(raw.end(), data + row * stride, data + (row + 1) * stride);
+	}
+
+	// zlib stream made of stored blocks
+	std::vector<uint8_t> zlib = { 0x78, 0x01 };
+	size_t offset = 0;
+	do
+	{
+		size_t blockSize = std::min<size_t>(raw.size() - offset, 65535);
+		bool last = offset + blockSize == raw.size();
+		zlib.push_back(last ? 1 : 0);
+		zlib.push_back(static_cast<uint8_t>(blockSize));
+		zlib.push_back(static_cast<uint8_t>(blockSize >> 8));
+		zlib.push_back(static_cast<uint8_t>(~blockSize));
+		zlib.push_back(static_cast<uint8_t>(~blockSize >> 8));
+		zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + blockSize);
+		offset += blockSize;
+	} while (offset < raw.size());
+
+	uint32_t a = 1, b = 0;
+	for (uint8_t v : raw)
+	{
+		a = (a + v) % 65521;
+		b = (b + a) % 65521;
+	}
+	PushBigEndian(zlib, (b << 16) | a);
+
+	WriteChunk(out, "IDAT", zlib);
+	WriteChunk(out, "IEND", {});
+	return true;
+}
+
+/*****************************************************************************************************************************************/
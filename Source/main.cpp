@@ -1,15 +1,32 @@
 #include "camera.h"
+#include "camera_path.h"
 #include "debugdraw.h"
+#include "golden_image.h"
+#include "headless_context.h"
+#include "image_utils.h"
 #include "input.h"
 #include "ogl.h"
+#include "profiler.h"
+#include "terrain/clipmap_validator.h"
+#include "terrain/quality_governor.h"
 #include "terrain/terrain.h"
+#include "terrain/terrain_shadows.h"
+#include "terrain/horizon_map.h"
+#include "terrain/terrain_world.h"
 
 
 #include <GLFW/glfw3.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
+#include <thread>
+#include <vector>
 
 
 /**************************************************************************************************************/
@@ -19,8 +36,21 @@ float gOGLVersion;
 struct State {
   int width = 1920;
   int height = 1080;
+  // Stencil counts the fragments passing the depth test, see ReportOverdraw
+  bool countOverdraw = false;
+  // Toggled with P
+  bool depthPrepass = false;
+  // Toggled with O
+  bool shadows = false;
+  // Sun azimuth change in degrees per second
+  float sunSpeed = 0.0f;
+  // Toggled with H
+  bool horizonMap = false;
 } gState;
 
+// Size of the window or offscreen framebuffer the camera renders into
+glm::ivec2 GetViewportSize() { return glm::ivec2(gState.width, gState.height); }
+
 struct PerFrameData {
   glm::mat4 projection;
   glm::mat4 view;
@@ -69,6 +99,15 @@ void KeyCallback(GLFWwindow *window, int key, int scancode, int action,
   if (key == GLFW_KEY_ESCAPE && isDown)
     glfwSetWindowShouldClose(window, true);
 
+  if (key == GLFW_KEY_P && action == GLFW_PRESS)
+    gState.depthPrepass = !gState.depthPrepass;
+
+  if (key == GLFW_KEY_O && action == GLFW_PRESS)
+    gState.shadows = !gState.shadows;
+
+  if (key == GLFW_KEY_H && action == GLFW_PRESS)
+    gState.horizonMap = !gState.horizonMap;
+
   Input::SetState(key, isDown, mods);
 }
 
@@ -81,30 +120,513 @@ void CursorPositionCb(GLFWwindow *window, double x, double y) {
 }
 
 /**************************************************************************************************************/
-int main() {
-  std::cout << "Working Directory: " << std::filesystem::current_path()
-            << std::endl;
-  if (!glfwInit())
-    glfwInit();
 
-  glfwSetErrorCallback(GLFWErrorCallback);
-  GLFWwindow *window =
-      glfwCreateWindow(gState.width, gState.height, "Hello World", 0, 0);
+double GetTime() {
+  // Same clock for the window and the headless path, GLFW isn't initialized
+  // when running without a display
+  static const auto start = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+void PrintTimingSummary(std::vector<float> frameTimes, std::ostream &out) {
+  if (frameTimes.empty())
+    return;
+
+  std::sort(frameTimes.begin(), frameTimes.end());
+  float total = 0.0f;
+  for (float frameTime : frameTimes)
+    total += frameTime;
+
+  auto percentile = [&frameTimes](float p) {
+    size_t index = static_cast<size_t>(p * (frameTimes.size() - 1));
+    return frameTimes[index] * 1000.0f;
+  };
+
+  out << "Frames: " << frameTimes.size()
+            << " mean: " << total / frameTimes.size() * 1000.0f << "ms"
+            << " p50: " << percentile(0.5f) << "ms"
+            << " p95: " << percentile(0.95f) << "ms"
+            << " p99: " << percentile(0.99f) << "ms"
+            << " max: " << frameTimes.back() * 1000.0f << "ms" << std::endl;
+}
+
+void RenderFrame(const std::function<void()> &drawTerrain,
+                 const GLBuffer &perFrameDataBuffer, bool wireframe) {
+  if (wireframe)
+    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+  else
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+
+  glViewport(0, 0, gState.width, gState.height);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+
+  if (gState.countOverdraw) {
+    glEnable(GL_STENCIL_TEST);
+    glStencilFunc(GL_ALWAYS, 0, 0xff);
+    glStencilOp(GL_KEEP, GL_KEEP, GL_INCR);
+  }
+
+  // Update PerFrameData
+  gPerFrameData.projection = camera.getProjectionMatrix();
+  gPerFrameData.view = camera.getViewMatrix();
+  gPerFrameData.VP = gPerFrameData.projection * gPerFrameData.view;
+  gPerFrameData.cameraPosition = glm::vec4(camera.getPosition(), 1.0f);
+  glNamedBufferSubData(perFrameDataBuffer.getHandle(), 0, sizeof(PerFrameData),
+                       &gPerFrameData);
+
+  // Draw
+  drawTerrain();
+  glDisable(GL_STENCIL_TEST);
+
+  if (wireframe)
+    GLDebugDraw::draw(&gPerFrameData.projection[0][0],
+                      &gPerFrameData.view[0][0]);
+}
+
+void RenderFrame(Terrain *terrain, const GLBuffer &perFrameDataBuffer,
+                 bool wireframe) {
+  RenderFrame([terrain]() { terrain->draw(); }, perFrameDataBuffer, wireframe);
+}
+
+// Islands on a grid around the origin, cycling through the bundled heightmaps
+std::vector<TerrainDesc> CreateIslandDescs(int count) {
+  const char *heightmaps[] = {"Assets/Textures/heightmap1.png",
+                              "Assets/Textures/heightmap2.png",
+                              "Assets/Textures/grand_canyon.png"};
+  // Centers snap to the coarsest tile of 2048 units, an empty tile between two
+  const float spacing = 2.0f * 2048.0f;
+  int columns = static_cast<int>(std::ceil(std::sqrt(float(count))));
+
+  std::vector<TerrainDesc> terrains;
+  for (int i = 0; i < count; ++i) {
+    TerrainDesc terrain;
+    terrain.heightmapFile = heightmaps[i % 3];
+    terrain.center = glm::vec2(i % columns, i / columns) * spacing;
+    terrain.maxHeight = 150.0f + 50.0f * (i % 3);
+    terrains.push_back(terrain);
+  }
+  return terrains;
+}
+
+// Print how many times each covered pixel was shaded in the last frame, a fragment
+// rejected by the depth test is not counted. The heatmap goes from blue for a
+// single write through green and yellow to red for four and more
+void ReportOverdraw(const GLFramebuffer &framebuffer, const char *label,
+                    std::vector<uint8_t> *heatmap) {
+  std::vector<uint8_t> stencil;
+  framebuffer.readStencil(stencil);
+
+  uint64_t coveredPixels = 0;
+  uint64_t fragments = 0;
+  int maxCount = 0;
+  for (uint8_t count : stencil) {
+    coveredPixels += count > 0 ? 1 : 0;
+    fragments += count;
+    maxCount = std::max(maxCount, int(count));
+  }
+
+  std::cout << "Overdraw " << label << ": " << fragments << " fragments over "
+            << coveredPixels << " pixels, " << std::fixed
+            << std::setprecision(3)
+            << (coveredPixels > 0 ? double(fragments) / coveredPixels : 0.0)
+            << " per pixel, max " << maxCount << std::endl;
+
+  if (heatmap == nullptr)
+    return;
+
+  const uint8_t colors[5][3] = {
+      {0, 0, 0}, {0, 0, 255}, {0, 255, 0}, {255, 255, 0}, {255, 0, 0}};
+  heatmap->resize(stencil.size() * 4);
+  for (size_t i = 0; i < stencil.size(); ++i) {
+    const uint8_t *color = colors[std::min(int(stencil[i]), 4)];
+    (*heatmap)[i * 4 + 0] = color[0];
+    (*heatmap)[i * 4 + 1] = color[1];
+    (*heatmap)[i * 4 + 2] = color[2];
+    (*heatmap)[i * 4 + 3] = 255;
+  }
+}
+
+// Time Terrain::update, placement, culling and upload, over a full turn of the
+// camera with the debug hooks off and then recording every category
+void RunCullingBenchmark(Terrain *terrain, int iterations) {
+#ifdef TERRAIN_DEBUG_DRAW
+  std::cout << "Debug draw compiled in" << std::endl;
+#else
+  std::cout << "Debug draw compiled out" << std::endl;
+#endif
+
+  const char *names[] = {"debug off", "debug on"};
+  for (int pass = 0; pass < 2; ++pass) {
+    for (int category = 0; category < int(DebugCategory::Count); ++category)
+      GLDebugDraw::setCategoryEnabled(DebugCategory(category), pass == 1);
+    GLDebugDraw::setFrameEnabled(pass == 1);
+
+    std::vector<float> updateTimes;
+    for (int i = 0; i < iterations; ++i) {
+      float yaw = glm::radians(360.0f) * i / iterations;
+      camera.setPose(glm::vec3(-50.0f, 400.0f, 2.0f),
+                     glm::vec3(-0.5f, yaw, 0.0f));
+
+      double start = GetTime();
+      terrain->update(&camera, GetViewportSize(), 0.0f);
+      updateTimes.push_back(static_cast<float>(GetTime() - start));
+
+      // Nothing is drawn, drop the lines before the next update
+      GLDebugDraw::clear();
+    }
+
+    std::cout << names[pass] << ": ";
+    PrintTimingSummary(updateTimes, std::cout);
+  }
+
+  GLDebugDraw::setFrameEnabled(false);
+  for (int category = 0; category < int(DebugCategory::Count); ++category)
+    GLDebugDraw::setCategoryEnabled(DebugCategory(category), false);
+
+  // Flat per block tests against ring and quadrant tests first, per yaw sector
+  // so that views along the axes and the diagonals can be told apart
+  const int kSectorCount = 8;
+  double sectorTimes[2][kSectorCount] = {};
+  uint64_t sectorBounds[2][kSectorCount] = {};
+  uint64_t sectorVisible[2][kSectorCount] = {};
+  int sectorSamples[kSectorCount] = {};
+
+  for (int i = 0; i < iterations; ++i) {
+    float yaw = glm::radians(360.0f) * i / iterations;
+    int sector = std::min(i * kSectorCount / iterations, kSectorCount - 1);
+    camera.setPose(glm::vec3(-50.0f, 400.0f, 2.0f),
+                   glm::vec3(-0.5f, yaw, 0.0f));
+    sectorSamples[sector]++;
+
+    for (int mode = 0; mode < 2; ++mode) {
+      terrain->setHierarchicalCulling(mode == 1);
+
+      double start = GetTime();
+      terrain->update(&camera, GetViewportSize(), 0.0f);
+      sectorTimes[mode][sector] += GetTime() - start;
+
+      const TerrainStats &stats = terrain->getStats();
+      sectorBounds[mode][sector] += stats.boundsTested;
+      sectorVisible[mode][sector] +=
+          stats.instancesGenerated - stats.instancesCulled;
+    }
+  }
+  terrain->setHierarchicalCulling(true);
+
+  std::cout << std::endl
+            << "yaw      flat ms  tests  ring ms  tests  visible" << std::endl;
+  for (int sector = 0; sector < kSectorCount; ++sector) {
+    int samples = std::max(sectorSamples[sector], 1);
+    std::cout << std::setw(3) << sector * 360 / kSectorCount << "-"
+              << std::setw(3) << (sector + 1) * 360 / kSectorCount
+              << std::fixed << std::setprecision(3) << std::setw(10)
+              << sectorTimes[0][sector] * 1000.0 / samples << std::setw(7)
+              << sectorBounds[0][sector] / samples << std::setw(9)
+              << sectorTimes[1][sector] * 1000.0 / samples << std::setw(7)
+              << sectorBounds[1][sector] / samples << std::setw(9)
+              << sectorVisible[1][sector] / samples << std::endl;
+
+    // Both modes must keep the same blocks
+    if (sectorVisible[0][sector] != sectorVisible[1][sector])
+      std::cout << "  visible mismatch, flat "
+                << sectorVisible[0][sector] / samples << std::endl;
+  }
+}
+
+// Orthographic views of a directional light around consecutive slices of the
+// camera frustum, split logarithmically like shadow cascades
+std::vector<glm::mat4> CreateCascadeViews(const Camera &viewCamera,
+                                          const glm::vec3 &lightDirection,
+                                          int cascadeCount, float maxDistance) {
+  std::vector<glm::mat4> views;
+  float zNear = viewCamera.getZNear();
+  float ratio = maxDistance / zNear;
+  for (int i = 0; i < cascadeCount; ++i) {
+    float sliceNear = zNear * std::pow(ratio, float(i) / cascadeCount);
+    float sliceFar = zNear * std::pow(ratio, float(i + 1) / cascadeCount);
+
+    Frustum slice;
+    slice.generate(glm::perspective(viewCamera.getFOV(),
+                                    viewCamera.getAspectRatio(), sliceNear,
+                                    sliceFar) *
+                   viewCamera.getViewMatrix());
+
+    glm::vec3 center = glm::vec3(0.0f);
+    for (const glm::vec3 &point : slice.frustumPoints_)
+      center += point / 8.0f;
+    float radius = 0.0f;
+    for (const glm::vec3 &point : slice.frustumPoints_)
+      radius = std::max(radius, glm::length(point - center));
+
+    // Deep enough to keep the terrain between the light and the slice
+    float depth = radius + 2000.0f;
+    glm::mat4 view =
+        glm::lookAt(center - lightDirection * depth, center,
+                    glm::vec3(0.0f, 1.0f, 0.0f));
+    views.push_back(
+        glm::ortho(-radius, radius, -radius, radius, 0.0f, depth + radius) *
+        view);
+  }
+  return views;
+}
+
+// Time one placement per view against a single placement culled against all
+// the views, the camera and four cascades of a low sun, over a turn of the camera.
+// The camera alone goes through the plain update, so the blocks every view of the
+// shared pass keeps are checked against the single view culling
+void RunViewBenchmark(Terrain *terrain, int iterations) {
+  const glm::vec3 lightDirection =
+      glm::normalize(glm::vec3(0.6f, -0.4f, 0.3f));
+  std::vector<float> separateTimes;
+  std::vector<float> sharedTimes;
+  const int kViewCount = 5;
+  uint64_t visible[kViewCount] = {};
+  int mismatches = 0;
+
+  for (int i = 0; i < iterations; ++i) {
+    float yaw = glm::radians(360.0f) * i / iterations;
+    camera.setPose(glm::vec3(-50.0f, 400.0f, 2.0f),
+                   glm::vec3(-0.5f, yaw, 0.0f));
+
+    std::vector<glm::mat4> views = {camera.getProjectionMatrix() *
+                                    camera.getViewMatrix()};
+    std::vector<glm::mat4> cascades =
+        CreateCascadeViews(camera, lightDirection, kViewCount - 1, 2000.0f);
+    views.insert(views.end(), cascades.begin(), cascades.end());
+
+    std::vector<std::vector<uint64_t>> separateBlocks(views.size());
+    double start = GetTime();
+    for (size_t view = 0; view < views.size(); ++view) {
+      if (view == 0)
+        terrain->update(&camera, GetViewportSize(), 0.0f);
+      else
+        terrain->updateViews(&camera, GetViewportSize(), {views[view]}, 0.0f);
+      terrain->getViewInstances(0, separateBlocks[view]);
+    }
+    separateTimes.push_back(static_cast<float>(GetTime() - start));
+
+    start = GetTime();
+    terrain->updateViews(&camera, GetViewportSize(), views, 0.0f);
+    sharedTimes.push_back(static_cast<float>(GetTime() - start));
+
+    // Every view must see the same blocks either way, the order within a mesh
+    // type may differ between equally distant blocks
+    std::vector<uint64_t> sharedBlocks;
+    for (size_t view = 0; view < views.size(); ++view) {
+      terrain->getViewInstances(int(view), sharedBlocks);
+      visible[view] += sharedBlocks.size();
+      std::sort(sharedBlocks.begin(), sharedBlocks.end());
+      std::sort(separateBlocks[view].begin(), separateBlocks[view].end());
+      if (sharedBlocks != separateBlocks[view])
+        mismatches++;
+    }
+  }
+
+  std::cout << "separate: ";
+  PrintTimingSummary(separateTimes, std::cout);
+  std::cout << "shared:   ";
+  PrintTimingSummary(sharedTimes, std::cout);
+  std::cout << "visible per view, camera first:";
+  for (int view = 0; view < kViewCount; ++view)
+    std::cout << " " << visible[view] / iterations;
+  std::cout << std::endl;
+  if (mismatches > 0)
+    std::cout << mismatches << " views differ from single view culling"
+              << std::endl;
+}
+
+// Time a full horizon bake and the rebake around a small edit, blocking and then
+// in the background batches Terrain::update starts once per 16ms frame, timing
+// the calls on this thread
+void RunHorizonBenchmark(Terrain *terrain) {
+  terrain->setHorizonMap(true);
+  HorizonMap *horizonMap = terrain->getHorizonMap();
+  const Heightfield &heightfield = terrain->getHeightfield();
+
+  int tileCount = horizonMap->getPendingTileCount();
+  double start = GetTime();
+  horizonMap->bake();
+  std::cout << "Baked " << tileCount << " horizon tiles in "
+            << (GetTime() - start) * 1000.0 << "ms" << std::endl;
+
+  int x = heightfield.getWidth() / 2;
+  int y = heightfield.getHeight() / 2;
+  horizonMap->invalidate(x, y, x + 16, y + 16);
+  tileCount = horizonMap->getPendingTileCount();
+  start = GetTime();
+  horizonMap->bake();
+  std::cout << "Baked " << tileCount
+            << " horizon tiles around a 16x16 edit in "
+            << (GetTime() - start) * 1000.0 << "ms" << std::endl;
+
+  horizonMap->invalidate(x, y, x + 16, y + 16);
+  std::vector<float> updateTimes;
+  start = GetTime();
+  while (true) {
+    double updateStart = GetTime();
+    int left = horizonMap->update(4);
+    updateTimes.push_back(static_cast<float>(GetTime() - updateStart));
+    if (left == 0)
+      break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(16));
+  }
+  std::cout << "Baked the edit in the background in "
+            << (GetTime() - start) * 1000.0 << "ms, update calls: ";
+  PrintTimingSummary(updateTimes, std::cout);
+}
+
+/**************************************************************************************************************/
+int main(int argc, char **argv) {
+  // Command line
+  bool useGovernor = false;
+  QualityGovernorConfig governorConfig = {};
+  std::string traceFile;
+  std::string statsFile;
+  std::string recordFile;
+  std::string replayFile;
+  float replayDt = 1.0f / 60.0f;
+  bool headless = false;
+  int frameCount = 0;
+  std::string outputFile = "frame.png";
+  std::string timingFile;
+  GoldenImageConfig goldenConfig = {};
+  bool golden = false;
+  int validateCount = 0;
+  int benchCullingCount = 0;
+  int benchViewCount = 0;
+  bool benchHorizon = false;
+  int worldTerrainCount = 0;
+  TerrainRenderMode renderMode = TerrainRenderMode::Clipmap;
+  bool frontToBack = true;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--governor") {
+      useGovernor = true;
+      if (i + 1 < argc && argv[i + 1][0] != '-')
+        governorConfig.targetFrameTime = (float)std::atof(argv[++i]);
+    } else if (arg == "--profile" && i + 1 < argc) {
+      traceFile = argv[++i];
+    } else if (arg == "--stats" && i + 1 < argc) {
+      statsFile = argv[++i];
+    } else if (arg == "--record" && i + 1 < argc) {
+      recordFile = argv[++i];
+    } else if (arg == "--replay" && i + 1 < argc) {
+      replayFile = argv[++i];
+    } else if (arg == "--replay-dt" && i + 1 < argc) {
+      replayDt = (float)std::atof(argv[++i]);
+    } else if (arg == "--headless") {
+      headless = true;
+    } else if (arg == "--frames" && i + 1 < argc) {
+      frameCount = std::atoi(argv[++i]);
+    } else if (arg == "--output" && i + 1 < argc) {
+      outputFile = argv[++i];
+    } else if (arg == "--timing" && i + 1 < argc) {
+      timingFile = argv[++i];
+    } else if (arg == "--golden") {
+      golden = true;
+      if (i + 1 < argc && argv[i + 1][0] != '-')
+        goldenConfig.referenceDir = argv[++i];
+    } else if (arg == "--golden-update") {
+      golden = true;
+      goldenConfig.update = true;
+    } else if (arg == "--bench-culling") {
+      benchCullingCount = 1000;
+      if (i + 1 < argc && argv[i + 1][0] != '-')
+        benchCullingCount = std::atoi(argv[++i]);
+    } else if (arg == "--bench-views") {
+      benchViewCount = 1000;
+      if (i + 1 < argc && argv[i + 1][0] != '-')
+        benchViewCount = std::atoi(argv[++i]);
+    } else if (arg == "--bench-horizon") {
+      benchHorizon = true;
+    } else if (arg == "--tessellation") {
+      renderMode = TerrainRenderMode::Tessellation;
+    } else if (arg == "--quadtree") {
+      renderMode = TerrainRenderMode::Quadtree;
+    } else if (arg == "--overdraw") {
+      gState.countOverdraw = true;
+    } else if (arg == "--unordered") {
+      frontToBack = false;
+    } else if (arg == "--depth-prepass") {
+      gState.depthPrepass = true;
+    } else if (arg == "--shadows") {
+      gState.shadows = true;
+    } else if (arg == "--horizon") {
+      gState.horizonMap = true;
+    } else if (arg == "--sun-speed" && i + 1 < argc) {
+      gState.sunSpeed = (float)std::atof(argv[++i]);
+    } else if (arg == "--world" && i + 1 < argc) {
+      worldTerrainCount = std::atoi(argv[++i]);
+    } else if (arg == "--validate-clipmap" && i + 1 < argc) {
+      validateCount = std::atoi(argv[++i]);
+    } else if (arg == "--size" && i + 2 < argc) {
+      gState.width = std::atoi(argv[++i]);
+      gState.height = std::atoi(argv[++i]);
+    }
+  }
 
-  if (window == nullptr) {
-    fprintf(stderr, "Failed to Create Window");
-    return 0;
+  // Check the ring layout on the CPU only, no context is created
+  if (validateCount > 0) {
+    TerrainParams params = {255, 1.0f, 12, 200.0f, 0.0f, 0.1f};
+    ClipmapValidator validator(params, [&params](const glm::vec2 &p) {
+      return (std::sin(p.x * 0.37f) * std::cos(p.y * 0.23f) * 0.5f + 0.5f) *
+             params.maxHeight;
+    });
+    double start = GetTime();
+    int failureCount = validator.fuzz(validateCount, 1234u, 100000.0f);
+    std::cout << "Validated " << validateCount << " camera positions in "
+              << (GetTime() - start) * 1000.0 << "ms" << std::endl;
+    return failureCount == 0 ? 0 : 1;
   }
 
-  glfwMakeContextCurrent(window);
+  // Replay drives the camera with a fixed timestep so runs are comparable
+  CameraPath cameraPath;
+  bool replaying = !replayFile.empty();
+  if (replaying && !cameraPath.load(replayFile.c_str()))
+    return 1;
 
-  // Set GLFW Callback
-  glfwSetWindowSizeCallback(window, WindowResizeCb);
-  glfwSetKeyCallback(window, KeyCallback);
-  glfwSetMouseButtonCallback(window, MouseCallback);
-  glfwSetCursorPosCallback(window, CursorPositionCb);
-  glfwSwapInterval(1);
-  gladLoadGLLoader((GLADloadproc)glfwGetProcAddress);
+  Profiler::SetEnabled(!traceFile.empty());
+  Profiler::SetThreadName("Main");
+
+  std::cout << "Working Directory: " << std::filesystem::current_path()
+            << std::endl;
+  GLFWwindow *window = nullptr;
+  HeadlessContext headlessContext;
+  if (headless) {
+    // Surfaceless context, everything renders into an offscreen framebuffer
+    if (!headlessContext.create(4, 5))
+      return 1;
+    gladLoadGLLoader((GLADloadproc)HeadlessContext::GetProcAddress);
+
+    // A static camera renders a single frame unless told otherwise
+    if (frameCount == 0 && !replaying)
+      frameCount = 1;
+  } else {
+    if (!glfwInit())
+      glfwInit();
+
+    glfwSetErrorCallback(GLFWErrorCallback);
+    window =
+        glfwCreateWindow(gState.width, gState.height, "Hello World", 0, 0);
+
+    if (window == nullptr) {
+      fprintf(stderr, "Failed to Create Window");
+      return 0;
+    }
+
+    glfwMakeContextCurrent(window);
+
+    // Set GLFW Callback
+    glfwSetWindowSizeCallback(window, WindowResizeCb);
+    glfwSetKeyCallback(window, KeyCallback);
+    glfwSetMouseButtonCallback(window, MouseCallback);
+    glfwSetCursorPosCallback(window, CursorPositionCb);
+    // Vsync would pin the frame time and hide the real cost from the governor
+    // and from replayed benchmark runs
+    glfwSwapInterval(useGovernor || replaying ? 0 : 1);
+    gladLoadGLLoader((GLADloadproc)glfwGetProcAddress);
+  }
 
   // Enable Debug Output
   glEnable(GL_DEBUG_OUTPUT);
@@ -124,72 +646,243 @@ int main() {
   glCullFace(GL_BACK);
   glClearColor(0.5f, 0.7f, 1.0f, 1.0f);
 
+  GLDebugDraw::Initialize();
+
+  // Offscreen target for headless runs and image comparisons
+  std::unique_ptr<GLFramebuffer> framebuffer;
+  if (headless || golden)
+    framebuffer = std::make_unique<GLFramebuffer>(gState.width, gState.height);
+  camera.setAspect(gState.width / (float)gState.height);
+
   // Global Uniform Buffer
   GLBuffer perFrameDataBuffer(nullptr, sizeof(PerFrameData),
                               GL_DYNAMIC_STORAGE_BIT);
   glBindBufferRange(GL_UNIFORM_BUFFER, 0, perFrameDataBuffer.getHandle(), 0,
                     sizeof(PerFrameData));
 
-  // Terrain
-  std::shared_ptr<Terrain> terrain = std::make_shared<Terrain>(255, 1.0f);
+  // Several terrains sharing one clipmap, drawn instead of the single terrain
+  std::unique_ptr<TerrainWorld> world;
+  std::shared_ptr<Terrain> terrain;
+  if (worldTerrainCount > 0) {
+    world = std::make_unique<TerrainWorld>(
+        255, 1.0f, CreateIslandDescs(worldTerrainCount));
+  } else {
+    terrain = std::make_shared<Terrain>(255, 1.0f);
+    terrain->setRenderMode(renderMode);
+    terrain->setFrontToBack(frontToBack);
+  }
+
+  // Baked up front when asked for on the command line, toggled later it bakes
+  // in the background over the next frames
+  if (terrain && gState.horizonMap) {
+    terrain->setHorizonMap(true);
+    terrain->getHorizonMap()->bake();
+  }
+
+  // Scales terrain quality to hold the frame budget
+  std::unique_ptr<QualityGovernor> governor;
+  if (terrain && useGovernor)
+    governor = std::make_unique<QualityGovernor>(terrain.get(), governorConfig);
+
+  // Per frame geometry counters dumped as csv
+  std::unique_ptr<TerrainStatsRecorder> statsRecorder;
+  if (!statsFile.empty())
+    statsRecorder = std::make_unique<TerrainStatsRecorder>(statsFile.c_str());
+  uint64_t frameIndex = 0;
+
+  std::unique_ptr<CameraPathRecorder> pathRecorder;
+  if (!recordFile.empty())
+    pathRecorder = std::make_unique<CameraPathRecorder>();
+  float replayTime = 0.0f;
+  std::vector<float> frameTimes;
+
+  float sunAzimuth = 0.0f;
+  uint64_t shadowFrameCount = 0;
 
   float dt = 0.016f;
-  float startTime = static_cast<float>(glfwGetTime());
+  float startTime = static_cast<float>(GetTime());
   bool wireframe = true;
 
   camera.setZFar(10000);
   camera.setZNear(0.9f);
 
-  while (!glfwWindowShouldClose(window)) {
-    if (Input::IsKeyDown(GLFW_KEY_SPACE))
-      wireframe = true;
-    else
-      wireframe = false;
-
-    if (wireframe)
-      glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-    else
-      glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+  bool running = true;
+  int exitCode = 0;
 
-    glViewport(0, 0, gState.width, gState.height);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  // The benchmarks measure the single terrain
+  if (terrain && benchCullingCount > 0) {
+    RunCullingBenchmark(terrain.get(), benchCullingCount);
+    running = false;
+  }
 
-    // Update Camera
-    camera.update(dt);
-    terrain->update(&camera, dt);
+  if (terrain && benchViewCount > 0) {
+    RunViewBenchmark(terrain.get(), benchViewCount);
+    running = false;
+  }
 
-    // Update PerFrameData
-    gPerFrameData.projection = camera.getProjectionMatrix();
-    gPerFrameData.view = camera.getViewMatrix();
-    gPerFrameData.VP = gPerFrameData.projection * gPerFrameData.view;
-    gPerFrameData.cameraPosition = glm::vec4(camera.getPosition(), 1.0f);
-    glNamedBufferSubData(perFrameDataBuffer.getHandle(), 0,
-                         sizeof(PerFrameData), &gPerFrameData);
+  if (terrain && benchHorizon) {
+    RunHorizonBenchmark(terrain.get());
+    running = false;
+  }
 
-    // Draw
-    terrain->draw();
+  // Render fixed poses and compare them instead of running interactively
+  if (golden) {
+    GoldenImageHarness harness(goldenConfig, gState.width, gState.height);
+    bool passed = harness.run([&](Terrain *goldenTerrain,
+                                  const CameraKeyframe &pose,
+                                  std::vector<uint8_t> &pixels) {
+      framebuffer->bind();
+      camera.setPose(pose.position, pose.orientation);
+      goldenTerrain->update(&camera, GetViewportSize(), 0.0f);
+      RenderFrame(goldenTerrain, perFrameDataBuffer, false);
+      framebuffer->readPixels(pixels);
+    });
+    exitCode = passed ? 0 : 1;
+    running = false;
+  }
 
-    if (wireframe)
-      GLDebugDraw::draw(&gPerFrameData.projection[0][0],
-                        &gPerFrameData.view[0][0]);
+  while (running && (window == nullptr || !glfwWindowShouldClose(window))) {
+    ProfileScope frameScope("Frame");
 
-    glfwPollEvents();
+    if (framebuffer)
+      framebuffer->bind();
 
-    float delta = static_cast<float>(glfwGetTime()) - startTime;
-    glfwSwapBuffers(window);
+    if (Input::IsKeyDown(GLFW_KEY_SPACE))
+      wireframe = true;
+    else
+      wireframe = false;
+    GLDebugDraw::setFrameEnabled(wireframe);
 
-    float endTime = static_cast<float>(glfwGetTime());
+    // Update Camera
+    float updateDt = dt;
+    if (replaying) {
+      CameraKeyframe pose = cameraPath.evaluate(replayTime);
+      camera.setPose(pose.position, pose.orientation);
+      updateDt = replayDt;
+      replayTime += replayDt;
+    } else {
+      PROFILE_SCOPE("FirstPersonCamera::update");
+      camera.update(dt);
+    }
+
+    if (pathRecorder)
+      pathRecorder->record(dt, camera);
+
+    if (world) {
+      world->update(&camera, GetViewportSize(), updateDt);
+      RenderFrame([&world]() { world->draw(); }, perFrameDataBuffer,
+                  wireframe);
+    } else {
+      terrain->setDepthPrepass(gState.depthPrepass);
+      terrain->setShadows(gState.shadows);
+      terrain->setHorizonMap(gState.horizonMap);
+      if (terrain->getShadows()) {
+        // Same elevation as the unshadowed light, turning around the up axis
+        sunAzimuth += glm::radians(gState.sunSpeed) * updateDt;
+        terrain->getShadows()->setLightDirection(glm::vec3(
+            std::sin(sunAzimuth), 1.0f, -std::cos(sunAzimuth)));
+        shadowFrameCount++;
+      }
+      terrain->update(&camera, GetViewportSize(), updateDt);
+      RenderFrame(terrain.get(), perFrameDataBuffer, wireframe);
+    }
+
+    float delta = 0.0f;
+    if (window) {
+      glfwPollEvents();
+
+      delta = static_cast<float>(GetTime()) - startTime;
+      {
+        PROFILE_SCOPE("glfwSwapBuffers");
+        glfwSwapBuffers(window);
+      }
+    } else {
+      // Nothing paces the headless loop, wait for the GPU to get real timings
+      delta = static_cast<float>(GetTime()) - startTime;
+      PROFILE_SCOPE("glFinish");
+      glFinish();
+    }
+    Profiler::EndFrame();
+
+    float endTime = static_cast<float>(GetTime());
     dt = endTime - startTime;
     startTime = endTime;
 
+    if (governor)
+      governor->update(dt);
+
+    if (statsRecorder)
+      statsRecorder->record(frameIndex, dt,
+                            world ? world->getStats() : terrain->getStats());
+    frameIndex++;
+
+    if (replaying || headless)
+      frameTimes.push_back(dt);
+    if (replaying && frameCount == 0 && replayTime > cameraPath.getDuration())
+      running = false;
+    if (frameCount > 0 && frameIndex >= static_cast<uint64_t>(frameCount))
+      running = false;
+
+    if (window == nullptr)
+      continue;
+
     std::stringstream ss;
     ss << "frameTime: " << std::setprecision(3) << dt * 1000.0f << "ms  "
        << "renderTime: " << std::setprecision(3) << delta * 1000.0f << "ms ";
+    if (governor)
+      ss << "quality: " << governor->getLevel() << " ";
     glfwSetWindowTitle(window, ss.str().c_str());
   }
 
-  glfwDestroyWindow(window);
-  glfwTerminate();
+  if (replaying || headless)
+    PrintTimingSummary(frameTimes, std::cout);
+  if (terrain && terrain->getShadows() && shadowFrameCount > 0)
+    std::cout << "Shadow cascades drawn per frame: "
+              << double(terrain->getShadows()->getRenderedCascadeCount()) /
+                     shadowFrameCount
+              << std::endl;
+  if (!timingFile.empty()) {
+    std::ofstream timingOut(timingFile);
+    PrintTimingSummary(frameTimes, timingOut);
+  }
+
+  if (framebuffer && frameIndex > 0) {
+    std::vector<uint8_t> pixels;
+    if (gState.countOverdraw) {
+      // The heatmap replaces the color output, the last frame is drawn again
+      // with the other instance order to compare against
+      ReportOverdraw(*framebuffer, frontToBack ? "front to back" : "unordered",
+                     &pixels);
+      if (terrain) {
+        terrain->setFrontToBack(!frontToBack);
+        terrain->update(&camera, GetViewportSize(), 0.0f);
+        RenderFrame(terrain.get(), perFrameDataBuffer, false);
+        ReportOverdraw(*framebuffer,
+                       frontToBack ? "unordered" : "front to back", nullptr);
+        terrain->setFrontToBack(frontToBack);
+      }
+    } else
+      framebuffer->readPixels(pixels);
+    ImageUtils::WritePNG(outputFile.c_str(), framebuffer->getWidth(),
+                         framebuffer->getHeight(), 4, pixels.data(), true);
+  }
+  if (pathRecorder)
+    pathRecorder->getPath().save(recordFile.c_str());
+
+  // Waits for the background bakes, their last scopes make it into the trace
+  governor.reset();
+  world.reset();
+  terrain.reset();
+  if (!traceFile.empty())
+    Profiler::WriteChromeTrace(traceFile.c_str());
+  Profiler::Shutdown();
+  framebuffer.reset();
+  GLDebugDraw::Shutdown();
+
+  if (window) {
+    glfwDestroyWindow(window);
+    glfwTerminate();
+  }
 
-  return 0;
+  return exitCode;
 }
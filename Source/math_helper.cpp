@@ -55,13 +55,52 @@ void Frustum::generate(Camera* camera)
 	pl[FARP].set3Points(ftr, ftl, fbl);
 	*/
 
-	// generate plane from the point
-	frustumPlanes_[Top].generateFromPoints(frustumPoints_[FTL], frustumPoints_[NTL], frustumPoints_[NTR]);
-	frustumPlanes_[Bottom].generateFromPoints(frustumPoints_[FBR], frustumPoints_[NBR], frustumPoints_[NBL]);
-	frustumPlanes_[Left].generateFromPoints(frustumPoints_[FBL], frustumPoints_[NBL], frustumPoints_[NTL]);
-	frustumPlanes_[Right].generateFromPoints(frustumPoints_[FBR], frustumPoints_[NTR], frustumPoints_[NBR]);
-	frustumPlanes_[Near].generateFromPoints(frustumPoints_[NBR], frustumPoints_[NTR], frustumPoints_[NTL]);
-	frustumPlanes_[Far].generateFromPoints(frustumPoints_[FBL], frustumPoints_[FTL], frustumPoints_[FTR]);
+	generatePlanes(camera->getProjectionMatrix() * camera->getViewMatrix());
+}
+
+/***************************************************************************************************************************/
+
+void Frustum::generate(const glm::mat4& viewProjection)
+{
+	// Corners of the clip space cube taken back to world space, works for
+	// orthographic projections (shadow cascades) as well
+	const glm::mat4 inverse = glm::inverse(viewProjection);
+	const glm::vec3 corners[8] = {
+		glm::vec3(-1.0f,  1.0f, -1.0f), glm::vec3(1.0f,  1.0f, -1.0f),
+		glm::vec3(-1.0f, -1.0f, -1.0f), glm::vec3(1.0f, -1.0f, -1.0f),
+		glm::vec3(-1.0f,  1.0f,  1.0f), glm::vec3(1.0f,  1.0f,  1.0f),
+		glm::vec3(-1.0f, -1.0f,  1.0f), glm::vec3(1.0f, -1.0f,  1.0f)
+	};
+
+	for (int i = 0; i < 8; ++i)
+	{
+		glm::vec4 p = inverse * glm::vec4(corners[i], 1.0f);
+		frustumPoints_[i] = glm::vec3(p) / p.w;
+	}
+
+	generatePlanes(viewProjection);
+}
+
+/***************************************************************************************************************************/
+
+void Frustum::generatePlanes(const glm::mat4& viewProjection)
+{
+	// Planes straight from the rows of the matrix. Planes through three corners lose
+	// too much precision with a far/near ratio in the thousands, the near corners
+	// are too close together next to the far ones, and the side planes ended up
+	// units away from the camera position
+	const glm::vec4 row0 = glm::vec4(viewProjection[0][0], viewProjection[1][0], viewProjection[2][0], viewProjection[3][0]);
+	const glm::vec4 row1 = glm::vec4(viewProjection[0][1], viewProjection[1][1], viewProjection[2][1], viewProjection[3][1]);
+	const glm::vec4 row2 = glm::vec4(viewProjection[0][2], viewProjection[1][2], viewProjection[2][2], viewProjection[3][2]);
+	const glm::vec4 row3 = glm::vec4(viewProjection[0][3], viewProjection[1][3], viewProjection[2][3], viewProjection[3][3]);
+
+	const glm::vec4 planes[6] = { row3 - row1, row3 + row1, row3 + row0, row3 - row0, row3 + row2, row3 - row2 };
+	const PlaneLocation locations[6] = { Top, Bottom, Left, Right, Near, Far };
+	for (int i = 0; i < 6; ++i)
+	{
+		float length = glm::length(glm::vec3(planes[i]));
+		frustumPlanes_[locations[i]] = Plane(glm::vec3(planes[i]) / length, planes[i].w / length);
+	}
 }
 
 /***************************************************************************************************************************/
@@ -90,4 +129,43 @@ bool Frustum::intersect(const BoundingBox& boundingBox)
 	return true;
 }
 
+/***************************************************************************************************************************/
+
+Frustum::Containment Frustum::classify(const BoundingBox& boundingBox)
+{
+	const glm::vec3 min = boundingBox.min_;
+	const glm::vec3 max = boundingBox.max_;
+
+	Containment result = Containment::Inside;
+	for (int i = 0; i < 6; ++i)
+	{
+		// Corner farthest along the normal and the opposite one
+		glm::vec3 p = min;
+		glm::vec3 n = max;
+		const Plane& plane = frustumPlanes_[i];
+		if (plane.normal.x >= 0)
+		{
+			p.x = max.x;
+			n.x = min.x;
+		}
+		if (plane.normal.y >= 0)
+		{
+			p.y = max.y;
+			n.y = min.y;
+		}
+		if (plane.normal.z >= 0)
+		{
+			p.z = max.z;
+			n.z = min.z;
+		}
+
+		if (plane.getDistance(p) < 0.0f)
+			return Containment::Outside;
+		if (plane.getDistance(n) < 0.0f)
+			result = Containment::Intersect;
+	}
+
+	return result;
+}
+
 /***************************************************************************************************************************/
\ No newline at end of file
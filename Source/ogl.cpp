@@ -1,7 +1,10 @@
 #include "ogl.h"
 
 #include <string>
+#include <cstring>
 #include <fstream>
+#include <cmath>
+#include <algorithm>
 #include "debugdraw.h"
 
 /*****************************************************************************************************************************************/
@@ -59,6 +62,25 @@ GLShader::GLShader(const char* filename) :
 {
 }
 
+static std::string InsertShaderDefines(std::string shaderCode, const std::vector<std::string>& defines)
+{
+	// Defines have to follow #version, which must stay the first statement
+	std::string defineCode;
+	for (const std::string& define : defines)
+		defineCode += "#define " + define + "\n";
+
+	size_t versionEnd = 0;
+	if (shaderCode.compare(0, 8, "#version") == 0)
+		versionEnd = shaderCode.find('\n') + 1;
+	return shaderCode.insert(versionEnd, defineCode);
+}
+
+GLShader::GLShader(const char* filename, const std::vector<std::string>& defines) :
+	GLShader(GetShaderTypeFromFile(filename),
+		InsertShaderDefines(ReadShaderFile(filename), defines).c_str())
+{
+}
+
 GLShader::GLShader(GLenum type, const char* shaderCode) : 
 	type_(type),
 	handle_(glCreateShader(type_))
@@ -118,6 +140,18 @@ GLProgram::GLProgram(GLShader a, GLShader b, GLShader c) :
 	printProgramInfoLog(handle_);
 }
 
+GLProgram::GLProgram(GLShader a, GLShader b, GLShader c, GLShader d) :
+	handle_(glCreateProgram())
+{
+	glAttachShader(handle_, a.getHandle());
+	glAttachShader(handle_, b.getHandle());
+	glAttachShader(handle_, c.getHandle());
+	glAttachShader(handle_, d.getHandle());
+	glLinkProgram(handle_);
+
+	printProgramInfoLog(handle_);
+}
+
 
 void GLProgram::setTexture(std::string name, int binding, unsigned int textureId)
 {
@@ -141,6 +175,11 @@ void GLProgram::setVec2(std::string name, float x, float y)
 	glUniform2f(glGetUniformLocation(handle_, name.c_str()), x, y);
 }
 
+void GLProgram::setMat4(std::string name, const float* matrix)
+{
+	glUniformMatrix4fv(glGetUniformLocation(handle_, name.c_str()), 1, GL_FALSE, matrix);
+}
+
 /*****************************************************************************************************************************************/
 
 GLComputeProgram::GLComputeProgram(GLShader shader) :
@@ -206,7 +245,7 @@ GLMesh::GLMesh(const MeshData& meshData) :
 	drawCommands.resize(numCommand * sizeof(DrawElementsIndirectCommand) + sizeof(GLsizei));
 
 	GLsizei drawCount = numCommand;
-	memcpy_s(drawCommands.data(), sizeof(GLsizei), &drawCount, sizeof(GLsizei));
+	memcpy(drawCommands.data(), &drawCount, sizeof(GLsizei));
 
 	commands = reinterpret_cast<DrawElementsIndirectCommand*>(drawCommands.data() + sizeof(GLsizei));
 	for (uint32_t i = 0; i < numCommand; ++i)
@@ -221,9 +260,9 @@ GLMesh::GLMesh(const MeshData& meshData) :
 
 /*****************************************************************************************************************************************/
 
-void GLMesh::draw() const
+void GLMesh::draw(uint32_t firstInstance) const
 {
-	GLsizei baseInstance = 0;
+	GLsizei baseInstance = static_cast<GLsizei>(firstInstance);
 
 	for (uint32_t i = 0; i < meshCount_; ++i)
 	{
@@ -242,6 +281,50 @@ void GLMesh::draw() const
 	glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (const void*)sizeof(GLsizei), meshCount_, 0);
 }
 
+/*****************************************************************************************************************************************/
+
+GLProceduralMesh::GLProceduralMesh(unsigned int meshCount) :
+
+	bufferIndirect_(nullptr, meshCount * sizeof(DrawArraysIndirectCommand) + sizeof(GLsizei), GL_DYNAMIC_STORAGE_BIT),
+
+	meshCount_(meshCount)
+{
+	// Core profile still requires a bound VAO even without any attribute
+	glCreateVertexArrays(1, &vao_);
+
+	drawCommands.resize(meshCount * sizeof(DrawArraysIndirectCommand) + sizeof(GLsizei));
+
+	GLsizei drawCount = meshCount;
+	memcpy(drawCommands.data(), &drawCount, sizeof(GLsizei));
+
+	commands = reinterpret_cast<DrawArraysIndirectCommand*>(drawCommands.data() + sizeof(GLsizei));
+	for (uint32_t i = 0; i < meshCount; ++i)
+		commands[i] = DrawArraysIndirectCommand{ 0, 0, 0, 0 };
+}
+
+/*****************************************************************************************************************************************/
+
+void GLProceduralMesh::draw(uint32_t firstInstance) const
+{
+	GLsizei baseInstance = static_cast<GLsizei>(firstInstance);
+
+	for (uint32_t i = 0; i < meshCount_; ++i)
+	{
+		commands[i].baseInstance_ = baseInstance;
+		baseInstance += commands[i].instanceCount_;
+	}
+
+	glNamedBufferSubData(bufferIndirect_.getHandle(), 0, drawCommands.size(), drawCommands.data());
+
+	glBindVertexArray(vao_);
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, bufferIndirect_.getHandle());
+
+	glBindBuffer(GL_PARAMETER_BUFFER, bufferIndirect_.getHandle());
+
+	glMultiDrawArraysIndirect(GL_TRIANGLES, (const void*)sizeof(GLsizei), meshCount_, 0);
+}
+
 /*****************************************************************************************************************************************/
 static GLenum GetTextureFilter(TextureFilter filter)
 {
@@ -253,6 +336,8 @@ static GLenum GetTextureFilter(TextureFilter filter)
 		return GL_NEAREST;
 	case TextureFilter::LinearMipmap:
 		return GL_LINEAR_MIPMAP_LINEAR;
+	case TextureFilter::NearestMipmap:
+		return GL_NEAREST_MIPMAP_NEAREST;
 	default:
 		return GL_LINEAR;
 	}
@@ -281,6 +366,16 @@ static TextureFormatInfo GetTextureFormatInfo(TextureFormat format)
 		result.internalFormat = GL_R16F;
 		result.type = GL_FLOAT;
 		break;
+	case TextureFormat::RG16_SNORM:
+		result.format = GL_RG;
+		result.internalFormat = GL_RG16_SNORM;
+		result.type = GL_SHORT;
+		break;
+	case TextureFormat::RG32F:
+		result.format = GL_RG;
+		result.internalFormat = GL_RG32F;
+		result.type = GL_FLOAT;
+		break;
 	case TextureFormat::RGB8:
 		result.format = GL_RGB;
 		result.internalFormat =  GL_RGB8;
@@ -306,17 +401,148 @@ static TextureFormatInfo GetTextureFormatInfo(TextureFormat format)
 GLTexture::GLTexture(const void* data, const TextureParams& params) : 
 	width_(params.width),
 	height_(params.height),
+	depth_(params.depth),
+	target_(params.type == TextureType::Texture2DArray ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D),
 	formatInfo_(GetTextureFormatInfo(params.format))
 {
-	glCreateTextures(GL_TEXTURE_2D, 1, &handle_);
+	glCreateTextures(target_, 1, &handle_);
 	glTextureParameteri(handle_, GL_TEXTURE_MIN_FILTER, GetTextureFilter(params.minFilter));
 	glTextureParameteri(handle_, GL_TEXTURE_MAG_FILTER, GetTextureFilter(params.magFilter));
 	glTextureParameteri(handle_, GL_TEXTURE_WRAP_S, GetTextureWrap(params.wrapS));
 	glTextureParameteri(handle_, GL_TEXTURE_WRAP_T, GetTextureWrap(params.wrapT));
 
-	glTextureStorage2D(handle_, 1, formatInfo_.internalFormat, params.width, params.height);
+	int levels = 1;
+	if (params.minFilter == TextureFilter::LinearMipmap || params.minFilter == TextureFilter::NearestMipmap)
+		levels = static_cast<int>(std::log2(std::max(params.width, params.height))) + 1;
+
+	if (target_ == GL_TEXTURE_2D_ARRAY)
+		glTextureStorage3D(handle_, levels, formatInfo_.internalFormat, params.width, params.height, params.depth);
+	else
+		glTextureStorage2D(handle_, levels, formatInfo_.internalFormat, params.width, params.height);
+
 	if(data)
-		glTextureSubImage2D(handle_, 0, 0, 0, params.width, params.height, formatInfo_.format, formatInfo_.type, data);
+		setLayer(0, data);
 }
 
-/*****************************************************************************************************************************************/
\ No newline at end of file
+/*****************************************************************************************************************************************/
+
+void GLTexture::setLayer(int layer, const void* data)
+{
+	assert(layer >= 0 && layer < depth_);
+	if (target_ == GL_TEXTURE_2D_ARRAY)
+		glTextureSubImage3D(handle_, 0, 0, 0, layer, width_, height_, 1, formatInfo_.format, formatInfo_.type, data);
+	else
+		glTextureSubImage2D(handle_, 0, 0, 0, width_, height_, formatInfo_.format, formatInfo_.type, data);
+}
+
+/*****************************************************************************************************************************************/
+
+void GLTexture::generateMipmaps()
+{
+	glGenerateTextureMipmap(handle_);
+}
+
+/*****************************************************************************************************************************************/
+
+void GLTexture::setMipLevel(int level, const void* data, int layer)
+{
+	assert(layer >= 0 && layer < depth_);
+	int width = std::max(width_ >> level, 1);
+	int height = std::max(height_ >> level, 1);
+	if (target_ == GL_TEXTURE_2D_ARRAY)
+		glTextureSubImage3D(handle_, level, 0, 0, layer, width, height, 1, formatInfo_.format, formatInfo_.type, data);
+	else
+		glTextureSubImage2D(handle_, level, 0, 0, width, height, formatInfo_.format, formatInfo_.type, data);
+}
+
+/*****************************************************************************************************************************************/
+
+void GLTexture::setRegion(int x, int y, int width, int height, const void* data, int layer, int level)
+{
+	assert(layer >= 0 && layer < depth_);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	if (target_ == GL_TEXTURE_2D_ARRAY)
+		glTextureSubImage3D(handle_, level, x, y, layer, width, height, 1, formatInfo_.format, formatInfo_.type, data);
+	else
+		glTextureSubImage2D(handle_, level, x, y, width, height, formatInfo_.format, formatInfo_.type, data);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+/*****************************************************************************************************************************************/
+
+uint64_t GLTexture::getBindlessHandle()
+{
+	assert(GLAD_GL_ARB_bindless_texture);
+	if (bindlessHandle_ == 0)
+	{
+		bindlessHandle_ = glGetTextureHandleARB(handle_);
+		glMakeTextureHandleResidentARB(bindlessHandle_);
+	}
+	return bindlessHandle_;
+}
+
+/*****************************************************************************************************************************************/
+
+GLTexture::~GLTexture()
+{
+	if (bindlessHandle_ != 0)
+		glMakeTextureHandleNonResidentARB(bindlessHandle_);
+	glDeleteTextures(1, &handle_);
+}
+
+/*****************************************************************************************************************************************/
+
+GLFramebuffer::GLFramebuffer(int width, int height) :
+	width_(width),
+	height_(height)
+{
+	glCreateTextures(GL_TEXTURE_2D, 1, &colorTexture_);
+	glTextureParameteri(colorTexture_, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTextureParameteri(colorTexture_, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTextureStorage2D(colorTexture_, 1, GL_RGBA8, width, height);
+
+	glCreateRenderbuffers(1, &depthStencil_);
+	glNamedRenderbufferStorage(depthStencil_, GL_DEPTH24_STENCIL8, width, height);
+
+	glCreateFramebuffers(1, &handle_);
+	glNamedFramebufferTexture(handle_, GL_COLOR_ATTACHMENT0, colorTexture_, 0);
+	glNamedFramebufferRenderbuffer(handle_, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depthStencil_);
+
+	GLenum status = glCheckNamedFramebufferStatus(handle_, GL_FRAMEBUFFER);
+	if (status != GL_FRAMEBUFFER_COMPLETE)
+	{
+		printf("Incomplete framebuffer: 0x%x\n", status);
+		assert(0);
+	}
+}
+
+void GLFramebuffer::bind() const
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, handle_);
+}
+
+void GLFramebuffer::readPixels(std::vector<uint8_t>& pixels) const
+{
+	pixels.resize(static_cast<size_t>(width_) * height_ * 4);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glNamedFramebufferReadBuffer(handle_, GL_COLOR_ATTACHMENT0);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, handle_);
+	glReadPixels(0, 0, width_, height_, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+}
+
+void GLFramebuffer::readStencil(std::vector<uint8_t>& stencil) const
+{
+	stencil.resize(static_cast<size_t>(width_) * height_);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, handle_);
+	glReadPixels(0, 0, width_, height_, GL_STENCIL_INDEX, GL_UNSIGNED_BYTE, stencil.data());
+}
+
+GLFramebuffer::~GLFramebuffer()
+{
+	glDeleteFramebuffers(1, &handle_);
+	glDeleteRenderbuffers(1, &depthStencil_);
+	glDeleteTextures(1, &colorTexture_);
+}
+
+/*****************************************************************************************************************************************/
@@ -0,0 +1,310 @@
+#include "profiler.h"
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*****************************************************************************************************************************************/
+
+bool Profiler::enabled_ = false;
+
+namespace {
+
+	// Single producer ring buffer, only the owning thread writes and bumps head.
+	// Readers take a snapshot of head so they never block the producer
+	struct ThreadBuffer
+	{
+		static const uint32_t kCapacity = 1 << 16;
+
+		ProfileEvent events[kCapacity];
+		std::atomic<uint64_t> head{ 0 };
+		uint32_t threadId = 0;
+		std::string name;
+		// A live thread records into it, under gRegistryMutex
+		bool owned = false;
+
+		void push(const ProfileEvent& evt)
+		{
+			uint64_t index = head.load(std::memory_order_relaxed);
+			events[index % kCapacity] = evt;
+			head.store(index + 1, std::memory_order_release);
+		}
+	};
+
+	// A thread takes a buffer on the first event it records, so threads that never
+	// record while profiling is enabled cost nothing. An exiting thread hands its
+	// buffer back to the pool with the events still in it, the next thread to record
+	// continues the same track. Short lived workers thus need no more buffers than
+	// ever ran at once, and a buffer is only freed once no thread records into it
+	std::mutex gRegistryMutex;
+	std::vector<std::unique_ptr<ThreadBuffer>> gThreadBuffers;
+	std::vector<ThreadBuffer*> gFreeBuffers;
+	uint32_t gNextThreadId = 1;
+
+	// Must hold gRegistryMutex
+	ThreadBuffer* CreateThreadBuffer(const std::string& name)
+	{
+		gThreadBuffers.push_back(std::make_unique<ThreadBuffer>());
+		ThreadBuffer* buffer = gThreadBuffers.back().get();
+		buffer->threadId = gNextThreadId++;
+		buffer->name = name;
+		buffer->owned = true;
+		return buffer;
+	}
+
+	ThreadBuffer* AcquireThreadBuffer(const std::string& name)
+	{
+		std::lock_guard<std::mutex> lock(gRegistryMutex);
+		if (gFreeBuffers.empty())
+			return CreateThreadBuffer(name);
+
+		ThreadBuffer* buffer = gFreeBuffers.back();
+		gFreeBuffers.pop_back();
+		buffer->name = name;
+		buffer->owned = true;
+		return buffer;
+	}
+
+	void ReleaseThreadBuffer(ThreadBuffer* buffer)
+	{
+		std::lock_guard<std::mutex> lock(gRegistryMutex);
+		buffer->owned = false;
+		gFreeBuffers.push_back(buffer);
+	}
+
+	// Hands the buffer back when its thread exits
+	struct ThreadBufferOwner
+	{
+		ThreadBuffer* buffer = nullptr;
+
+		~ThreadBufferOwner()
+		{
+			if (buffer != nullptr)
+				ReleaseThreadBuffer(buffer);
+		}
+	};
+
+	thread_local ThreadBufferOwner tThreadBuffer;
+	thread_local std::string tThreadName = "Worker";
+
+	const auto gStartTime = std::chrono::steady_clock::now();
+
+	ThreadBuffer* GetThreadBuffer()
+	{
+		if (tThreadBuffer.buffer == nullptr)
+			tThreadBuffer.buffer = AcquireThreadBuffer(tThreadName);
+		return tThreadBuffer.buffer;
+	}
+
+	// GPU scopes, written only from the GL thread into their own track. Each scope is
+	// a pair of GL_TIMESTAMP queries rather than a GL_TIME_ELAPSED query, timestamps
+	// don't exclude each other so scopes nest like the CPU ones
+	struct GpuQuery
+	{
+		GLuint begin;
+		GLuint end;
+		const char* name;
+		int64_t cpuStart;
+	};
+
+	ThreadBuffer* gGpuBuffer = nullptr;
+	std::vector<GLuint> gFreeQueries;
+	std::vector<GpuQuery> gPendingQueries;
+	// Scopes begun but not ended yet, innermost last
+	std::vector<GpuQuery> gQueryStack;
+
+	GLuint AcquireQuery()
+	{
+		if (gFreeQueries.empty())
+		{
+			GLuint handle = 0;
+			glGenQueries(1, &handle);
+			return handle;
+		}
+
+		GLuint handle = gFreeQueries.back();
+		gFreeQueries.pop_back();
+		return handle;
+	}
+
+	void WriteEscaped(std::ofstream& out, const char* str)
+	{
+		for (const char* c = str; *c; ++c)
+		{
+			if (*c == '"' || *c == '\\')
+				out << '\\';
+			out << *c;
+		}
+	}
+}
+
+/*****************************************************************************************************************************************/
+
+void Profiler::SetThreadName(const char* name)
+{
+	tThreadName = name;
+
+	// Renames the buffer if the thread already recorded
+	if (tThreadBuffer.buffer != nullptr)
+	{
+		std::lock_guard<std::mutex> lock(gRegistryMutex);
+		tThreadBuffer.buffer->name = name;
+	}
+}
+
+/*****************************************************************************************************************************************/
+
+int64_t Profiler::Now()
+{
+	auto elapsed = std::chrono::steady_clock::now() - gStartTime;
+	return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
+/*****************************************************************************************************************************************/
+
+void Profiler::RecordCpu(const char* name, int64_t start, int64_t end)
+{
+	GetThreadBuffer()->push(ProfileEvent{ name, start, end - start });
+}
+
+/*****************************************************************************************************************************************/
+
+void Profiler::BeginGpu(const char* name)
+{
+	GpuQuery query = GpuQuery{ AcquireQuery(), AcquireQuery(), name, Now() };
+	glQueryCounter(query.begin, GL_TIMESTAMP);
+	gQueryStack.push_back(query);
+}
+
+/*****************************************************************************************************************************************/
+
+void Profiler::EndGpu()
+{
+	if (gQueryStack.empty())
+		return;
+
+	GpuQuery query = gQueryStack.back();
+	gQueryStack.pop_back();
+	glQueryCounter(query.end, GL_TIMESTAMP);
+	gPendingQueries.push_back(query);
+}
+
+/*****************************************************************************************************************************************/
+
+void Profiler::EndFrame()
+{
+	if (gPendingQueries.empty())
+		return;
+
+	// A track of its own, owned by the GL thread until Shutdown
+	if (gGpuBuffer == nullptr)
+	{
+		std::lock_guard<std::mutex> lock(gRegistryMutex);
+		gGpuBuffer = CreateThreadBuffer("GPU");
+	}
+
+	// Scopes are pending in the order they ended, which is the order their end
+	// timestamps complete in, stop at the first one still in flight
+	size_t resolved = 0;
+	for (; resolved < gPendingQueries.size(); ++resolved)
+	{
+		const GpuQuery& query = gPendingQueries[resolved];
+
+		GLint available = 0;
+		glGetQueryObjectiv(query.end, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			break;
+
+		GLuint64 begin = 0;
+		GLuint64 end = 0;
+		glGetQueryObjectui64v(query.begin, GL_QUERY_RESULT, &begin);
+		glGetQueryObjectui64v(query.end, GL_QUERY_RESULT, &end);
+
+		// GPU timeline is not calibrated, events are placed at their CPU submission
+		gGpuBuffer->push(ProfileEvent{ query.name, query.cpuStart, static_cast<int64_t>((end - begin) / 1000) });
+		gFreeQueries.push_back(query.begin);
+		gFreeQueries.push_back(query.end);
+	}
+	gPendingQueries.erase(gPendingQueries.begin(), gPendingQueries.begin() + resolved);
+}
+
+/*****************************************************************************************************************************************/
+
+bool Profiler::WriteChromeTrace(const char* filename)
+{
+	std::ofstream out(filename);
+	if (!out)
+	{
+		fprintf(stderr, "Failed to write trace: %s\n", filename);
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(gRegistryMutex);
+
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	bool first = true;
+	for (const auto& buffer : gThreadBuffers)
+	{
+		if (!first)
+			out << ",\n";
+		first = false;
+
+		out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->threadId << ",\"args\":{\"name\":\"";
+		WriteEscaped(out, buffer->name.c_str());
+		out << "\"}}";
+
+		// Only the last kCapacity events survive in the ring
+		uint64_t head = buffer->head.load(std::memory_order_acquire);
+		uint64_t begin = head > ThreadBuffer::kCapacity ? head - ThreadBuffer::kCapacity : 0;
+		for (uint64_t i = begin; i < head; ++i)
+		{
+			const ProfileEvent& evt = buffer->events[i % ThreadBuffer::kCapacity];
+			out << ",\n{\"name\":\"";
+			WriteEscaped(out, evt.name);
+			out << "\",\"cat\":\"" << (buffer.get() == gGpuBuffer ? "gpu" : "cpu") << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->threadId
+				<< ",\"ts\":" << evt.start << ",\"dur\":" << evt.duration << "}";
+		}
+	}
+	out << "\n]}\n";
+
+	return true;
+}
+
+/*****************************************************************************************************************************************/
+
+void Profiler::Shutdown()
+{
+	for (const std::vector<GpuQuery>* queries : { &gPendingQueries, &gQueryStack })
+	{
+		for (const GpuQuery& query : *queries)
+		{
+			gFreeQueries.push_back(query.begin);
+			gFreeQueries.push_back(query.end);
+		}
+	}
+	gPendingQueries.clear();
+	gQueryStack.clear();
+
+	if (!gFreeQueries.empty())
+		glDeleteQueries(static_cast<GLsizei>(gFreeQueries.size()), gFreeQueries.data());
+	gFreeQueries.clear();
+
+	// Threads still running keep recording into their buffers, those are freed at exit
+	std::lock_guard<std::mutex> lock(gRegistryMutex);
+	if (gGpuBuffer != nullptr)
+		gGpuBuffer->owned = false;
+	gGpuBuffer = nullptr;
+	gFreeBuffers.clear();
+	gThreadBuffers.erase(std::remove_if(gThreadBuffers.begin(), gThreadBuffers.end(),
+		[](const std::unique_ptr<ThreadBuffer>& buffer) { return !buffer->owned; }), gThreadBuffers.end());
+}
+
+/*****************************************************************************************************************************************/
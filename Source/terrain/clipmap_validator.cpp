@@ -0,0 +1,328 @@
+#include "terrain/clipmap_validator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <assert.h>
+
+/*****************************************************************************************************************************************/
+
+// Allowed height difference along a seam relative to the height range
+static const float kSeamTolerance = 1e-4f;
+
+// Block corners must land this close to the level grid, relative to the level cell size
+// since the rotation of the trim adds an error proportional to the block size
+static const float kGridTolerance = 1e-3f;
+
+/*****************************************************************************************************************************************/
+
+static bool Overlaps(int64_t aMin, int64_t aMax, int64_t bMin, int64_t bMax)
+{
+	return aMin < bMax && bMin < aMax;
+}
+
+/*****************************************************************************************************************************************/
+
+static int64_t GetArea(int64_t minX, int64_t minY, int64_t maxX, int64_t maxY)
+{
+	return (maxX - minX) * (maxY - minY);
+}
+
+/*****************************************************************************************************************************************/
+
+ClipmapValidator::ClipmapValidator(const TerrainParams& params, HeightFunc heightFunc) :
+	params_(params),
+	heightFunc_(heightFunc)
+{
+	assert(((params_.vertexCount + 1) & params_.vertexCount) == 0);
+	assert(heightFunc_);
+}
+
+/*****************************************************************************************************************************************/
+
+ClipmapValidationResult ClipmapValidator::validate(const glm::vec3& cameraPosition, int finestLevel)
+{
+	ClipmapValidationResult result = {};
+
+	instances_.clear();
+	TerrainGeometry::GenerateLocations(params_, cameraPosition, instances_, nullptr, finestLevel);
+
+	// The layout is checked on what main.vert decodes from the packed instances
+	glm::vec2 origin = TerrainGeometry::GetInstanceOrigin(params_, cameraPosition);
+	for (auto& instance : instances_)
+	{
+		TerrainGeometry::TerrainData unpacked = TerrainGeometry::UnpackInstance(
+			TerrainGeometry::PackInstance(instance, origin, params_.unitSize), origin, params_.unitSize);
+		if (unpacked.translate != instance.translate || unpacked.scale != instance.scale || unpacked.id.x != instance.id.x)
+		{
+			result.coverageErrors++;
+			if (result.message.empty())
+				result.message = "instance changed by the packed encoding";
+		}
+		instance = unpacked;
+	}
+
+	levelRects_.resize(params_.maxClipLevelCount);
+	for (auto& rects : levelRects_)
+		rects.clear();
+
+	for (const auto& instance : instances_)
+	{
+		int level = static_cast<int>(std::lround(std::log2(instance.scale.x)));
+		if (level < 0 || level >= params_.maxClipLevelCount || float(1 << level) != instance.scale.x || instance.scale.x != instance.scale.y)
+		{
+			result.coverageErrors++;
+			if (result.message.empty())
+				result.message = "instance with invalid scale " + std::to_string(instance.scale.x);
+			continue;
+		}
+		expandInstance(instance, levelRects_[level], result);
+	}
+
+	for (int level = 0; level < finestLevel; ++level)
+	{
+		if (!levelRects_[level].empty() && result.message.empty())
+			result.message = "level " + std::to_string(level) + ": generated below the finest level";
+		result.coverageErrors += static_cast<int>(levelRects_[level].size());
+	}
+
+	GridRect bounds = {};
+	for (int level = finestLevel; level < params_.maxClipLevelCount; ++level)
+	{
+		GridRect hole = bounds;
+		validateLevel(level, levelRects_[level], level > finestLevel ? &hole : nullptr, bounds, result);
+		if (level + 1 < params_.maxClipLevelCount)
+			validateSeam(level, bounds, cameraPosition, result);
+	}
+
+	return result;
+}
+
+/*****************************************************************************************************************************************/
+
+int ClipmapValidator::fuzz(int iterationCount, uint32_t seed, float range)
+{
+	std::mt19937 generator(seed);
+	std::uniform_real_distribution<float> distribution(-range, range);
+	std::uniform_int_distribution<int> levelDistribution(0, std::min(3, params_.maxClipLevelCount - 1));
+
+	int failureCount = 0;
+	float maxSeamError = 0.0f;
+	for (int i = 0; i < iterationCount; ++i)
+	{
+		glm::vec3 cameraPosition = glm::vec3(distribution(generator), params_.maxHeight, distribution(generator));
+		int finestLevel = levelDistribution(generator);
+		ClipmapValidationResult result = validate(cameraPosition, finestLevel);
+		maxSeamError = std::max(maxSeamError, result.maxSeamError);
+
+		if (!result.isValid())
+		{
+			if (failureCount == 0)
+				fprintf(stderr, "Clipmap invalid at (%.3f, %.3f) from level %d: %d coverage, %d seam error(s), %s\n",
+					cameraPosition.x, cameraPosition.z, finestLevel, result.coverageErrors, result.seamErrors, result.message.c_str());
+			failureCount++;
+		}
+	}
+
+	fprintf(stdout, "Clipmap validation: %d/%d camera positions failed, max seam error %.5f\n", failureCount, iterationCount, maxSeamError);
+	return failureCount;
+}
+
+/*****************************************************************************************************************************************/
+
+float ClipmapValidator::getMorphedHeight(const glm::vec2& position, float scale, const glm::vec3& cameraPosition) const
+{
+	// Must match main.vert, fully morphed vertices are collapsed onto the coarser
+	// vertex there which leaves the surface and therefore this height unchanged
+	const float gridSize = params_.vertexCount * scale * params_.unitSize;
+	const float transitionWidth = gridSize * params_.transitionRegionWidth;
+
+	const float morphEnd = TerrainGeometry::GetLodRange(params_) * scale - 1.0f;
+
+	glm::vec2 alpha = (glm::abs(position - glm::vec2(cameraPosition.x, cameraPosition.z)) - (morphEnd - transitionWidth)) / transitionWidth;
+	alpha = glm::clamp(alpha, glm::vec2(0.0f), glm::vec2(1.0f));
+	float morphFactor = std::max(alpha.x, alpha.y);
+
+	// zf and zd as Heightfield::generateMorphLevels bakes them, GLSL mod is always positive
+	float zf = heightFunc_(position);
+	float zd = 0.0f;
+	float period = scale * 2.0f * params_.unitSize;
+	glm::vec2 modPos = position - period * glm::floor(position / period);
+	if (glm::length(modPos) > 0.5f)
+		zd = (heightFunc_(position + modPos) + heightFunc_(position - modPos)) * 0.5f - zf;
+	return zf + morphFactor * zd;
+}
+
+/*****************************************************************************************************************************************/
+
+bool ClipmapValidator::expandInstance(const TerrainGeometry::TerrainData& instance, std::vector<GridRect>& rects, ClipmapValidationResult& result) const
+{
+	int meshId = static_cast<int>(instance.id.x);
+	int m = (params_.vertexCount + 1) / 4;
+	glm::ivec2 dimension = TerrainGeometry::GetFootprintDimension(meshId, m, params_.vertexCount);
+
+	// Footprints in quads, the L-Trim is a horizontal strip and a vertical strip on top of it
+	glm::ivec4 localRects[2];
+	int localRectCount = 1;
+	if (meshId == 4)
+	{
+		localRects[0] = glm::ivec4(0, 0, dimension.x - 1, 1);
+		localRects[1] = glm::ivec4(0, 1, 1, dimension.y);
+		localRectCount = 2;
+	}
+	else
+		localRects[0] = glm::ivec4(0, 0, dimension.x - 1, dimension.y - 1);
+
+	// Same transform as main.vert
+	float c = std::cos(instance.id.y);
+	float s = std::sin(instance.id.y);
+	int64_t step = static_cast<int64_t>(instance.scale.x);
+
+	for (int i = 0; i < localRectCount; ++i)
+	{
+		int64_t corners[2][2];
+		for (int j = 0; j < 2; ++j)
+		{
+			glm::vec2 local = glm::vec2(j == 0 ? localRects[i].x : localRects[i].z, j == 0 ? localRects[i].y : localRects[i].w);
+			local *= instance.scale * params_.unitSize;
+			glm::vec2 world = glm::vec2(c * local.x - s * local.y, s * local.x + c * local.y) + instance.translate;
+
+			glm::vec2 grid = world / params_.unitSize;
+			glm::vec2 rounded = glm::round(grid);
+			float tolerance = kGridTolerance * instance.scale.x;
+			if (std::abs(grid.x - rounded.x) > tolerance || std::abs(grid.y - rounded.y) > tolerance ||
+				int64_t(rounded.x) % step != 0 || int64_t(rounded.y) % step != 0)
+			{
+				result.coverageErrors++;
+				if (result.message.empty())
+					result.message = "mesh " + std::to_string(meshId) + " corner off the level grid";
+				return false;
+			}
+			corners[j][0] = static_cast<int64_t>(rounded.x);
+			corners[j][1] = static_cast<int64_t>(rounded.y);
+		}
+
+		rects.push_back(GridRect{
+			std::min(corners[0][0], corners[1][0]), std::min(corners[0][1], corners[1][1]),
+			std::max(corners[0][0], corners[1][0]), std::max(corners[0][1], corners[1][1]) });
+	}
+	return true;
+}
+
+/*****************************************************************************************************************************************/
+
+void ClipmapValidator::validateLevel(int level, const std::vector<GridRect>& rects, const GridRect* hole, GridRect& bounds, ClipmapValidationResult& result) const
+{
+	auto fail = [&result, level](const char* message) {
+		result.coverageErrors++;
+		if (result.message.empty())
+			result.message = "level " + std::to_string(level) + ": " + message;
+	};
+
+	if (rects.empty())
+	{
+		fail("no blocks");
+		return;
+	}
+
+	bounds = rects[0];
+	for (const GridRect& rect : rects)
+	{
+		bounds.minX = std::min(bounds.minX, rect.minX);
+		bounds.minY = std::min(bounds.minY, rect.minY);
+		bounds.maxX = std::max(bounds.maxX, rect.maxX);
+		bounds.maxY = std::max(bounds.maxY, rect.maxY);
+	}
+
+	int64_t step = int64_t(1) << level;
+	// The coarsest level has no trim around it
+	int trimCells = level + 1 < params_.maxClipLevelCount ? 1 : 0;
+	int64_t expectedSize = (params_.vertexCount - 2 + trimCells) * step;
+	if (bounds.maxX - bounds.minX != expectedSize || bounds.maxY - bounds.minY != expectedSize)
+		fail("ring size doesn't match the footprint");
+
+	int64_t expectedArea = GetArea(bounds.minX, bounds.minY, bounds.maxX, bounds.maxY);
+	if (hole)
+	{
+		// Finer level must be aligned to this level's vertices and lie strictly inside
+		if (hole->minX % step != 0 || hole->minY % step != 0 || hole->maxX % step != 0 || hole->maxY % step != 0)
+			fail("finer level not aligned to the level grid");
+		if (hole->minX <= bounds.minX || hole->minY <= bounds.minY || hole->maxX >= bounds.maxX || hole->maxY >= bounds.maxY)
+			fail("finer level touches the outer edge");
+		expectedArea -= GetArea(hole->minX, hole->minY, hole->maxX, hole->maxY);
+	}
+
+	// Exactly once coverage: disjoint blocks outside the hole whose areas add up to the ring
+	int64_t area = 0;
+	for (size_t i = 0; i < rects.size(); ++i)
+	{
+		const GridRect& a = rects[i];
+		area += GetArea(a.minX, a.minY, a.maxX, a.maxY);
+
+		if (hole && Overlaps(a.minX, a.maxX, hole->minX, hole->maxX) && Overlaps(a.minY, a.maxY, hole->minY, hole->maxY))
+			fail("block overlaps the finer level");
+
+		for (size_t j = i + 1; j < rects.size(); ++j)
+		{
+			const GridRect& b = rects[j];
+			if (Overlaps(a.minX, a.maxX, b.minX, b.maxX) && Overlaps(a.minY, a.maxY, b.minY, b.maxY))
+				fail("blocks overlap");
+		}
+	}
+
+	if (area != expectedArea)
+		fail("gap in the ring");
+}
+
+/*****************************************************************************************************************************************/
+
+void ClipmapValidator::validateSeam(int level, const GridRect& bounds, const glm::vec3& cameraPosition, ClipmapValidationResult& result) const
+{
+	int64_t step = int64_t(1) << level;
+	float scale = float(step);
+	float tolerance = kSeamTolerance * std::max(params_.maxHeight - params_.minHeight, 1.0f);
+
+	// Walk the outer edge of the level, every other vertex is a T-junction on the coarser level
+	const glm::ivec2 directions[4] = { glm::ivec2(1, 0), glm::ivec2(0, 1), glm::ivec2(-1, 0), glm::ivec2(0, -1) };
+	int64_t vertexX = bounds.minX;
+	int64_t vertexY = bounds.minY;
+	int64_t edgeLength = (bounds.maxX - bounds.minX) / step;
+
+	for (const glm::ivec2& direction : directions)
+	{
+		for (int64_t i = 0; i < edgeLength; ++i)
+		{
+			glm::vec2 position = glm::vec2(float(vertexX), float(vertexY)) * params_.unitSize;
+			float fineHeight = getMorphedHeight(position, scale, cameraPosition);
+
+			float coarseHeight = 0.0f;
+			if (i % 2 == 0)
+				coarseHeight = getMorphedHeight(position, scale * 2.0f, cameraPosition);
+			else
+			{
+				glm::vec2 offset = glm::vec2(direction) * scale * params_.unitSize;
+				coarseHeight = (getMorphedHeight(position - offset, scale * 2.0f, cameraPosition) +
+					getMorphedHeight(position + offset, scale * 2.0f, cameraPosition)) * 0.5f;
+			}
+
+			float error = std::abs(fineHeight - coarseHeight);
+			result.maxSeamError = std::max(result.maxSeamError, error);
+			if (error > tolerance)
+			{
+				result.seamErrors++;
+				if (result.message.empty())
+				{
+					char message[128];
+					snprintf(message, sizeof(message), "level %d seam at (%.1f, %.1f) off by %.4f", level, position.x, position.y, error);
+					result.message = message;
+				}
+			}
+
+			vertexX += direction.x * step;
+			vertexY += direction.y * step;
+		}
+	}
+}
+
+/*****************************************************************************************************************************************/
@@ -0,0 +1,450 @@
+#include "terrain/heightfield.h"
+#include "image_utils.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <assert.h>
+
+/*****************************************************************************************************************************************/
+
+bool Heightfield::load(const char* filename)
+{
+	ImageHeader header = {};
+	float* data = ImageUtils::LoadImageFloat(filename, header);
+	if (data == nullptr)
+		return false;
+
+	width_ = header.width;
+	height_ = header.height;
+	data_.resize(static_cast<size_t>(width_) * height_);
+	for (size_t i = 0; i < data_.size(); ++i)
+		data_[i] = data[i * header.nChannel];
+
+	ImageUtils::FreeImage(data);
+	return true;
+}
+
+/*****************************************************************************************************************************************/
+
+void Heightfield::fill(int width, int height, float height01)
+{
+	width_ = width;
+	height_ = height;
+	data_.assign(static_cast<size_t>(width_) * height_, height01);
+	pyramid_.clear();
+}
+
+/*****************************************************************************************************************************************/
+
+float Heightfield::getTexel(int x, int y) const
+{
+	x = ((x % width_) + width_) % width_;
+	y = ((y % height_) + height_) % height_;
+	return data_[static_cast<size_t>(y) * width_ + x];
+}
+
+/*****************************************************************************************************************************************/
+
+float Heightfield::sample(float x, float y) const
+{
+	// Texel centers are at half integers like in OpenGL
+	x -= 0.5f;
+	y -= 0.5f;
+	float fx = std::floor(x);
+	float fy = std::floor(y);
+	int ix = static_cast<int>(fx);
+	int iy = static_cast<int>(fy);
+	float tx = x - fx;
+	float ty = y - fy;
+
+	float h0 = getTexel(ix, iy) * (1.0f - tx) + getTexel(ix + 1, iy) * tx;
+	float h1 = getTexel(ix, iy + 1) * (1.0f - tx) + getTexel(ix + 1, iy + 1) * tx;
+	return h0 * (1.0f - ty) + h1 * ty;
+}
+
+/*****************************************************************************************************************************************/
+
+void Heightfield::resize(int width, int height)
+{
+	std::vector<float> data(static_cast<size_t>(width) * height);
+	float scaleX = static_cast<float>(width_) / width;
+	float scaleY = static_cast<float>(height_) / height;
+	for (int y = 0; y < height; ++y)
+	{
+		for (int x = 0; x < width; ++x)
+			data[static_cast<size_t>(y) * width + x] = sample((x + 0.5f) * scaleX, (y + 0.5f) * scaleY);
+	}
+
+	data_ = std::move(data);
+	width_ = width;
+	height_ = height;
+	pyramid_.clear();
+}
+
+/*****************************************************************************************************************************************/
+
+template<typename RowFunc>
+void Heightfield::ParallelRows(int rowCount, RowFunc rowFunc, int maxThreads)
+{
+	int threadCount = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+	if (maxThreads > 0)
+		threadCount = std::min(threadCount, maxThreads);
+	threadCount = std::min(threadCount, rowCount);
+	if (threadCount <= 1)
+	{
+		rowFunc(0, rowCount);
+		return;
+	}
+
+	int rowsPerThread = (rowCount + threadCount - 1) / threadCount;
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < threadCount; ++i)
+	{
+		int startRow = i * rowsPerThread;
+		int endRow = std::min(startRow + rowsPerThread, rowCount);
+		if (startRow < endRow)
+			threads.emplace_back(rowFunc, startRow, endRow);
+	}
+
+	for (std::thread& thread : threads)
+		thread.join();
+}
+
+/*****************************************************************************************************************************************/
+
+void Heightfield::generateNormals(float maxHeight, float texelWorldSize, std::vector<int16_t>& normals) const
+{
+	PROFILE_SCOPE("Heightfield::generateNormals");
+
+	normals.resize(static_cast<size_t>(width_) * height_ * 2);
+	if (data_.empty())
+		return;
+
+	// Central difference spans two texels
+	float heightScale = maxHeight / (2.0f * texelWorldSize);
+
+	ParallelRows(height_, [&](int startRow, int endRow) {
+		generateNormalRows(startRow, endRow, heightScale, normals.data());
+	});
+}
+
+/*****************************************************************************************************************************************/
+
+void Heightfield::generateNormalRows(int startRow, int endRow, float heightScale, int16_t* normals) const
+{
+	std::vector<float> dx(width_);
+	std::vector<float> dz(width_);
+
+	for (int y = startRow; y < endRow; ++y)
+	{
+		const float* row = &data_[static_cast<size_t>(y) * width_];
+		const float* rowUp = &data_[static_cast<size_t>((y + height_ - 1) % height_) * width_];
+		const float* rowDown = &data_[static_cast<size_t>((y + 1) % height_) * width_];
+
+		// Branch free inner loops over contiguous rows so the compiler can vectorize them,
+		// the wrapped first and last texels are patched afterwards
+		for (int x = 1; x < width_ - 1; ++x)
+			dx[x] = (row[x + 1] - row[x - 1]) * heightScale;
+		dx[0] = (row[1 % width_] - row[width_ - 1]) * heightScale;
+		dx[width_ - 1] = (row[0] - row[std::max(width_ - 2, 0)]) * heightScale;
+
+		for (int x = 0; x < width_; ++x)
+			dz[x] = (rowDown[x] - rowUp[x]) * heightScale;
+
+		int16_t* out = normals + static_cast<size_t>(y) * width_ * 2;
+		for (int x = 0; x < width_; ++x)
+		{
+			// Same orientation as the four tap normal main.frag used to compute,
+			// (dh/dx, 1, dh/dz), projected on the octahedron. y is always up so the
+			// lower hemisphere fold is never needed
+			float l1 = std::abs(dx[x]) + 1.0f + std::abs(dz[x]);
+			float u = dx[x] / l1;
+			float v = dz[x] / l1;
+			out[x * 2 + 0] = static_cast<int16_t>(std::lround(u * 32767.0f));
+			out[x * 2 + 1] = static_cast<int16_t>(std::lround(v * 32767.0f));
+		}
+	}
+}
+
+/*****************************************************************************************************************************************/
+
+void Heightfield::generateMorphLevels(float worldSize, float unitSize, int levelCount, std::vector<std::vector<float>>& levels) const
+{
+	PROFILE_SCOPE("Heightfield::generateMorphLevels");
+	assert(unitSize > 0.0f && levelCount > 0);
+
+	int baseSize = static_cast<int>(worldSize / unitSize);
+	levels.resize(levelCount);
+	if (data_.empty())
+		return;
+
+	for (int i = 0; i < levelCount; ++i)
+	{
+		int size = std::max(baseSize >> i, 1);
+		float spacing = unitSize * static_cast<float>(1 << i);
+		std::vector<float>& level = levels[i];
+		level.resize(static_cast<size_t>(size) * size * 2);
+
+		ParallelRows(size, [&](int startRow, int endRow) {
+			generateMorphRows(startRow, endRow, size, spacing, worldSize, level);
+		});
+
+		// zd needs the heights of the neighbouring rows so it runs once every zf is written
+		ParallelRows(size, [&](int startRow, int endRow) {
+			for (int y = startRow; y < endRow; ++y)
+			{
+				for (int x = 0; x < size; ++x)
+				{
+					// Vertices between two coarser ones take the average of both, same
+					// neighbours as mod(worldPos, 2 * spacing) picks in the old vertex shader
+					int dx = x & 1;
+					int dy = y & 1;
+					float* texel = &level[(static_cast<size_t>(y) * size + x) * 2];
+					if (size == 1 || (dx == 0 && dy == 0))
+					{
+						texel[1] = 0.0f;
+						continue;
+					}
+
+					int x0 = (x - dx + size) % size;
+					int y0 = (y - dy + size) % size;
+					int x1 = (x + dx) % size;
+					int y1 = (y + dy) % size;
+					float h0 = level[(static_cast<size_t>(y0) * size + x0) * 2];
+					float h1 = level[(static_cast<size_t>(y1) * size + x1) * 2];
+					texel[1] = (h0 + h1) * 0.5f - texel[0];
+				}
+			}
+		});
+	}
+}
+
+/*****************************************************************************************************************************************/
+
+void Heightfield::generateMorphRows(int startRow, int endRow, int size, float spacing, float worldSize, std::vector<float>& level) const
+{
+	// Same mapping as getHeightFromTexture in main.vert, (worldPos + worldSize / 2) / worldSize
+	float texelScale = spacing / worldSize;
+	for (int y = startRow; y < endRow; ++y)
+	{
+		float v = (y * texelScale + 0.5f) * height_;
+		for (int x = 0; x < size; ++x)
+		{
+			float u = (x * texelScale + 0.5f) * width_;
+			level[(static_cast<size_t>(y) * size + x) * 2] = sample(u, v);
+		}
+	}
+}
+
+/*****************************************************************************************************************************************/
+
+void Heightfield::generateHorizons(const std::vector<TexelRect>& tiles, float heightScale, float maxDistance, uint8_t* horizons, int maxThreads) const
+{
+	PROFILE_SCOPE("Heightfield::generateHorizons");
+	if (data_.empty() || tiles.empty())
+		return;
+
+	// Denser near the texel where the small features are, sparser towards the distance
+	std::vector<float> distances;
+	for (float distance = 1.0f; distance <= maxDistance; distance = std::max(distance + 1.0f, distance * 1.5f))
+		distances.push_back(distance);
+
+	// A bilinear lookup at most the farthest distance away reads one texel past it
+	int margin = static_cast<int>(std::ceil(distances.back())) + 1;
+
+	ParallelRows(static_cast<int>(tiles.size()), [&](int startTile, int endTile) {
+		for (int i = startTile; i < endTile; ++i)
+		{
+			const TexelRect& tile = tiles[i];
+			if (tile.x0 >= margin && tile.y0 >= margin && tile.x1 + margin < width_ && tile.y1 + margin < height_)
+				generateHorizonTile<true>(tile, distances, heightScale, horizons);
+			else
+				generateHorizonTile<false>(tile, distances, heightScale, horizons);
+		}
+	}, maxThreads);
+}
+
+/*****************************************************************************************************************************************/
+
+template<bool Interior>
+void Heightfield::generateHorizonTile(const TexelRect& tile, const std::vector<float>& distances, float heightScale, uint8_t* horizons) const
+{
+	float directionX[kHorizonDirections];
+	float directionY[kHorizonDirections];
+	for (int d = 0; d < kHorizonDirections; ++d)
+	{
+		float angle = 6.28318531f * d / kHorizonDirections;
+		directionX[d] = std::cos(angle);
+		directionY[d] = std::sin(angle);
+	}
+
+	const size_t layerSize = static_cast<size_t>(width_) * height_ * 4;
+	for (int y = tile.y0; y < tile.y1; ++y)
+	{
+		for (int x = tile.x0; x < tile.x1; ++x)
+		{
+			float h0 = data_[static_cast<size_t>(y) * width_ + x];
+			float centerX = x + 0.5f;
+			float centerY = y + 0.5f;
+
+			// Steepest slope towards any sample, a horizon below the texel counts as flat
+			float maxSlope[kHorizonDirections] = {};
+			for (float distance : distances)
+			{
+				float scale = heightScale / distance;
+				for (int d = 0; d < kHorizonDirections; ++d)
+				{
+					// Bilinear lookup as sample, without the wrapping away from the border
+					float sx = centerX + directionX[d] * distance - 0.5f;
+					float sy = centerY + directionY[d] * distance - 0.5f;
+					float fx = std::floor(sx);
+					float fy = std::floor(sy);
+					int ix = static_cast<int>(fx);
+					int iy = static_cast<int>(fy);
+
+					float h;
+					if (Interior || (ix >= 0 && iy >= 0 && ix < width_ - 1 && iy < height_ - 1))
+					{
+						const float* texel = &data_[static_cast<size_t>(iy) * width_ + ix];
+						float tx = sx - fx;
+						float ty = sy - fy;
+						float top = texel[0] + (texel[1] - texel[0]) * tx;
+						float bottom = texel[width_] + (texel[width_ + 1] - texel[width_]) * tx;
+						h = top + (bottom - top) * ty;
+					}
+					else
+						h = sample(sx + 0.5f, sy + 0.5f);
+
+					maxSlope[d] = std::max(maxSlope[d], (h - h0) * scale);
+				}
+			}
+
+			size_t texel = (static_cast<size_t>(y) * width_ + x) * 4;
+			for (int d = 0; d < kHorizonDirections; ++d)
+			{
+				float sine = maxSlope[d] / std::sqrt(1.0f + maxSlope[d] * maxSlope[d]);
+				horizons[(d / 4) * layerSize + texel + (d % 4)] = static_cast<uint8_t>(sine * 255.0f + 0.5f);
+			}
+		}
+	}
+}
+
+/*****************************************************************************************************************************************/
+
+void Heightfield::buildMinMaxPyramid()
+{
+	PROFILE_SCOPE("Heightfield::buildMinMaxPyramid");
+
+	pyramid_.clear();
+	if (data_.empty())
+		return;
+
+	PyramidLevel base = { std::vector<float>(data_.size() * 2), width_, height_ };
+	for (size_t i = 0; i < data_.size(); ++i)
+	{
+		base.minMax[i * 2 + 0] = data_[i];
+		base.minMax[i * 2 + 1] = data_[i];
+	}
+	pyramid_.push_back(std::move(base));
+
+	while (pyramid_.back().width > 1 || pyramid_.back().height > 1)
+	{
+		const PyramidLevel& previous = pyramid_.back();
+		PyramidLevel level = { {}, (previous.width + 1) / 2, (previous.height + 1) / 2 };
+		level.minMax.resize(static_cast<size_t>(level.width) * level.height * 2);
+
+		for (int y = 0; y < level.height; ++y)
+		{
+			for (int x = 0; x < level.width; ++x)
+			{
+				float minHeight = 1.0f;
+				float maxHeight = 0.0f;
+				for (int i = 0; i < 4; ++i)
+				{
+					int px = std::min(x * 2 + (i & 1), previous.width - 1);
+					int py = std::min(y * 2 + (i >> 1), previous.height - 1);
+					const float* texel = &previous.minMax[(static_cast<size_t>(py) * previous.width + px) * 2];
+					minHeight = std::min(minHeight, texel[0]);
+					maxHeight = std::max(maxHeight, texel[1]);
+				}
+				level.minMax[(static_cast<size_t>(y) * level.width + x) * 2 + 0] = minHeight;
+				level.minMax[(static_cast<size_t>(y) * level.width + x) * 2 + 1] = maxHeight;
+			}
+		}
+		pyramid_.push_back(std::move(level));
+	}
+}
+
+/*****************************************************************************************************************************************/
+
+void Heightfield::getHeightRange(float x0, float y0, float x1, float y1, float& minHeight, float& maxHeight) const
+{
+	minHeight = 0.0f;
+	maxHeight = 1.0f;
+	if (pyramid_.empty())
+		return;
+
+	// Texels a bilinear lookup reads, centers are at half integers
+	int ix0 = static_cast<int>(std::floor(x0 - 0.5f));
+	int iy0 = static_cast<int>(std::floor(y0 - 0.5f));
+	int ix1 = static_cast<int>(std::floor(x1 - 0.5f)) + 1;
+	int iy1 = static_cast<int>(std::floor(y1 - 0.5f)) + 1;
+
+	const float* top = pyramid_.back().minMax.data();
+	if (ix1 - ix0 + 1 >= width_ || iy1 - iy0 + 1 >= height_)
+	{
+		minHeight = top[0];
+		maxHeight = top[1];
+		return;
+	}
+
+	// Coarsest level where the rectangle still spans at most 2x2 texels
+	int shift = 0;
+	while (shift + 1 < static_cast<int>(pyramid_.size()) && ((ix1 - ix0) >> shift) > 1)
+		shift++;
+	while (shift + 1 < static_cast<int>(pyramid_.size()) && ((iy1 - iy0) >> shift) > 1)
+		shift++;
+
+	// Wrap into the heightmap, a range crossing the border is split in two
+	int wx0 = ((ix0 % width_) + width_) % width_;
+	int wy0 = ((iy0 % height_) + height_) % height_;
+	int wx1 = wx0 + (ix1 - ix0);
+	int wy1 = wy0 + (iy1 - iy0);
+
+	int xRanges[2][2] = { { wx0, std::min(wx1, width_ - 1) }, { 0, wx1 - width_ } };
+	int yRanges[2][2] = { { wy0, std::min(wy1, height_ - 1) }, { 0, wy1 - height_ } };
+
+	minHeight = 1.0f;
+	maxHeight = 0.0f;
+	for (int j = 0; j < 2; ++j)
+	{
+		if (yRanges[j][1] < yRanges[j][0])
+			continue;
+		for (int i = 0; i < 2; ++i)
+		{
+			if (xRanges[i][1] < xRanges[i][0])
+				continue;
+			GetPyramidRange(pyramid_[shift], shift, xRanges[i][0], yRanges[j][0], xRanges[i][1], yRanges[j][1], minHeight, maxHeight);
+		}
+	}
+}
+
+/*****************************************************************************************************************************************/
+
+void Heightfield::GetPyramidRange(const PyramidLevel& level, int shift, int x0, int y0, int x1, int y1, float& minHeight, float& maxHeight)
+{
+	for (int y = y0 >> shift; y <= (y1 >> shift); ++y)
+	{
+		for (int x = x0 >> shift; x <= (x1 >> shift); ++x)
+		{
+			const float* texel = &level.minMax[(static_cast<size_t>(y) * level.width + x) * 2];
+			minHeight = std::min(minHeight, texel[0]);
+			maxHeight = std::max(maxHeight, texel[1]);
+		}
+	}
+}
+
+/*****************************************************************************************************************************************/
@@ -0,0 +1,206 @@
+#include "terrain/horizon_map.h"
+#include "terrain/heightfield.h"
+#include "ogl.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <cmath>
+
+/*****************************************************************************************************************************************/
+
+HorizonMap::HorizonMap(std::shared_ptr<const Heightfield> heightfield, float maxHeight, float texelWorldSize, float maxDistance) :
+	heightfield_(std::move(heightfield)),
+	heightScale_(maxHeight / texelWorldSize),
+	maxDistance_(maxDistance)
+{
+	int width = heightfield_->getWidth();
+	int height = heightfield_->getHeight();
+	tileCountX_ = (width + kTileSize - 1) / kTileSize;
+	tileCountY_ = (height + kTileSize - 1) / kTileSize;
+	pendingTiles_.assign(static_cast<size_t>(tileCountX_) * tileCountY_, 1);
+	pendingTileCount_ = tileCountX_ * tileCountY_;
+
+	// No horizon until a tile is baked, lit and unoccluded
+	horizons_.assign(static_cast<size_t>(width) * height * Heightfield::kHorizonDirections, 0);
+
+	TextureParams params = {};
+	params.width = width;
+	params.height = height;
+	params.depth = Heightfield::kHorizonDirections / 4;
+	params.type = TextureType::Texture2DArray;
+	params.format = TextureFormat::RGBA8;
+	texture_ = std::make_shared<GLTexture>(nullptr, params);
+
+	size_t layerSize = static_cast<size_t>(width) * height * 4;
+	for (int layer = 0; layer < params.depth; ++layer)
+		texture_->setLayer(layer, horizons_.data() + layer * layerSize);
+
+	worker_ = std::thread(&HorizonMap::runWorker, this);
+}
+
+/*****************************************************************************************************************************************/
+
+void HorizonMap::invalidate(int x0, int y0, int x1, int y1)
+{
+	// Texels up to the search distance away have the rectangle in their horizon
+	int margin = static_cast<int>(std::ceil(maxDistance_)) + 1;
+	int firstTileX = static_cast<int>(std::floor(float(x0 - margin) / kTileSize));
+	int lastTileX = static_cast<int>(std::floor(float(x1 - 1 + margin) / kTileSize));
+	int firstTileY = static_cast<int>(std::floor(float(y0 - margin) / kTileSize));
+	int lastTileY = static_cast<int>(std::floor(float(y1 - 1 + margin) / kTileSize));
+	lastTileX = std::min(lastTileX, firstTileX + tileCountX_ - 1);
+	lastTileY = std::min(lastTileY, firstTileY + tileCountY_ - 1);
+
+	for (int tileY = firstTileY; tileY <= lastTileY; ++tileY)
+	{
+		for (int tileX = firstTileX; tileX <= lastTileX; ++tileX)
+		{
+			int x = ((tileX % tileCountX_) + tileCountX_) % tileCountX_;
+			int y = ((tileY % tileCountY_) + tileCountY_) % tileCountY_;
+			uint8_t& pending = pendingTiles_[static_cast<size_t>(y) * tileCountX_ + x];
+			if (!pending)
+				pendingTileCount_++;
+			pending = 1;
+		}
+	}
+}
+
+/*****************************************************************************************************************************************/
+
+int HorizonMap::update(int maxTiles)
+{
+	std::vector<Heightfield::TexelRect> bakedTiles;
+	bool idle = false;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		bakedTiles.swap(bakedTiles_);
+		idle = bakingTiles_.empty();
+	}
+
+	if (bakedTiles.empty() && (!idle || pendingTileCount_ == 0))
+		return getPendingTileCount();
+
+	PROFILE_SCOPE("HorizonMap::update");
+
+	// Upload has to happen on the thread owning the context
+	uploadTiles(bakedTiles);
+	inFlightTileCount_ -= static_cast<int>(bakedTiles.size());
+
+	if (idle && pendingTileCount_ > 0)
+	{
+		std::vector<Heightfield::TexelRect> tiles = takePendingTiles(maxTiles);
+		inFlightTileCount_ += static_cast<int>(tiles.size());
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			bakingTiles_.swap(tiles);
+		}
+		condition_.notify_one();
+	}
+	return getPendingTileCount();
+}
+
+/*****************************************************************************************************************************************/
+
+void HorizonMap::bake()
+{
+	PROFILE_SCOPE("HorizonMap::bake");
+
+	std::vector<Heightfield::TexelRect> bakedTiles;
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		condition_.wait(lock, [this]() { return bakingTiles_.empty(); });
+		bakedTiles.swap(bakedTiles_);
+	}
+	uploadTiles(bakedTiles);
+	inFlightTileCount_ = 0;
+
+	std::vector<Heightfield::TexelRect> tiles = takePendingTiles(pendingTileCount_);
+	heightfield_->generateHorizons(tiles, heightScale_, maxDistance_, horizons_.data());
+	uploadTiles(tiles);
+}
+
+/*****************************************************************************************************************************************/
+
+void HorizonMap::runWorker()
+{
+	Profiler::SetThreadName("HorizonMap");
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true)
+	{
+		condition_.wait(lock, [this]() { return stopping_ || !bakingTiles_.empty(); });
+		if (stopping_)
+			return;
+
+		// One thread, the render thread keeps the other cores
+		lock.unlock();
+		heightfield_->generateHorizons(bakingTiles_, heightScale_, maxDistance_, horizons_.data(), 1);
+		lock.lock();
+
+		bakedTiles_.insert(bakedTiles_.end(), bakingTiles_.begin(), bakingTiles_.end());
+		bakingTiles_.clear();
+		condition_.notify_all();
+	}
+}
+
+/*****************************************************************************************************************************************/
+
+HorizonMap::~HorizonMap()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	condition_.notify_all();
+	worker_.join();
+}
+
+/*****************************************************************************************************************************************/
+
+std::vector<Heightfield::TexelRect> HorizonMap::takePendingTiles(int maxTiles)
+{
+	int width = heightfield_->getWidth();
+	int height = heightfield_->getHeight();
+
+	std::vector<Heightfield::TexelRect> tiles;
+	for (size_t i = 0; i < pendingTiles_.size() && static_cast<int>(tiles.size()) < maxTiles; ++i)
+	{
+		if (!pendingTiles_[i])
+			continue;
+
+		int x0 = static_cast<int>(i % tileCountX_) * kTileSize;
+		int y0 = static_cast<int>(i / tileCountX_) * kTileSize;
+		tiles.push_back(Heightfield::TexelRect{ x0, y0, std::min(x0 + kTileSize, width), std::min(y0 + kTileSize, height) });
+		pendingTiles_[i] = 0;
+		pendingTileCount_--;
+	}
+	return tiles;
+}
+
+/*****************************************************************************************************************************************/
+
+void HorizonMap::uploadTiles(const std::vector<Heightfield::TexelRect>& tiles)
+{
+	int width = heightfield_->getWidth();
+	int height = heightfield_->getHeight();
+
+	// Only the baked tiles are uploaded
+	size_t layerSize = static_cast<size_t>(width) * height * 4;
+	for (const Heightfield::TexelRect& tile : tiles)
+	{
+		int tileWidth = tile.x1 - tile.x0;
+		int tileHeight = tile.y1 - tile.y0;
+		upload_.resize(static_cast<size_t>(tileWidth) * tileHeight * 4);
+		for (int layer = 0; layer < Heightfield::kHorizonDirections / 4; ++layer)
+		{
+			for (int y = 0; y < tileHeight; ++y)
+			{
+				const uint8_t* row = horizons_.data() + layer * layerSize + (static_cast<size_t>(tile.y0 + y) * width + tile.x0) * 4;
+				std::copy(row, row + tileWidth * 4, upload_.data() + static_cast<size_t>(y) * tileWidth * 4);
+			}
+			texture_->setRegion(tile.x0, tile.y0, tileWidth, tileHeight, upload_.data(), layer);
+		}
+	}
+}
+
+/*****************************************************************************************************************************************/
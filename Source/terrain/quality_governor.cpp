@@ -0,0 +1,130 @@
+#include "terrain/quality_governor.h"
+#include "terrain/terrain.h"
+
+#include <algorithm>
+#include <cmath>
+#include <assert.h>
+
+/*****************************************************************************************************************************************/
+
+QualityGovernor::QualityGovernor(Terrain* terrain, const QualityGovernorConfig& config) :
+	terrain_(terrain),
+	config_(config),
+	samples_(config.windowSize, 0),
+	currentLevel_(static_cast<int>(config.levels.size()) - 1),
+	log_(config.logFile)
+{
+	assert(!config_.levels.empty());
+	assert(config_.windowSize > 0);
+
+	// Upload every footprint up front so that switching level never hitches
+	std::vector<int> vertexCounts;
+	for (const QualityLevel& level : config_.levels)
+		vertexCounts.push_back(level.vertexCount);
+	terrain_->precomputeFootprints(vertexCounts);
+
+	if (log_)
+		log_ << "frame,time,percentileMs,targetMs,fromLevel,toLevel,reason,maxClipLevelCount,vertexCount,transitionRegionWidth,fragmentDetail\n";
+
+	applyLevel(currentLevel_, "initial", 0.0f);
+}
+
+/*****************************************************************************************************************************************/
+
+void QualityGovernor::update(float dt)
+{
+	float frameTime = dt * 1000.0f;
+	elapsedTime_ += dt;
+	frameIndex_++;
+
+	addSample(frameTime);
+
+	if (cooldown_ > 0)
+	{
+		cooldown_--;
+		return;
+	}
+
+	// Wait for a full window so that a single hitch doesn't trigger a change
+	if (sampleCount_ < config_.windowSize)
+		return;
+
+	float percentileTime = getFrameTimePercentile();
+	int maxLevel = static_cast<int>(config_.levels.size()) - 1;
+
+	if (percentileTime > config_.targetFrameTime * config_.upperThreshold && currentLevel_ > 0)
+		applyLevel(currentLevel_ - 1, "over budget", percentileTime);
+	else if (percentileTime < config_.targetFrameTime * config_.lowerThreshold && currentLevel_ < maxLevel)
+		applyLevel(currentLevel_ + 1, "under budget", percentileTime);
+}
+
+/*****************************************************************************************************************************************/
+
+float QualityGovernor::getFrameTimePercentile() const
+{
+	if (sampleCount_ == 0)
+		return 0.0f;
+
+	int threshold = static_cast<int>(std::ceil(config_.percentile * sampleCount_));
+	int count = 0;
+	for (int i = 0; i < kBucketCount; ++i)
+	{
+		count += histogram_[i];
+		if (count >= threshold)
+			return (i + 1) * kBucketWidth;
+	}
+	return kBucketCount * kBucketWidth;
+}
+
+/*****************************************************************************************************************************************/
+
+void QualityGovernor::addSample(float frameTime)
+{
+	int bucket = std::clamp(static_cast<int>(frameTime / kBucketWidth), 0, kBucketCount - 1);
+
+	// Evict the oldest sample once the window is full
+	if (sampleCount_ == config_.windowSize)
+		histogram_[samples_[sampleHead_]]--;
+	else
+		sampleCount_++;
+
+	samples_[sampleHead_] = bucket;
+	histogram_[bucket]++;
+	sampleHead_ = (sampleHead_ + 1) % config_.windowSize;
+}
+
+/*****************************************************************************************************************************************/
+
+void QualityGovernor::resetHistory()
+{
+	histogram_.fill(0);
+	sampleHead_ = 0;
+	sampleCount_ = 0;
+}
+
+/*****************************************************************************************************************************************/
+
+void QualityGovernor::applyLevel(int level, const char* reason, float frameTime)
+{
+	const QualityLevel& quality = config_.levels[level];
+
+	terrain_->reconfigure(quality.vertexCount, terrain_->getParams().unitSize, quality.maxClipLevelCount);
+	terrain_->setTransitionRegionWidth(quality.transitionRegionWidth);
+	terrain_->setFragmentDetail(quality.fragmentDetail);
+
+	if (log_)
+	{
+		log_ << frameIndex_ << "," << elapsedTime_ << "," << frameTime << "," << config_.targetFrameTime << ","
+			<< currentLevel_ << "," << level << "," << reason << ","
+			<< quality.maxClipLevelCount << "," << quality.vertexCount << ","
+			<< quality.transitionRegionWidth << "," << quality.fragmentDetail << "\n";
+		log_.flush();
+	}
+
+	// Samples measured with the old settings no longer describe the new ones
+	currentLevel_ = level;
+	cooldown_ = config_.cooldownFrames;
+	resetHistory();
+}
+
+/*****************************************************************************************************************************************/
@@ -1,31 +1,66 @@
 #include "terrain/terrain.h"
 #include "terrain/terrain_geometry.h"
+#include "terrain/terrain_material.h"
+#include "terrain/heightfield.h"
+#include "terrain/terrain_tessellation.h"
+#include "terrain/terrain_shadows.h"
+#include "terrain/horizon_map.h"
+#include "camera.h"
 #include "ogl.h"
 #include "image_utils.h"
+#include "profiler.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+/*****************************************************************************************************************************************/
+
+// World size covered by one repeat of the heightmap, u_TextureDims in the shaders
+static const float kHeightmapWorldSize = 2048.0f;
+
+// Loaded instead of a heightmap that fails to load
+static const char* kFallbackHeightmap = "Assets/Textures/heightmap1.png";
 
 /*****************************************************************************************************************************************/
 
-Terrain::Terrain(int vertexCount, float unitSize) :
-	terrainParams_{ vertexCount, unitSize, 12, 200.0f, 0.0f, 0.1f }
+Terrain::Terrain(int vertexCount, float unitSize, bool vertexPulling, const char* heightmapFile) :
+	terrainParams_{ vertexCount, unitSize, 12, 200.0f, 0.0f, 0.1f, vertexPulling }
 //terrainParams_{ vertexCount, unitSize, 8, 10.0f, 0.0f, 0.1f }
 {
 	// Create Geometry
 	terrainGeometry_ = std::make_shared<TerrainGeometry>(&terrainParams_);
 
-	// Create Shader
-	shader_ = std::make_shared<GLProgram>(GLShader("Assets/Shaders/main.vert"), GLShader("Assets/Shaders/main.frag"));
-
 	{
 		// Load Heightmap
-		ImageHeader header = {};
-		float* data = ImageUtils::LoadImageFloat("Assets/Textures/heightmap.png", header);
+		heightfield_ = std::make_shared<Heightfield>();
+		if (!heightfield_->load(heightmapFile))
+		{
+			fprintf(stderr, "Failed to load heightmap %s, using %s\n", heightmapFile, kFallbackHeightmap);
+			if (!heightfield_->load(kFallbackHeightmap))
+			{
+				// Flat, the texel sizes below need a heightmap of some size
+				fprintf(stderr, "Failed to load heightmap %s, the terrain is flat\n", kFallbackHeightmap);
+				heightfield_->fill(256, 256, 0.0f);
+			}
+		}
 		TextureParams params = {};
-		params.width = header.width;
-		params.height = header.height;
+		params.width = heightfield_->getWidth();
+		params.height = heightfield_->getHeight();
 		params.format = TextureFormat::R16F;
-		heightMap_ = std::make_shared<GLTexture>(data, params);
-		ImageUtils::FreeImage(data);
+		heightMap_ = std::make_shared<GLTexture>(heightfield_->getData(), params);
+
+		// Fragment normals are fetched once instead of rebuilt from four height taps
+		std::vector<int16_t> normals;
+		heightfield_->generateNormals(terrainParams_.maxHeight, kHeightmapWorldSize / params.width, normals);
+		params.format = TextureFormat::RG16_SNORM;
+		normalMap_ = std::make_shared<GLTexture>(normals.data(), params);
 	}
+	updateMorphMap();
+
+	// Node bounds of the quadtree mode
+	heightfield_->buildMinMaxPyramid();
+	terrainGeometry_->setHeightfield(heightfield_.get(), kHeightmapWorldSize);
 	{
 		// Load Heightmap
 		ImageHeader header = {};
@@ -38,40 +73,437 @@ Terrain::Terrain(int vertexCount, float unitSize) :
 		gradientMap_ = std::make_shared<GLTexture>(data, params);
 		ImageUtils::FreeImage(data);
 	}
+
+	material_ = std::make_shared<TerrainMaterial>();
+
+	std::vector<std::string> defines;
+	if (GLAD_GL_ARB_bindless_texture)
+	{
+		createTextureHandleBuffer();
+		defines.push_back("BINDLESS_TEXTURES");
+	}
+
+	// Create Shader
+	shader_ = std::make_shared<GLProgram>(GLShader("Assets/Shaders/main.vert", defines), GLShader("Assets/Shaders/main.frag", defines));
+
+	std::vector<std::string> depthDefines = defines;
+	depthDefines.push_back("DEPTH_ONLY");
+	depthShader_ = std::make_shared<GLProgram>(GLShader("Assets/Shaders/main.vert", depthDefines), GLShader("Assets/Shaders/depth.frag"));
+
+	std::vector<std::string> shadowDefines = depthDefines;
+	shadowDefines.push_back("SHADOW_CASTER");
+	shadowShader_ = std::make_shared<GLProgram>(GLShader("Assets/Shaders/main.vert", shadowDefines), GLShader("Assets/Shaders/depth.frag"));
+
+	tessellation_ = std::make_shared<TerrainTessellation>(&terrainParams_, defines);
+
+	glCreateQueries(GL_PRIMITIVES_GENERATED, kPrimitiveQueryCount, primitiveQueries_);
+}
+
+/*****************************************************************************************************************************************/
+
+void Terrain::update(Camera* camera, const glm::ivec2& viewportSize, float dt)
+{
+	PROFILE_SCOPE("Terrain::update");
+	if (horizonMap_)
+		horizonMap_->update(kHorizonTilesPerUpdate);
+	updatePendingMorphMap();
+
+	if (terrainParams_.renderMode == TerrainRenderMode::Tessellation)
+		tessellation_->update(camera, viewportSize);
+	else if (shadows_)
+	{
+		// Cascades due this frame are culled in the same pass as the camera
+		pendingCascades_ = shadows_->update(camera);
+		std::vector<glm::mat4> views = { camera->getProjectionMatrix() * camera->getViewMatrix() };
+		for (int cascade : pendingCascades_)
+			views.push_back(shadows_->getViewProjection(cascade));
+		terrainGeometry_->updateViews(camera, viewportSize, views);
+	}
+	else
+		terrainGeometry_->update(camera, viewportSize);
+	updateMorphMap();
+
+	// Draw adds its uploads on top, read here by code that only updates
+	if (terrainParams_.renderMode == TerrainRenderMode::Tessellation)
+		stats_ = tessellation_->getStats();
+	else
+		stats_ = terrainGeometry_->getStats();
+	stats_.primitivesGenerated = primitivesGenerated_;
+}
+
+/*****************************************************************************************************************************************/
+
+void Terrain::updateViews(Camera* camera, const glm::ivec2& viewportSize, const std::vector<glm::mat4>& viewProjections, float dt)
+{
+	PROFILE_SCOPE("Terrain::updateViews");
+
+	// Tessellation culls on the GPU against whatever view projection it is drawn with
+	if (terrainParams_.renderMode == TerrainRenderMode::Tessellation)
+	{
+		tessellation_->update(camera, viewportSize);
+		stats_ = tessellation_->getStats();
+	}
+	else
+	{
+		updatePendingMorphMap();
+		terrainGeometry_->updateViews(camera, viewportSize, viewProjections);
+		updateMorphMap();
+		stats_ = terrainGeometry_->getStats();
+	}
+	stats_.primitivesGenerated = primitivesGenerated_;
+}
+
+/*****************************************************************************************************************************************/
+
+uint32_t Terrain::getViewInstanceCount(int viewIndex) const
+{
+	return terrainParams_.renderMode == TerrainRenderMode::Tessellation ? 0 : terrainGeometry_->getViewInstanceCount(viewIndex);
 }
 
 /*****************************************************************************************************************************************/
 
-void Terrain::update(Camera* camera, float dt)
+void Terrain::getViewInstances(int viewIndex, std::vector<uint64_t>& keys) const
 {
-	terrainGeometry_->update(camera);
+	keys.clear();
+	if (terrainParams_.renderMode == TerrainRenderMode::Tessellation)
+		return;
+
+	std::vector<TerrainGeometry::PackedTerrainData> instances;
+	terrainGeometry_->getViewInstances(viewIndex, instances);
+	for (const TerrainGeometry::PackedTerrainData& instance : instances)
+		keys.push_back(static_cast<uint64_t>(instance.attributes) << 32 | instance.position);
 }
 
 /*****************************************************************************************************************************************/
 
 void Terrain::draw()
 {
-	shader_->useProgram();
-	shader_->setInt("u_Heightmap", 0);
-	shader_->setInt("u_GradientMap", 1);
-	shader_->setInt("u_VertexCount", terrainParams_.vertexCount);
-	shader_->setFloat("u_TextureDims", 2048.0f);
-	shader_->setFloat("u_MaxHeight", terrainParams_.maxHeight);
-	shader_->setFloat("u_TransitionRegionWidth", terrainParams_.transitionRegionWidth);
-	shader_->setFloat("u_UnitSize", terrainParams_.unitSize);
+	drawView(0);
+}
+
+/*****************************************************************************************************************************************/
+
+void Terrain::drawView(int viewIndex)
+{
+	PROFILE_SCOPE("Terrain::draw");
+	PROFILE_GPU_SCOPE("Terrain::draw");
+
+	// Oldest query of the ring, it is usually done by now and never waited on
+	GLuint query = primitiveQueries_[primitiveQueryIndex_];
+	if (primitiveQueryFrame_ >= kPrimitiveQueryCount)
+	{
+		GLuint available = 0;
+		glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available)
+		{
+			GLuint64 primitives = 0;
+			glGetQueryObjectui64v(query, GL_QUERY_RESULT, &primitives);
+			primitivesGenerated_ = primitives;
+		}
+	}
+
+	glBindBufferBase(GL_UNIFORM_BUFFER, 2, material_->getRuleBuffer());
+	if (textureHandleBuffer_)
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, textureHandleBuffer_->getHandle());
+	else
+	{
+		const GLuint textures[] = {
+			heightMap_->getHandle(),
+			gradientMap_->getHandle(),
+			material_->getAlbedoArray()->getHandle(),
+			material_->getNormalArray()->getHandle(),
+			normalMap_->getHandle(),
+			morphMap_->getHandle(),
+		};
+		glBindTextures(0, 6, textures);
+	}
+
+	if (viewIndex == 0 && terrainParams_.renderMode != TerrainRenderMode::Tessellation)
+		drawShadowCascades();
+	if (horizonMap_)
+		glBindTextureUnit(7, horizonMap_->getTexture()->getHandle());
+
+	glBeginQuery(GL_PRIMITIVES_GENERATED, query);
+	if (terrainParams_.renderMode == TerrainRenderMode::Tessellation)
+		tessellation_->draw(kHeightmapWorldSize);
+	else
+		drawClipmap(viewIndex);
+	glEndQuery(GL_PRIMITIVES_GENERATED);
+
+	// Draw adds its uploads to the counters of the update
+	if (terrainParams_.renderMode == TerrainRenderMode::Tessellation)
+		stats_ = tessellation_->getStats();
+	else
+		stats_ = terrainGeometry_->getStats();
+	stats_.primitivesGenerated = primitivesGenerated_;
+
+	primitiveQueryIndex_ = (primitiveQueryIndex_ + 1) % kPrimitiveQueryCount;
+	primitiveQueryFrame_++;
+}
+
+/*****************************************************************************************************************************************/
+
+void Terrain::drawClipmap(int viewIndex)
+{
+	if (terrainParams_.depthPrepass)
+	{
+		// Depth only first so that main.frag runs once per pixel in the colour pass
+		{
+			PROFILE_SCOPE("Terrain::depthPrepass");
+			glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+			setClipmapUniforms(depthShader_.get());
+			terrainGeometry_->drawView(viewIndex);
+			glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		}
+
+		PROFILE_SCOPE("Terrain::colorPass");
+		glDepthMask(GL_FALSE);
+		glDepthFunc(GL_EQUAL);
+		setClipmapUniforms(shader_.get());
+		terrainGeometry_->drawView(viewIndex);
+		glDepthFunc(GL_LESS);
+		glDepthMask(GL_TRUE);
+		return;
+	}
+
+	setClipmapUniforms(shader_.get());
+	terrainGeometry_->drawView(viewIndex);
+}
+
+/*****************************************************************************************************************************************/
+
+void Terrain::drawShadowCascades()
+{
+	if (!shadows_)
+		return;
+
+	if (!pendingCascades_.empty())
+	{
+		PROFILE_SCOPE("Terrain::shadowCascades");
+		PROFILE_GPU_SCOPE("Terrain::shadowCascades");
+
+		// View 0 is the camera, the cascades follow in the order of the update
+		setClipmapUniforms(shadowShader_.get());
+		for (size_t i = 0; i < pendingCascades_.size(); ++i)
+		{
+			int cascade = pendingCascades_[i];
+			shadows_->beginCascade(cascade);
+			shadowShader_->setMat4("u_ShadowViewProjection", &shadows_->getViewProjection(cascade)[0][0]);
+			terrainGeometry_->drawView(static_cast<int>(i) + 1);
+			shadows_->endCascade();
+		}
+		pendingCascades_.clear();
+	}
+
+	shadows_->bind();
+}
+
+/*****************************************************************************************************************************************/
+
+void Terrain::setShadows(bool enabled)
+{
+	if (enabled == (shadows_ != nullptr))
+		return;
+
+	shadows_ = enabled ? std::make_shared<TerrainShadows>() : nullptr;
+	pendingCascades_.clear();
+}
+
+/*****************************************************************************************************************************************/
+
+void Terrain::setHorizonMap(bool enabled)
+{
+	if (enabled == (horizonMap_ != nullptr))
+		return;
+
+	horizonMap_ = enabled ? std::make_shared<HorizonMap>(heightfield_, terrainParams_.maxHeight, kHeightmapWorldSize / heightfield_->getWidth()) : nullptr;
+}
+
+/*****************************************************************************************************************************************/
+
+void Terrain::setClipmapUniforms(GLProgram* shader)
+{
+	shader->useProgram();
+	shader->setInt("u_VertexCount", terrainParams_.vertexCount);
+	shader->setFloat("u_TextureDims", kHeightmapWorldSize);
+	shader->setFloat("u_MaxHeight", terrainParams_.maxHeight);
+	shader->setFloat("u_TransitionRegionWidth", terrainParams_.transitionRegionWidth);
+	shader->setFloat("u_LodRange", TerrainGeometry::GetLodRange(terrainParams_));
+	shader->setFloat("u_UnitSize", terrainParams_.unitSize);
+	shader->setInt("u_VertexPulling", terrainParams_.vertexPulling ? 1 : 0);
+	shader->setInt("u_FragmentDetail", terrainParams_.fragmentDetail);
+	shader->setVec2("u_InstanceOrigin", terrainGeometry_->getInstanceOrigin().x, terrainGeometry_->getInstanceOrigin().y);
+	shader->setInt("u_ShadowCascadeCount", shadows_ ? TerrainShadows::kCascadeCount : 0);
+	shader->setInt("u_HorizonMapEnabled", horizonMap_ ? 1 : 0);
+}
+
+/*****************************************************************************************************************************************/
+
+void Terrain::reconfigure(int vertexCount, float unitSize, int maxClipLevelCount)
+{
+	assert(((vertexCount + 1) & vertexCount) == 0);
+	assert(maxClipLevelCount > 0);
+
+	// Clip level count only affects placement so it can change immediately
+	terrainParams_.maxClipLevelCount = maxClipLevelCount;
+	requestedVertexCount_ = vertexCount;
+	requestedUnitSize_ = unitSize;
+
+	// Same unit size or its morph map ready, otherwise update bakes it first
+	if (isMorphMapReady(unitSize))
+		terrainGeometry_->requestFootprint(vertexCount, unitSize);
+	else
+		updatePendingMorphMap();
+}
+
+/*****************************************************************************************************************************************/
+
+void Terrain::updateMorphMap()
+{
+	// The geometry switches unit size once its new footprint is ready, the morph
+	// map follows in the same frame
+	if (morphMap_ && morphUnitSize_ == terrainParams_.unitSize)
+		return;
+
+	PROFILE_SCOPE("Terrain::updateMorphMap");
+	if (morphMap_ && isMorphMapReady(terrainParams_.unitSize))
+	{
+		morphMap_ = nextMorphMap_;
+		nextMorphMap_.reset();
+	}
+	else
+	{
+		// Construction, and a unit size reconfigure did not bake ahead
+		morphMap_ = CreateMorphMap(terrainParams_.unitSize);
+		std::vector<std::vector<float>> levels = GenerateMorphLevels(heightfield_, terrainParams_.unitSize);
+		for (size_t i = 0; i < levels.size(); ++i)
+			morphMap_->setMipLevel(static_cast<int>(i), levels[i].data());
+	}
+	morphUnitSize_ = terrainParams_.unitSize;
+
+	// The handle of the old morph map went with it
+	if (textureHandleBuffer_)
+		createTextureHandleBuffer();
+}
+
+/*****************************************************************************************************************************************/
+
+void Terrain::updatePendingMorphMap()
+{
+	if (pendingMorphLevels_.valid())
+	{
+		if (pendingMorphLevels_.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+			return;
+
+		morphUploadLevels_ = pendingMorphLevels_.get();
+		morphUploadLevel_ = 0;
+		morphUploadRow_ = 0;
+		nextMorphMap_ = CreateMorphMap(pendingMorphUnitSize_);
+		nextMorphUnitSize_ = pendingMorphUnitSize_;
+	}
+
+	if (!morphUploadLevels_.empty())
+	{
+		// Upload has to happen on the thread owning the context, spread over several
+		// updates so that no frame takes the whole mip chain
+		PROFILE_SCOPE("Terrain::uploadMorphMap");
+		int budget = kMorphUploadTexelsPerUpdate;
+		int baseSize = static_cast<int>(kHeightmapWorldSize / nextMorphUnitSize_);
+		while (budget > 0 && morphUploadLevel_ < static_cast<int>(morphUploadLevels_.size()))
+		{
+			int size = std::max(baseSize >> morphUploadLevel_, 1);
+			int rows = std::min(std::max(budget / size, 1), size - morphUploadRow_);
+			const float* data = morphUploadLevels_[morphUploadLevel_].data() + static_cast<size_t>(morphUploadRow_) * size * 2;
+			nextMorphMap_->setRegion(0, morphUploadRow_, size, rows, data, 0, morphUploadLevel_);
 
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, heightMap_->getHandle());
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, gradientMap_->getHandle());
+			budget -= rows * size;
+			morphUploadRow_ += rows;
+			if (morphUploadRow_ == size)
+			{
+				morphUploadLevel_++;
+				morphUploadRow_ = 0;
+			}
+		}
 
-	terrainGeometry_->draw();
+		if (morphUploadLevel_ < static_cast<int>(morphUploadLevels_.size()))
+			return;
+
+		morphUploadLevels_.clear();
+		if (requestedUnitSize_ == nextMorphUnitSize_)
+			terrainGeometry_->requestFootprint(requestedVertexCount_, requestedUnitSize_);
+	}
+
+	// A later reconfigure asked for yet another unit size
+	if (requestedVertexCount_ == 0 || isMorphMapReady(requestedUnitSize_))
+		return;
+
+	pendingMorphUnitSize_ = requestedUnitSize_;
+	pendingMorphLevels_ = std::async(std::launch::async, GenerateMorphLevels, std::shared_ptr<const Heightfield>(heightfield_), pendingMorphUnitSize_);
+}
+
+/*****************************************************************************************************************************************/
+
+bool Terrain::isMorphMapReady(float unitSize) const
+{
+	if (unitSize == morphUnitSize_)
+		return true;
+	return nextMorphMap_ && morphUploadLevels_.empty() && unitSize == nextMorphUnitSize_;
+}
+
+/*****************************************************************************************************************************************/
+
+std::shared_ptr<GLTexture> Terrain::CreateMorphMap(float unitSize)
+{
+	// One texel per vertex of every clip level, the vertex shader fetches the height
+	// and the morph target at once instead of three filtered heightmap samples
+	TextureParams params = {};
+	params.width = params.height = static_cast<int>(kHeightmapWorldSize / unitSize);
+	params.format = TextureFormat::RG32F;
+	params.minFilter = TextureFilter::NearestMipmap;
+	params.magFilter = TextureFilter::Nearest;
+	return std::make_shared<GLTexture>(nullptr, params);
+}
+
+/*****************************************************************************************************************************************/
+
+std::vector<std::vector<float>> Terrain::GenerateMorphLevels(std::shared_ptr<const Heightfield> heightfield, float unitSize)
+{
+	int size = static_cast<int>(kHeightmapWorldSize / unitSize);
+	int levelCount = static_cast<int>(std::log2(size)) + 1;
+	std::vector<std::vector<float>> levels;
+	heightfield->generateMorphLevels(kHeightmapWorldSize, unitSize, levelCount, levels);
+	return levels;
+}
+
+/*****************************************************************************************************************************************/
+
+void Terrain::createTextureHandleBuffer()
+{
+	// Handles stay resident for the lifetime of their texture so draw binds nothing
+	uint64_t handles[] = {
+		heightMap_->getBindlessHandle(),
+		gradientMap_->getBindlessHandle(),
+		material_->getAlbedoArray()->getBindlessHandle(),
+		material_->getNormalArray()->getBindlessHandle(),
+		normalMap_->getBindlessHandle(),
+		morphMap_->getBindlessHandle(),
+	};
+	textureHandleBuffer_ = std::make_shared<GLBuffer>(handles, static_cast<uint32_t>(sizeof(handles)), 0);
+}
+
+/*****************************************************************************************************************************************/
+
+void Terrain::precomputeFootprints(const std::vector<int>& vertexCounts)
+{
+	for (int vertexCount : vertexCounts)
+		terrainGeometry_->precomputeFootprint(vertexCount, terrainParams_.unitSize);
 }
 
 /*****************************************************************************************************************************************/
 
 Terrain::~Terrain()
 {
+	glDeleteQueries(kPrimitiveQueryCount, primitiveQueries_);
 }
 
 /*****************************************************************************************************************************************/
\ No newline at end of file
@@ -1,145 +1,935 @@
 #include "terrain/terrain_geometry.h"
+#include "terrain/heightfield.h"
 #include "geometry/vertex_data.h"
 #include "geometry/geometry.h"
 #include "camera.h"
 #include "ogl.h"
 
 #include "debugdraw.h"
+#include "profiler.h"
 
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
 
 
+/****************************************************************************************************************************************/
+
+// Cosine and sine of the quarter turns blocks are rotated by, exact like rot() in main.vert
+static const float kCos[4] = { 1.0f, 0.0f, -1.0f, 0.0f };
+static const float kSin[4] = { 0.0f, 1.0f, 0.0f, -1.0f };
+
+static int GetQuarterTurns(float angle)
+{
+	return static_cast<int>(std::lround(angle / glm::radians(90.0f))) & 3;
+}
+
 /****************************************************************************************************************************************/
 
 TerrainGeometry::TerrainGeometry(TerrainParams* params) : 
-	params_(params),
-	m_((params->vertexCount + 1) / 4)
+	m_((params->vertexCount + 1) / 4),
+	params_(params)
 {
-	transformBuffer_ = std::make_shared<GLBuffer>(nullptr, static_cast<uint32_t>(sizeof(TerrainData) * 1000), GL_DYNAMIC_STORAGE_BIT);
-	generateFootprintGeometry(params->vertexCount, params->unitSize);
-	
+	transformBuffer_ = std::make_shared<GLBuffer>(nullptr, static_cast<uint32_t>(sizeof(PackedTerrainData) * kMaxInstanceCount * kMaxViewCount), GL_DYNAMIC_STORAGE_BIT);
+	if (params->vertexPulling)
+	{
+		proceduralMesh_ = std::make_shared<GLProceduralMesh>(kFootprintMeshCount);
+		generateProceduralFootprint(params->vertexCount, params->unitSize);
+	}
+	else
+	{
+		requestedKey_ = FootprintKey{ params->vertexCount, params->unitSize };
+		precomputeFootprint(params->vertexCount, params->unitSize);
+		activateFootprint(requestedKey_);
+	}
 }
 
 /****************************************************************************************************************************************/
 
-void TerrainGeometry::update(Camera* camera)
+void TerrainGeometry::update(Camera* camera, const glm::ivec2& viewportSize)
 {
-	glm::vec3 cameraPosition = camera->getPosition();
-	generateLocations(cameraPosition);
+	// Footprint is only a draw parameter when the vertices are pulled
+	if (params_->vertexPulling && (params_->vertexCount != footprintVertexCount_ || params_->unitSize != footprintUnitSize_))
+		generateProceduralFootprint(params_->vertexCount, params_->unitSize);
+	else if (!params_->vertexPulling)
+		updatePendingFootprint();
+
+	stats_.reset();
+	generatePlacement(camera, viewportSize, camera->getFrustum().get());
 	updateDrawCommands(camera);
 }
 
 /****************************************************************************************************************************************/
 
+void TerrainGeometry::updateViews(Camera* camera, const glm::ivec2& viewportSize, const std::vector<glm::mat4>& viewProjections)
+{
+	PROFILE_SCOPE("TerrainGeometry::updateViews");
+
+	// TerrainWorld regions are only resolved against the camera
+	assert(regions_.empty());
+	assert(!viewProjections.empty() && viewProjections.size() <= kMaxViewCount);
+
+	if (params_->vertexPulling && (params_->vertexCount != footprintVertexCount_ || params_->unitSize != footprintUnitSize_))
+		generateProceduralFootprint(params_->vertexCount, params_->unitSize);
+	else if (!params_->vertexPulling)
+		updatePendingFootprint();
+
+	stats_.reset();
+
+	// Quadtree nodes can not be culled during the selection, a node hidden from the
+	// camera may still cast a shadow into it
+	generatePlacement(camera, viewportSize, nullptr);
+
+	viewFrusta_.resize(viewProjections.size());
+	for (size_t i = 0; i < viewProjections.size(); ++i)
+		viewFrusta_[i].generate(viewProjections[i]);
+	cullViews(camera);
+
+	// Ordered once, each view keeps the order of the instances it sees
+	sortInstances(transformData_, camera->getPosition(), &visibilityMasks_);
+
+	views_.resize(viewProjections.size());
+	viewData_.clear();
+	for (size_t view = 0; view < views_.size(); ++view)
+	{
+		ViewCommands& commands = views_[view];
+		commands = ViewCommands();
+		commands.firstInstance = static_cast<uint32_t>(viewData_.size());
+		for (size_t i = 0; i < transformData_.size(); ++i)
+		{
+			if ((visibilityMasks_[i] & (1u << view)) == 0)
+				continue;
+
+			viewData_.push_back(transformData_[i]);
+			commands.instanceCounts[int(transformData_[i].id.x)]++;
+		}
+		addViewStats(commands);
+	}
+
+	uploadInstances(viewData_, camera->getPosition());
+}
+
+/****************************************************************************************************************************************/
+
+void TerrainGeometry::generatePlacement(Camera* camera, const glm::ivec2& viewportSize, Frustum* frustum)
+{
+	transformData_.clear();
+
+	glm::vec3 cameraPosition = camera->getPosition();
+	if (params_->renderMode == TerrainRenderMode::Quadtree)
+		GenerateQuadtreeNodes(*params_, cameraPosition, frustum, heightfield_, heightfieldWorldSize_, transformData_, &stats_);
+	else
+	{
+		// Levels that would be sub-pixel everywhere are not worth their triangles
+		int finestLevel = 0;
+		if (viewportSize.y > 0)
+		{
+			float pixelScale = camera->getProjectionMatrix()[1][1] * viewportSize.y * 0.5f;
+			finestLevel = GetFinestClipLevel(*params_, cameraPosition, heightfield_, heightfieldWorldSize_, pixelScale);
+		}
+
+		GenerateLocations(*params_, cameraPosition, transformData_, &stats_, finestLevel);
+		stats_.finestClipLevel = static_cast<uint32_t>(finestLevel);
+	}
+}
+
+/****************************************************************************************************************************************/
+
 void TerrainGeometry::draw()
 {
+	if (!views_.empty())
+		drawView(0);
+}
+
+/****************************************************************************************************************************************/
+
+void TerrainGeometry::drawView(int viewIndex)
+{
+	assert(viewIndex >= 0 && viewIndex < static_cast<int>(views_.size()));
+	const ViewCommands& view = views_[viewIndex];
+
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, transformBuffer_->getHandle());
 
-	mesh_->draw();
+	if (proceduralMesh_)
+	{
+		for (int i = 0; i < kFootprintMeshCount; ++i)
+			proceduralMesh_->commands[i].instanceCount_ = view.instanceCounts[i];
+		proceduralMesh_->draw(view.firstInstance);
+		stats_.bytesUploaded += proceduralMesh_->getCommandBufferSize();
+	}
+	else
+	{
+		for (int i = 0; i < kFootprintMeshCount; ++i)
+			mesh_->commands[i].instanceCount_ = view.instanceCounts[i];
+		mesh_->draw(view.firstInstance);
+		stats_.bytesUploaded += mesh_->getCommandBufferSize();
+	}
+}
 
-	transformData_.clear();
+/****************************************************************************************************************************************/
+
+uint32_t TerrainGeometry::getViewInstanceCount(int viewIndex) const
+{
+	uint32_t count = 0;
+	for (int i = 0; i < kFootprintMeshCount; ++i)
+		count += views_[viewIndex].instanceCounts[i];
+	return count;
 }
 
 /****************************************************************************************************************************************/
 
-void TerrainGeometry::generateFootprintGeometry(int vertexCount, float unitSize)
+void TerrainGeometry::getViewInstances(int viewIndex, std::vector<PackedTerrainData>& instances) const
 {
+	const ViewCommands& view = views_[viewIndex];
+	auto first = packedData_.begin() + view.firstInstance;
+	instances.assign(first, first + getViewInstanceCount(viewIndex));
+}
 
-	MeshData meshData = {};
+/****************************************************************************************************************************************/
+
+MeshData TerrainGeometry::GenerateFootprintGeometry(int vertexCount, float unitSize)
+{
+	// Only touches CPU memory so that it can be called from a worker thread
+	PROFILE_SCOPE("TerrainGeometry::GenerateFootprintGeometry");
 
-	// Generate all the required grids
-	float mSize = (m_ - 1) * unitSize;
+	int m = (vertexCount + 1) / 4;
+
+	MeshData meshData = {};
 
 	// MxM mesh ID: 0
-	GeometryGenerator::GenerateGrid(glm::ivec2(m_), unitSize, meshData);
+	GeometryGenerator::GenerateGrid(glm::ivec2(m), unitSize, meshData);
 
 	// Mx2 Mesh ID : 1
-	GeometryGenerator::GenerateGrid(glm::ivec2(m_, 2), unitSize, meshData);
+	GeometryGenerator::GenerateGrid(glm::ivec2(m, 2), unitSize, meshData);
 
 	// (M + 1)x2 Mesh ID: 2
-	GeometryGenerator::GenerateGrid(glm::ivec2(m_ + 1, 2), unitSize, meshData);
+	GeometryGenerator::GenerateGrid(glm::ivec2(m + 1, 2), unitSize, meshData);
 
 	// 2xM Mesh ID: 3
-	GeometryGenerator::GenerateGrid(glm::ivec2(2, m_), unitSize, meshData);
+	GeometryGenerator::GenerateGrid(glm::ivec2(2, m), unitSize, meshData);
 
 	// V * (V-1) L-Trim ID:4
 	GeometryGenerator::GenerateLTrim(glm::ivec2(vertexCount, vertexCount - 1), unitSize, meshData);
 
-
 	std::vector<AttributeLayout> attributeLayout = { AttributeLayout{0 , 2, 0}};
 	meshData.attributeLayout = attributeLayout;
-	mesh_ = std::make_shared<GLMesh>(meshData);
+	return meshData;
+}
+
+/****************************************************************************************************************************************/
+
+void TerrainGeometry::requestFootprint(int vertexCount, float unitSize)
+{
+	if (params_->vertexPulling)
+	{
+		// Picked up by the next update without touching any buffer
+		params_->vertexCount = vertexCount;
+		params_->unitSize = unitSize;
+		return;
+	}
+
+	requestedKey_ = FootprintKey{ vertexCount, unitSize };
+	if (footprintCache_.find(requestedKey_) != footprintCache_.end())
+	{
+		activateFootprint(requestedKey_);
+		return;
+	}
+
+	// Only one rebuild is in flight, the latest request is started when it finishes
+	if (pendingFootprint_.valid())
+		return;
+
+	pendingKey_ = requestedKey_;
+	pendingFootprint_ = std::async(std::launch::async, GenerateFootprintGeometry, vertexCount, unitSize);
+}
+
+/****************************************************************************************************************************************/
+
+void TerrainGeometry::precomputeFootprint(int vertexCount, float unitSize)
+{
+	if (params_->vertexPulling)
+		return;
+
+	FootprintKey key{ vertexCount, unitSize };
+	if (footprintCache_.find(key) == footprintCache_.end())
+		footprintCache_[key] = std::make_shared<GLMesh>(GenerateFootprintGeometry(vertexCount, unitSize));
+}
+
+/****************************************************************************************************************************************/
+
+void TerrainGeometry::activateFootprint(const FootprintKey& key)
+{
+	mesh_ = footprintCache_[key];
+	footprintBounds_ = mesh_->boundingBoxes_;
+	footprintVertexCount_ = key.first;
+	footprintUnitSize_ = key.second;
+	m_ = (key.first + 1) / 4;
+
+	params_->vertexCount = key.first;
+	params_->unitSize = key.second;
+}
+
+/****************************************************************************************************************************************/
+
+void TerrainGeometry::updatePendingFootprint()
+{
+	if (!pendingFootprint_.valid() ||
+		pendingFootprint_.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+		return;
+
+	// Upload has to happen on the thread owning the context
+	footprintCache_[pendingKey_] = std::make_shared<GLMesh>(pendingFootprint_.get());
+
+	if (footprintCache_.find(requestedKey_) != footprintCache_.end())
+		activateFootprint(requestedKey_);
+	else
+		requestFootprint(requestedKey_.first, requestedKey_.second);
+}
+
+/****************************************************************************************************************************************/
+
+void TerrainGeometry::generateProceduralFootprint(int vertexCount, float unitSize)
+{
+	footprintVertexCount_ = vertexCount;
+	footprintUnitSize_ = unitSize;
+	m_ = (vertexCount + 1) / 4;
+
+	// Same layout as GenerateFootprintGeometry but only the draw counts
+	// and bounds are needed, main.vert rebuilds the positions
+	footprintBounds_.clear();
+	for (int i = 0; i < kFootprintMeshCount; ++i)
+	{
+		glm::ivec2 dimension = GetFootprintDimension(i, m_, vertexCount);
+
+		uint32_t quadCount = (dimension.x - 1) * (dimension.y - 1);
+		if (i == 4)
+			quadCount = (dimension.x - 1) + (dimension.y - 1);
+		proceduralMesh_->setVertexCount(i, quadCount * 6);
+
+		if (i == 4)
+			footprintBounds_.push_back(GeometryGenerator::GetLTrimBounds(dimension, unitSize));
+		else
+			footprintBounds_.push_back(BoundingBox{
+				glm::vec3(0.0f),
+				glm::vec3((dimension.x - 1) * unitSize, 1.0f, (dimension.y - 1) * unitSize)
+				});
+	}
 }
 
 /****************************************************************************************************************************************/
 
-void TerrainGeometry::generateLocations(const glm::vec3& cameraPosition)
+glm::ivec2 TerrainGeometry::GetFootprintDimension(int meshId, int m, int vertexCount)
+{
+	// Must match getFootprintDimension in main.vert
+	switch (meshId)
+	{
+	case 0:
+		return glm::ivec2(m);
+	case 1:
+		return glm::ivec2(m, 2);
+	case 2:
+		return glm::ivec2(m + 1, 2);
+	case 3:
+		return glm::ivec2(2, m);
+	default:
+		return glm::ivec2(vertexCount, vertexCount - 1);
+	}
+}
+
+/****************************************************************************************************************************************/
+
+void TerrainGeometry::addViewStats(const ViewCommands& view)
+{
+	for (int i = 0; i < kFootprintMeshCount; ++i)
+	{
+		uint32_t vertexCount = proceduralMesh_ ? proceduralMesh_->commands[i].count_ : mesh_->commands[i].count_;
+		stats_.trianglesPerMesh[i] += static_cast<uint64_t>(vertexCount / 3) * view.instanceCounts[i];
+		if (view.instanceCounts[i] > 0)
+			stats_.drawCommandCount++;
+	}
+}
+
+/****************************************************************************************************************************************/
+
+void TerrainGeometry::GenerateLocations(const TerrainParams& params, const glm::vec3& cameraPosition,
+	std::vector<TerrainData>& instances, TerrainStats* stats, int finestLevel)
 { 
+	PROFILE_SCOPE("TerrainGeometry::GenerateLocations");
+	assert(finestLevel >= 0 && finestLevel < params.maxClipLevelCount);
+
 	// Generate Location for all clipmap level
-	for (int i = 0; i < params_->maxClipLevelCount; ++i)
-		generateLocationFor(i, cameraPosition);
+	for (int i = finestLevel; i < params.maxClipLevelCount; ++i)
+	{
+		size_t instanceCount = instances.size();
+		GenerateLocationFor(params, i, i == finestLevel, cameraPosition, instances);
+
+		if (stats)
+		{
+			instanceCount = instances.size() - instanceCount;
+			stats->instancesPerLevel[std::min(i, TerrainStats::kMaxClipLevels - 1)] += static_cast<uint32_t>(instanceCount);
+			stats->instancesGenerated += static_cast<uint32_t>(instanceCount);
+		}
+	}
+}
+
+/****************************************************************************************************************************************/
+
+int TerrainGeometry::GetFinestClipLevel(const TerrainParams& params, const glm::vec3& cameraPosition,
+	const Heightfield* heightfield, float worldSize, float pixelScale)
+{
+	if (params.clipLevelSkipPixels <= 0.0f)
+		return 0;
+
+	int level = 0;
+	for (; level < params.maxClipLevelCount - 1; ++level)
+	{
+		float spacing = static_cast<float>(1 << level) * params.unitSize;
+
+		float maxHeight = 1.0f;
+		if (heightfield)
+		{
+			// Everything a level can draw lies within half a footprint of the camera
+			float minHeight = 0.0f;
+			float texelScale = heightfield->getWidth() / worldSize;
+			float extent = (params.vertexCount * 0.5f + 1.0f) * spacing;
+			glm::vec2 texelMin = (glm::vec2(cameraPosition.x, cameraPosition.z) - extent + worldSize * 0.5f) * texelScale;
+			glm::vec2 texelMax = (glm::vec2(cameraPosition.x, cameraPosition.z) + extent + worldSize * 0.5f) * texelScale;
+			heightfield->getHeightRange(texelMin.x, texelMin.y, texelMax.x, texelMax.y, minHeight, maxHeight);
+		}
+
+		// Altitude above the highest ground the level covers, heights map to
+		// [minHeight, maxHeight] like the node bounds
+		float surfaceHeight = params.minHeight + maxHeight * (params.maxHeight - params.minHeight);
+		float distance = cameraPosition.y - surfaceHeight;
+		if (distance <= 0.0f || spacing * pixelScale / distance >= params.clipLevelSkipPixels)
+			break;
+	}
+	return level;
+}
+
+/****************************************************************************************************************************************/
+
+void TerrainGeometry::setHeightfield(const Heightfield* heightfield, float worldSize)
+{
+	heightfield_ = heightfield;
+	heightfieldWorldSize_ = worldSize;
+}
+
+/****************************************************************************************************************************************/
+
+float TerrainGeometry::GetLodRange(const TerrainParams& params)
+{
+	if (params.renderMode != TerrainRenderMode::Quadtree)
+	{
+		// Wherever the camera is inside the center tile the outer edge of a ring
+		// can be as close as (VertexCount - 3) / 2 tiles
+		return (params.vertexCount - 3) * 0.5f * params.unitSize;
+	}
+
+	// A node splits closer than half its range, so the finer children reach at most
+	// one node size beyond it. The range has to cover that plus the transition region
+	// of the coarser level for both sides of every level change to agree
+	int m = (params.vertexCount + 1) / 4;
+	return 2.0f * ((m - 1) + params.vertexCount * params.transitionRegionWidth) * params.unitSize + 2.0f;
+}
+
+/****************************************************************************************************************************************/
+
+struct QuadtreeSelection
+{
+	const TerrainParams& params;
+	glm::vec2 camera;
+	Frustum* frustum;
+	const Heightfield* heightfield;
+	float worldSize;
+	float lodRange;
+	std::vector<TerrainGeometry::TerrainData>& instances;
+	TerrainStats* stats;
+};
+
+// Bounds of a quadtree node from the height range below it
+static BoundingBox GetQuadtreeNodeBounds(const TerrainParams& params, const glm::vec2& origin, float scale, const Heightfield* heightfield, float worldSize)
+{
+	float size = ((params.vertexCount + 1) / 4 - 1) * scale * params.unitSize;
+
+	// Morphing reads one vertex beyond the node
+	float border = scale * params.unitSize;
+	float minHeight = 0.0f;
+	float maxHeight = 1.0f;
+	if (heightfield)
+	{
+		float texelScale = heightfield->getWidth() / worldSize;
+		glm::vec2 texelMin = (origin - border + worldSize * 0.5f) * texelScale;
+		glm::vec2 texelMax = (origin + size + border + worldSize * 0.5f) * texelScale;
+		heightfield->getHeightRange(texelMin.x, texelMin.y, texelMax.x, texelMax.y, minHeight, maxHeight);
+	}
+
+	return BoundingBox{
+		glm::vec3(origin.x - border, params.minHeight + minHeight * (params.maxHeight - params.minHeight), origin.y - border),
+		glm::vec3(origin.x + size + border, params.minHeight + maxHeight * (params.maxHeight - params.minHeight), origin.y + size + border)
+	};
+}
+
+static void SelectQuadtreeNode(QuadtreeSelection& selection, const glm::vec2& origin, int level)
+{
+	const TerrainParams& params = selection.params;
+	float scale = static_cast<float>(1 << level);
+	float size = ((params.vertexCount + 1) / 4 - 1) * scale * params.unitSize;
+
+	if (selection.frustum)
+	{
+		BoundingBox box = GetQuadtreeNodeBounds(params, origin, scale, selection.heightfield, selection.worldSize);
+		if (!selection.frustum->intersect(box))
+		{
+			if (selection.stats)
+				selection.stats->instancesCulled++;
+			return;
+		}
+	}
+
+	// Same xz Chebyshev distance main.vert morphs with
+	glm::vec2 nearest = glm::clamp(selection.camera, origin, origin + size);
+	glm::vec2 delta = glm::abs(selection.camera - nearest);
+	float distance = std::max(delta.x, delta.y);
+
+	if (level > 0 && distance < selection.lodRange * scale * 0.5f)
+	{
+		float half = size * 0.5f;
+		for (int i = 0; i < 4; ++i)
+			SelectQuadtreeNode(selection, origin + glm::vec2((i & 1) * half, (i >> 1) * half), level - 1);
+		return;
+	}
+
+	selection.instances.push_back(TerrainGeometry::TerrainData{ origin, glm::vec2(scale), glm::vec2(0.0f) });
+	if (selection.stats)
+	{
+		selection.stats->instancesPerLevel[std::min(level, TerrainStats::kMaxClipLevels - 1)]++;
+		selection.stats->instancesGenerated++;
+	}
+}
+
+void TerrainGeometry::GenerateQuadtreeNodes(const TerrainParams& params, const glm::vec3& cameraPosition, Frustum* frustum,
+	const Heightfield* heightfield, float worldSize, std::vector<TerrainData>& instances, TerrainStats* stats)
+{
+	PROFILE_SCOPE("TerrainGeometry::GenerateQuadtreeNodes");
+
+	// MxM has an odd number of quads, so the children of a node are aligned to their own
+	// scale but not to the parent grid, which is all morphing needs
+	QuadtreeSelection selection = { params, glm::vec2(cameraPosition.x, cameraPosition.z), frustum, heightfield, worldSize, GetLodRange(params), instances, stats };
+
+	// 4x4 roots at the coarsest level follow the camera
+	int rootLevel = params.maxClipLevelCount - 1;
+	float rootSize = ((params.vertexCount + 1) / 4 - 1) * static_cast<float>(1 << rootLevel) * params.unitSize;
+	glm::vec2 rootOrigin = (glm::floor(selection.camera / rootSize) - 2.0f) * rootSize;
+	for (int y = 0; y < 4; ++y)
+		for (int x = 0; x < 4; ++x)
+			SelectQuadtreeNode(selection, rootOrigin + glm::vec2(x, y) * rootSize, rootLevel);
 }
 
 /****************************************************************************************************************************************/
 
 void TerrainGeometry::updateDrawCommands(Camera* camera)
 {
-	std::sort(transformData_.begin(), transformData_.end(), [](const TerrainData& a, const TerrainData& b) {
-		return a.id.x < b.id.x;
+	PROFILE_SCOPE("TerrainGeometry::updateDrawCommands");
+
+	cullInstances(camera);
+
+	transformData_.erase(std::remove_if(
+		transformData_.begin(), transformData_.end(),
+		[](const TerrainData& data) {
+			return data.id.x < 0.0f;
+		}), transformData_.end());
+
+	if (!regions_.empty())
+		assignRegions(camera);
+
+	sortInstances(transformData_, camera->getPosition());
+
+	// Mesh types without any instance this frame must not keep the old count
+	views_.resize(1);
+	views_[0] = ViewCommands();
+	for (const TerrainData& transform : transformData_)
+		views_[0].instanceCounts[int(transform.id.x)]++;
+	addViewStats(views_[0]);
+
+	assert(transformData_.size() <= kMaxInstanceCount);
+	uploadInstances(transformData_, camera->getPosition());
+}
+
+/****************************************************************************************************************************************/
+
+void TerrainGeometry::sortInstances(std::vector<TerrainData>& instances, const glm::vec3& cameraPosition, std::vector<uint32_t>* masks)
+{
+	// Nearest blocks first within each command so that early depth rejects the
+	// farther fragments instead of shading them again
+	glm::vec2 center = glm::vec2(cameraPosition.x, cameraPosition.z);
+	std::vector<std::pair<float, uint32_t>>& ordered = sortKeys_;
+	ordered.clear();
+	for (uint32_t i = 0; i < instances.size(); ++i)
+	{
+		const TerrainData& transform = instances[i];
+		float distance = 0.0f;
+		if (params_->frontToBack)
+		{
+			// Block extent turned like rot() in main.vert, the L-trims are laid out
+			// from their corner in every quarter turn
+			int quarterTurns = GetQuarterTurns(transform.id.y);
+			glm::ivec2 dimension = GetFootprintDimension(int(transform.id.x), m_, footprintVertexCount_);
+			glm::vec2 halfExtent = glm::vec2(dimension - 1) * transform.scale * params_->unitSize * 0.5f;
+			glm::vec2 blockCenter = transform.translate + glm::vec2(
+				kCos[quarterTurns] * halfExtent.x - kSin[quarterTurns] * halfExtent.y,
+				kSin[quarterTurns] * halfExtent.x + kCos[quarterTurns] * halfExtent.y);
+			glm::vec2 delta = blockCenter - center;
+			distance = glm::dot(delta, delta);
+		}
+		ordered.emplace_back(distance, i);
+	}
+
+	std::sort(ordered.begin(), ordered.end(), [&instances](const auto& a, const auto& b) {
+		float idA = instances[a.second].id.x;
+		float idB = instances[b.second].id.x;
+		if (idA != idB)
+			return idA < idB;
+		if (a.first != b.first)
+			return a.first < b.first;
+		return a.second < b.second;
 		});
 
-	float currentId = transformData_[0].id.x;
-	BoundingBox aabb = mesh_->boundingBoxes_[int(currentId)];
-	int totalInstance = 0;
+	// Masks are indexed like the instances and move with them. The swaps hand the
+	// old storage back to the members for the next sort
+	sortedData_.resize(instances.size());
+	sortedMasks_.resize(masks ? masks->size() : 0);
+	for (size_t i = 0; i < ordered.size(); ++i)
+	{
+		sortedData_[i] = instances[ordered[i].second];
+		if (masks)
+			sortedMasks_[i] = (*masks)[ordered[i].second];
+	}
+	instances.swap(sortedData_);
+	if (masks)
+		masks->swap(sortedMasks_);
+}
+
+/****************************************************************************************************************************************/
+
+void TerrainGeometry::uploadInstances(const std::vector<TerrainData>& instances, const glm::vec3& cameraPosition)
+{
+	assert(instances.size() <= kMaxInstanceCount * kMaxViewCount);
+	instanceOrigin_ = GetInstanceOrigin(*params_, cameraPosition);
+	packedData_.resize(instances.size());
+	for (size_t i = 0; i < instances.size(); ++i)
+		packedData_[i] = PackInstance(instances[i], instanceOrigin_, params_->unitSize);
+
+	glNamedBufferSubData(transformBuffer_->getHandle(), 0, sizeof(PackedTerrainData) * packedData_.size(), packedData_.data());
+	stats_.bytesUploaded += sizeof(PackedTerrainData) * packedData_.size();
+}
+
+/****************************************************************************************************************************************/
+
+void TerrainGeometry::assignRegions(Camera* camera)
+{
+	PROFILE_SCOPE("TerrainGeometry::assignRegions");
 
 	const auto frustum = camera->getFrustum();
-	DrawElementsIndirectCommand* commands = mesh_->commands;
-	for (auto& transform : transformData_)
+	regionData_.clear();
+	for (const TerrainData& transform : transformData_)
 	{
+		BoundingBox box = getInstanceBounds(transform);
 
-		glm::mat4 transformMatrix = glm::translate(glm::mat4(1.0f), glm::vec3(transform.translate.x, 0.0f, transform.translate.y)) *
-			glm::rotate(glm::mat4(1.0f), transform.id.y, glm::vec3(0.0f, 1.0f, 0.0f)) *
-			glm::scale(glm::mat4(1.0f), glm::vec3(transform.scale.x, params_->maxHeight - params_->minHeight, transform.scale.y));
+		for (size_t i = 0; i < regions_.size(); ++i)
+		{
+			const TerrainRegion& region = regions_[i];
+			BoundingBox regionBox = {
+				glm::vec3(std::max(box.min_.x, region.min.x), region.minHeight, std::max(box.min_.z, region.min.y)),
+				glm::vec3(std::min(box.max_.x, region.max.x), region.maxHeight, std::min(box.max_.z, region.max.y))
+			};
+			if (regionBox.min_.x >= regionBox.max_.x || regionBox.min_.z >= regionBox.max_.z)
+				continue;
 
-		BoundingBox box_ = aabb.transform(transformMatrix);
-		GLDebugDraw::addAABB(box_.min_, box_.max_);
+			stats_.boundsTested++;
+			if (!frustum->intersect(regionBox))
+				continue;
 
-		if (currentId == transform.id.x)
+			TerrainData regionTransform = transform;
+			regionTransform.terrainIndex = static_cast<int>(i);
+			regionData_.push_back(regionTransform);
+		}
+	}
+
+	transformData_.swap(regionData_);
+}
+
+/****************************************************************************************************************************************/
+
+TerrainGeometry::PackedTerrainData TerrainGeometry::PackInstance(const TerrainData& instance, const glm::vec2& origin, float unitSize)
+{
+	int level = static_cast<int>(std::lround(std::log2(instance.scale.x)));
+	glm::vec2 tile = glm::round((instance.translate - origin) / (instance.scale.x * unitSize));
+	int quarterTurns = static_cast<int>(std::lround(instance.id.y / glm::radians(90.0f))) & 3;
+
+	assert(level >= 0 && level < 16);
+	assert(instance.terrainIndex >= 0 && instance.terrainIndex < kMaxTerrainCount);
+	assert(tile.x >= INT16_MIN && tile.x <= INT16_MAX && tile.y >= INT16_MIN && tile.y <= INT16_MAX);
+
+	PackedTerrainData packed = {};
+	packed.position = static_cast<uint16_t>(static_cast<int16_t>(tile.x)) | (static_cast<uint32_t>(static_cast<uint16_t>(static_cast<int16_t>(tile.y))) << 16);
+	packed.attributes = static_cast<uint32_t>(level) | (static_cast<uint32_t>(instance.id.x) << 4) | (static_cast<uint32_t>(quarterTurns) << 7) |
+		(static_cast<uint32_t>(instance.terrainIndex) << 9);
+	return packed;
+}
+
+/****************************************************************************************************************************************/
+
+TerrainGeometry::TerrainData TerrainGeometry::UnpackInstance(const PackedTerrainData& packed, const glm::vec2& origin, float unitSize)
+{
+	glm::vec2 tile = glm::vec2(static_cast<int16_t>(packed.position & 0xffff), static_cast<int16_t>(packed.position >> 16));
+	float scale = static_cast<float>(1 << (packed.attributes & 0xf));
+	float meshId = static_cast<float>((packed.attributes >> 4) & 0x7);
+	float rotation = static_cast<float>((packed.attributes >> 7) & 0x3) * glm::radians(90.0f);
+
+	int terrainIndex = static_cast<int>((packed.attributes >> 9) & 0x3f);
+
+	return TerrainData{ origin + tile * scale * unitSize, glm::vec2(scale), glm::vec2(meshId, rotation), terrainIndex };
+}
+
+/****************************************************************************************************************************************/
+
+glm::vec2 TerrainGeometry::GetInstanceOrigin(const TerrainParams& params, const glm::vec3& cameraPosition)
+{
+	float coarsestTile = static_cast<float>(1 << (params.maxClipLevelCount - 1)) * params.unitSize;
+	return glm::floor(glm::vec2(cameraPosition.x, cameraPosition.z) / coarsestTile) * coarsestTile;
+}
+
+/****************************************************************************************************************************************/
+
+BoundingBox TerrainGeometry::getInstanceBounds(const TerrainData& transform)
+{
+	// Turned like rot() in main.vert, x towards z, which glm::rotate about +y turns the other way
+	int quarterTurns = GetQuarterTurns(transform.id.y);
+	glm::mat4 rotation = glm::mat4(1.0f);
+	rotation[0] = glm::vec4(kCos[quarterTurns], 0.0f, kSin[quarterTurns], 0.0f);
+	rotation[2] = glm::vec4(-kSin[quarterTurns], 0.0f, kCos[quarterTurns], 0.0f);
+
+	glm::mat4 transformMatrix = glm::translate(glm::mat4(1.0f), glm::vec3(transform.translate.x, 0.0f, transform.translate.y)) *
+		rotation *
+		glm::scale(glm::mat4(1.0f), glm::vec3(transform.scale.x, params_->maxHeight - params_->minHeight, transform.scale.y));
+
+	return footprintBounds_[int(transform.id.x)].transform(transformMatrix);
+}
+
+/****************************************************************************************************************************************/
+
+bool TerrainGeometry::testInstance(Frustum* frustum, TerrainData& transform, bool drawVisibleBounds)
+{
+	BoundingBox box = getInstanceBounds(transform);
+	stats_.boundsTested++;
+
+	if (frustum->intersect(box))
+	{
+		if (drawVisibleBounds)
+			GLDebugDraw::addAABB(box.min_, box.max_, DebugCategory::Visible);
+		return true;
+	}
+
+	transform.id = glm::vec2(-1.0f);
+	stats_.instancesCulled++;
+	return false;
+}
+
+/****************************************************************************************************************************************/
+
+void TerrainGeometry::cullInstances(Camera* camera)
+{
+	PROFILE_SCOPE("TerrainGeometry::cullInstances");
+
+	const uint32_t debugMask = GLDebugDraw::getFrameMask();
+	const bool drawInstanceBounds = (debugMask & GLDebugDraw::GetCategoryBit(DebugCategory::Instances)) != 0;
+	const bool drawVisibleBounds = (debugMask & GLDebugDraw::GetCategoryBit(DebugCategory::Visible)) != 0;
+
+	if (drawInstanceBounds)
+	{
+		for (const TerrainData& transform : transformData_)
+		{
+			BoundingBox box = getInstanceBounds(transform);
+			GLDebugDraw::addAABB(box.min_, box.max_, DebugCategory::Instances);
+		}
+	}
+
+	// Quadtree nodes were culled with tighter bounds while they were selected
+	if (params_->renderMode == TerrainRenderMode::Quadtree)
+		return;
+
+	const auto frustum = camera->getFrustum();
+	if (!params_->hierarchicalCulling)
+	{
+		for (TerrainData& transform : transformData_)
+			testInstance(frustum.get(), transform, drawVisibleBounds);
+		return;
+	}
+
+	// GenerateLocations writes the blocks level by level. Each ring and then each of
+	// its quadrants is tested first, blocks are only visited one by one in the
+	// quadrants crossing the frustum. L-Trims lie past the ring and span two sides,
+	// they are always tested on their own
+	glm::vec2 cameraPosition = glm::vec2(camera->getPosition().x, camera->getPosition().z);
+	float heightRange = params_->maxHeight - params_->minHeight;
+
+	size_t begin = 0;
+	while (begin < transformData_.size())
+	{
+		float scale = transformData_[begin].scale.x;
+		size_t end = begin;
+		while (end < transformData_.size() && transformData_[end].scale.x == scale)
+			end++;
+
+		float tileSize = scale * params_->unitSize;
+		float gridSize = (m_ - 1) * tileSize;
+		glm::vec2 offset = glm::floor(cameraPosition / tileSize) * tileSize;
+		glm::vec2 ringMin = offset - gridSize * 2.0f;
+		glm::vec2 ringMax = offset + gridSize * 2.0f + tileSize;
+
+		Frustum::Containment ringTest = frustum->classify(BoundingBox{ glm::vec3(ringMin.x, 0.0f, ringMin.y), glm::vec3(ringMax.x, heightRange, ringMax.y) });
+		stats_.boundsTested++;
+
+		// Quadrants split at the offset, the center strips start there and belong to the far side
+		Frustum::Containment quadrantTests[4];
+		for (int i = 0; i < 4; ++i)
 		{
-			if (frustum->intersect(box_) || transform.id.x == 4.0f)
+			if (ringTest != Frustum::Containment::Intersect)
 			{
-				GLDebugDraw::addAABB(box_.min_, box_.max_);
-				totalInstance++;
+				quadrantTests[i] = ringTest;
+				continue;
 			}
-			else
-				transform.id = glm::vec2(-1.0f);
+
+			glm::vec2 quadrantMin = glm::vec2((i & 1) ? offset.x : ringMin.x, (i & 2) ? offset.y : ringMin.y);
+			glm::vec2 quadrantMax = glm::vec2((i & 1) ? ringMax.x : offset.x, (i & 2) ? ringMax.y : offset.y);
+			quadrantTests[i] = frustum->classify(BoundingBox{ glm::vec3(quadrantMin.x, 0.0f, quadrantMin.y), glm::vec3(quadrantMax.x, heightRange, quadrantMax.y) });
+			stats_.boundsTested++;
 		}
-		else
+
+		for (size_t i = begin; i < end; ++i)
 		{
-			commands[int(currentId)].instanceCount_ = totalInstance;
-			currentId = transform.id.x;
-			aabb = mesh_->boundingBoxes_[int(currentId)];
-			totalInstance = 1;
+			TerrainData& transform = transformData_[i];
+			int meshId = int(transform.id.x);
+			if (meshId == 4)
+			{
+				testInstance(frustum.get(), transform, drawVisibleBounds);
+				continue;
+			}
+
+			glm::ivec2 dimension = GetFootprintDimension(meshId, m_, footprintVertexCount_);
+			glm::vec2 blockCenter = transform.translate + glm::vec2(dimension - 1) * tileSize * 0.5f;
+			int quadrant = (blockCenter.x > offset.x ? 1 : 0) | (blockCenter.y > offset.y ? 2 : 0);
+
+			if (quadrantTests[quadrant] == Frustum::Containment::Outside)
+			{
+				transform.id = glm::vec2(-1.0f);
+				stats_.instancesCulled++;
+			}
+			else if (quadrantTests[quadrant] == Frustum::Containment::Intersect)
+				testInstance(frustum.get(), transform, drawVisibleBounds);
+			else if (drawVisibleBounds)
+			{
+				BoundingBox box = getInstanceBounds(transform);
+				GLDebugDraw::addAABB(box.min_, box.max_, DebugCategory::Visible);
+			}
 		}
+
+		begin = end;
 	}
+}
 
-	transformData_.erase(std::remove_if(
-		transformData_.begin(), transformData_.end(),
-		[](const TerrainData& data) {
-			return data.id.x < 0.0f;
-		}), transformData_.end());
+/****************************************************************************************************************************************/
 
-	commands[int(currentId)].instanceCount_ = totalInstance;
-	glNamedBufferSubData(transformBuffer_->getHandle(), 0, sizeof(TerrainData) * transformData_.size(), transformData_.data());
+void TerrainGeometry::cullViews(Camera* camera)
+{
+	PROFILE_SCOPE("TerrainGeometry::cullViews");
+
+	const int viewCount = static_cast<int>(viewFrusta_.size());
+	const uint32_t allViews = viewCount == 32 ? ~0u : (1u << viewCount) - 1;
+
+	// Each level is tested once per view as a whole, blocks of a level that is
+	// entirely inside or outside of a view skip their test for that view. The
+	// bounds of a block are built once for all the views it is still tested in
+	glm::vec2 cameraPosition = glm::vec2(camera->getPosition().x, camera->getPosition().z);
+	float heightRange = params_->maxHeight - params_->minHeight;
+	bool testLevels = params_->hierarchicalCulling && params_->renderMode != TerrainRenderMode::Quadtree;
+
+	visibilityMasks_.resize(transformData_.size());
+	size_t begin = 0;
+	while (begin < transformData_.size())
+	{
+		float scale = transformData_[begin].scale.x;
+		size_t end = begin;
+		while (end < transformData_.size() && transformData_[end].scale.x == scale)
+			end++;
+
+		uint32_t insideMask = 0;
+		uint32_t testMask = allViews;
+		if (testLevels)
+		{
+			float tileSize = scale * params_->unitSize;
+			float gridSize = (m_ - 1) * tileSize;
+			glm::vec2 offset = glm::floor(cameraPosition / tileSize) * tileSize;
+			glm::vec2 ringMin = offset - gridSize * 2.0f;
+			glm::vec2 ringMax = offset + gridSize * 2.0f + tileSize;
+			BoundingBox ring = { glm::vec3(ringMin.x, 0.0f, ringMin.y), glm::vec3(ringMax.x, heightRange, ringMax.y) };
+
+			testMask = 0;
+			for (int view = 0; view < viewCount; ++view)
+			{
+				Frustum::Containment test = viewFrusta_[view].classify(ring);
+				if (test == Frustum::Containment::Inside)
+					insideMask |= 1u << view;
+				else if (test == Frustum::Containment::Intersect)
+					testMask |= 1u << view;
+			}
+			stats_.boundsTested += viewCount;
+		}
+
+		for (size_t i = begin; i < end; ++i)
+		{
+			TerrainData& transform = transformData_[i];
+
+			// L-Trims lie past the ring, they are tested in every view
+			bool lTrim = transform.id.x == 4.0f;
+			uint32_t mask = lTrim ? 0 : insideMask;
+			uint32_t blockTestMask = lTrim ? allViews : testMask;
+			if (blockTestMask != 0)
+			{
+				// Quadtree nodes get the tight bounds they are selected with
+				BoundingBox box = params_->renderMode == TerrainRenderMode::Quadtree ?
+					GetQuadtreeNodeBounds(*params_, transform.translate, transform.scale.x, heightfield_, heightfieldWorldSize_) :
+					getInstanceBounds(transform);
+				for (int view = 0; view < viewCount; ++view)
+				{
+					if ((blockTestMask & (1u << view)) == 0)
+						continue;
+
+					stats_.boundsTested++;
+					if (viewFrusta_[view].intersect(box))
+						mask |= 1u << view;
+				}
+			}
+
+			visibilityMasks_[i] = mask;
+			if (mask == 0)
+				stats_.instancesCulled++;
+		}
+
+		begin = end;
+	}
 }
 
 /****************************************************************************************************************************************/
 
-void TerrainGeometry::generateLocationFor(int clipLevel, const glm::vec3& cameraPosition)
+void TerrainGeometry::GenerateLocationFor(const TerrainParams& params, int clipLevel, bool finest, const glm::vec3& cameraPosition,
+	std::vector<TerrainData>& instances)
 {
+	int m = (params.vertexCount + 1) / 4;
 	glm::vec2 scale = glm::vec2((float)(1 << clipLevel));
-	float unitSize = params_->unitSize;
-	float gridSize = scale.x * unitSize * (m_ - 1);
+	float unitSize = params.unitSize;
+	float gridSize = scale.x * unitSize * (m - 1);
 	float tileSize = scale.x * unitSize;
 
 	glm::vec2 offset = glm::floor(glm::vec2(cameraPosition.x, cameraPosition.z) / tileSize) * tileSize;
@@ -159,12 +949,12 @@ void TerrainGeometry::generateLocationFor(int clipLevel, const glm::vec3& camera
 			if (x == 2)
 				startPos.x += tileSize;
 
-			if (clipLevel == 0)
-				transformData_.push_back(TerrainData{ startPos, scale, glm::vec2(0.0f, 0.0f) });
+			if (finest)
+				instances.push_back(TerrainData{ startPos, scale, glm::vec2(0.0f, 0.0f) });
 			else 
 			{
 				if ((y == 0 || y == 3) || ((y == 1 || y == 2) && (x == 0 || x == 3)))
-					transformData_.push_back(TerrainData{ startPos, scale, glm::vec2(0.0f) });
+					instances.push_back(TerrainData{ startPos, scale, glm::vec2(0.0f) });
 			}
 
 			startPos.x += gridSize;
@@ -175,25 +965,25 @@ void TerrainGeometry::generateLocationFor(int clipLevel, const glm::vec3& camera
 	}
 
 	// Generate CrossHair Y-Direction
-	transformData_.push_back(TerrainData{ glm::vec2(0.0f, tl.y) + offset, scale, glm::vec2(3.0f, 0.0f) });
-	transformData_.push_back(TerrainData{ glm::vec2(offset.x, startPos.y - gridSize), scale, glm::vec2(3.0f, 0.0f) });
+	instances.push_back(TerrainData{ glm::vec2(0.0f, tl.y) + offset, scale, glm::vec2(3.0f, 0.0f) });
+	instances.push_back(TerrainData{ glm::vec2(offset.x, startPos.y - gridSize), scale, glm::vec2(3.0f, 0.0f) });
 
 	// Generate CrossHair X-Direction
-	transformData_.push_back(TerrainData{ glm::vec2(tl.x, 0.0f) + offset, scale, glm::vec2(1.0f, 0.0f) });
-	transformData_.push_back(TerrainData{ glm::vec2(gridSize + tileSize, 0.0f) + offset, scale, glm::vec2(1.0f, 0.0f) });
+	instances.push_back(TerrainData{ glm::vec2(tl.x, 0.0f) + offset, scale, glm::vec2(1.0f, 0.0f) });
+	instances.push_back(TerrainData{ glm::vec2(gridSize + tileSize, 0.0f) + offset, scale, glm::vec2(1.0f, 0.0f) });
 
-	if (clipLevel == 0)
+	if (finest)
 	{
 		// Generate CrossHair X-Direction
-		transformData_.push_back(TerrainData{ glm::vec2(tl.x + gridSize, 0.0f) + offset, scale, glm::vec2(1.0f, 0.0f) });
-		transformData_.push_back(TerrainData{ offset, scale, glm::vec2(2.0f, 0.0f) });
+		instances.push_back(TerrainData{ glm::vec2(tl.x + gridSize, 0.0f) + offset, scale, glm::vec2(1.0f, 0.0f) });
+		instances.push_back(TerrainData{ offset, scale, glm::vec2(2.0f, 0.0f) });
 
 		// Generate CrossHair Y-Direction
-		transformData_.push_back(TerrainData{ glm::vec2(0.0f, tl.y + gridSize) + offset, scale, glm::vec2(3.0f, 0.0f) });
-		transformData_.push_back(TerrainData{ glm::vec2(0.0f, tileSize) + offset, scale, glm::vec2(3.0f, 0.0f) });
+		instances.push_back(TerrainData{ glm::vec2(0.0f, tl.y + gridSize) + offset, scale, glm::vec2(3.0f, 0.0f) });
+		instances.push_back(TerrainData{ glm::vec2(0.0f, tileSize) + offset, scale, glm::vec2(3.0f, 0.0f) });
 	}
 
-	if (clipLevel == params_->maxClipLevelCount - 1)
+	if (clipLevel == params.maxClipLevelCount - 1)
 		return;
 
 	float nextTileSize = 2.0f * tileSize;
@@ -227,7 +1017,7 @@ void TerrainGeometry::generateLocationFor(int clipLevel, const glm::vec3& camera
 		rotate = glm::radians(-90.0f);
 	}
 
-	transformData_.push_back(TerrainData{ translate + offset, scale, glm::vec2(4.0f, rotate) });
+	instances.push_back(TerrainData{ translate + offset, scale, glm::vec2(4.0f, rotate) });
 }
 
 /****************************************************************************************************************************************/
@@ -0,0 +1,221 @@
+#include "terrain/terrain_material.h"
+#include "image_utils.h"
+#include "ogl.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <assert.h>
+
+/*****************************************************************************************************************************************/
+
+static const char* kNoiseTexture = "Assets/Textures/noiseTexture.png";
+
+// Used when the noise texture is missing
+static const int kFallbackLayerSize = 256;
+
+// Same layout as MaterialRules in main.frag (std140)
+struct MaterialRuleData
+{
+	// min, max, blend, tiling
+	glm::vec4 height;
+	// min, max, blend, unused
+	glm::vec4 slope;
+	glm::vec4 tint;
+};
+
+struct MaterialRuleBlock
+{
+	int layerCount[4];
+	MaterialRuleData rules[TerrainMaterial::kMaxLayerCount];
+};
+
+/*****************************************************************************************************************************************/
+
+static void ConvertToRGBA(const unsigned char* data, const ImageHeader& header, std::vector<uint8_t>& pixels)
+{
+	pixels.resize(header.width * header.height * 4);
+	for (int i = 0; i < header.width * header.height; ++i)
+	{
+		const unsigned char* src = data + i * header.nChannel;
+		uint8_t* dst = &pixels[i * 4];
+		if (header.nChannel >= 3)
+		{
+			dst[0] = src[0];
+			dst[1] = src[1];
+			dst[2] = src[2];
+		}
+		else
+			dst[0] = dst[1] = dst[2] = src[0];
+		dst[3] = header.nChannel == 4 ? src[3] : (header.nChannel == 2 ? src[1] : 255);
+	}
+}
+
+/*****************************************************************************************************************************************/
+
+TerrainMaterial::TerrainMaterial(const std::vector<MaterialLayer>& layers) :
+	layerCount_(std::min(static_cast<int>(layers.size()), kMaxLayerCount))
+{
+	assert(layerCount_ > 0);
+	if (static_cast<int>(layers.size()) > kMaxLayerCount)
+		fprintf(stderr, "Terrain material has %d layers, only the first %d are used\n", static_cast<int>(layers.size()), kMaxLayerCount);
+
+	// Every layer shares the size of the noise texture
+	std::vector<uint8_t> noise;
+	int width = kFallbackLayerSize;
+	int height = kFallbackLayerSize;
+	{
+		ImageHeader header = {};
+		unsigned char* data = ImageUtils::LoadImage(kNoiseTexture, header);
+		if (data)
+		{
+			width = header.width;
+			height = header.height;
+			ConvertToRGBA(data, header, noise);
+			ImageUtils::FreeImage(data);
+		}
+		else
+		{
+			noise.resize(width * height * 4);
+			uint32_t state = 0x12345678u;
+			for (uint8_t& value : noise)
+			{
+				state = state * 1664525u + 1013904223u;
+				value = static_cast<uint8_t>(state >> 24);
+			}
+		}
+	}
+
+	TextureParams params = {};
+	params.width = width;
+	params.height = height;
+	params.depth = layerCount_;
+	params.type = TextureType::Texture2DArray;
+	params.format = TextureFormat::RGBA8;
+	params.minFilter = TextureFilter::LinearMipmap;
+	albedoArray_ = std::make_shared<GLTexture>(nullptr, params);
+	normalArray_ = std::make_shared<GLTexture>(nullptr, params);
+
+	MaterialRuleBlock ruleBlock = {};
+	ruleBlock.layerCount[0] = layerCount_;
+
+	std::vector<uint8_t> albedo;
+	std::vector<uint8_t> normal;
+	for (int i = 0; i < layerCount_; ++i)
+	{
+		const MaterialLayer& layer = layers[i];
+
+		if (layer.albedoFile.empty() || !LoadLayerImage(layer.albedoFile, width, height, albedo))
+			GenerateAlbedo(noise, i % 4, albedo);
+		if (layer.normalFile.empty() || !LoadLayerImage(layer.normalFile, width, height, normal))
+			GenerateNormal(albedo, width, height, normal);
+
+		albedoArray_->setLayer(i, albedo.data());
+		normalArray_->setLayer(i, normal.data());
+
+		ruleBlock.rules[i].height = glm::vec4(layer.minHeight, layer.maxHeight, layer.blend, layer.tiling);
+		ruleBlock.rules[i].slope = glm::vec4(layer.minSlope, layer.maxSlope, layer.blend, 0.0f);
+		ruleBlock.rules[i].tint = glm::vec4(layer.tint, 1.0f);
+	}
+
+	albedoArray_->generateMipmaps();
+	normalArray_->generateMipmaps();
+
+	ruleBuffer_ = std::make_shared<GLBuffer>(&ruleBlock, static_cast<uint32_t>(sizeof(MaterialRuleBlock)), 0);
+}
+
+/*****************************************************************************************************************************************/
+
+std::vector<MaterialLayer> TerrainMaterial::DefaultLayers()
+{
+	// Later layers are painted over the earlier ones by their weight, the first
+	// one is the base. Colors follow the previous constant grass and rock shading
+	return {
+		// Grass
+		MaterialLayer{ "", "", glm::vec3(0.01f, 0.5f, 0.01f), 8.0f, 0.0f, 1.0f, 0.0f, 1.0f, 0.1f },
+		// Rock on steep slopes
+		MaterialLayer{ "", "", glm::vec3(0.97f, 0.66f, 0.37f), 16.0f, 0.0f, 1.0f, 0.2f, 1.0f, 0.1f },
+		// Sand on flat ground close to the lowest height
+		MaterialLayer{ "", "", glm::vec3(0.76f, 0.70f, 0.50f), 4.0f, 0.0f, 0.02f, 0.0f, 0.15f, 0.01f },
+	};
+}
+
+/*****************************************************************************************************************************************/
+
+unsigned int TerrainMaterial::getRuleBuffer() const
+{
+	return ruleBuffer_->getHandle();
+}
+
+/*****************************************************************************************************************************************/
+
+bool TerrainMaterial::LoadLayerImage(const std::string& filename, int width, int height, std::vector<uint8_t>& pixels)
+{
+	ImageHeader header = {};
+	unsigned char* data = ImageUtils::LoadImage(filename.c_str(), header);
+	if (data == nullptr)
+		return false;
+
+	bool valid = header.width == width && header.height == height;
+	if (valid)
+		ConvertToRGBA(data, header, pixels);
+	else
+		fprintf(stderr, "Material layer %s is %dx%d, expected %dx%d\n", filename.c_str(), header.width, header.height, width, height);
+
+	ImageUtils::FreeImage(data);
+	return valid;
+}
+
+/*****************************************************************************************************************************************/
+
+void TerrainMaterial::GenerateAlbedo(const std::vector<uint8_t>& noise, int channel, std::vector<uint8_t>& pixels)
+{
+	// Grey detail around 0.5, main.frag scales it by twice the layer tint
+	pixels.resize(noise.size());
+	for (size_t i = 0; i < noise.size(); i += 4)
+	{
+		uint8_t value = static_cast<uint8_t>(90 + noise[i + channel] * 75 / 255);
+		pixels[i + 0] = pixels[i + 1] = pixels[i + 2] = value;
+		pixels[i + 3] = 255;
+	}
+}
+
+/*****************************************************************************************************************************************/
+
+void TerrainMaterial::GenerateNormal(const std::vector<uint8_t>& albedo, int width, int height, std::vector<uint8_t>& pixels)
+{
+	// Treat the albedo luminance as a bump map, tangent space with z up
+	const float strength = 4.0f;
+
+	auto luminance = [&](int x, int y) {
+		x = (x + width) % width;
+		y = (y + height) % height;
+		const uint8_t* p = &albedo[(y * width + x) * 4];
+		return (0.299f * p[0] + 0.587f * p[1] + 0.114f * p[2]) / 255.0f;
+	};
+
+	pixels.resize(width * height * 4);
+	for (int y = 0; y < height; ++y)
+	{
+		for (int x = 0; x < width; ++x)
+		{
+			float dx = luminance(x + 1, y) - luminance(x - 1, y);
+			float dy = luminance(x, y + 1) - luminance(x, y - 1);
+			glm::vec3 n = glm::normalize(glm::vec3(-dx * strength, -dy * strength, 1.0f));
+
+			uint8_t* dst = &pixels[(y * width + x) * 4];
+			dst[0] = static_cast<uint8_t>((n.x * 0.5f + 0.5f) * 255.0f);
+			dst[1] = static_cast<uint8_t>((n.y * 0.5f + 0.5f) * 255.0f);
+			dst[2] = static_cast<uint8_t>((n.z * 0.5f + 0.5f) * 255.0f);
+			dst[3] = 255;
+		}
+	}
+}
+
+/*****************************************************************************************************************************************/
+
+TerrainMaterial::~TerrainMaterial()
+{
+}
+
+/*****************************************************************************************************************************************/
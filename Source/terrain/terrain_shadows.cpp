@@ -0,0 +1,203 @@
+#include "terrain/terrain_shadows.h"
+#include "camera.h"
+#include "ogl.h"
+
+#include <cstdio>
+
+/*****************************************************************************************************************************************/
+
+// A cascade moves in steps of 1/kSnapDivisions of its extent, a whole number of texels
+static const float kSnapDivisions = 8.0f;
+
+// Depth range of a cascade on each side of its origin, beyond its extent so that
+// casters towards the sun are kept whatever the height of the terrain
+static const float kDepthMargin = 2000.0f;
+
+/*****************************************************************************************************************************************/
+
+TerrainShadows::TerrainShadows(int resolution, float nearestExtent) :
+	resolution_(resolution),
+	lightDirection_(glm::normalize(glm::vec3(0.0f, 1.0f, -1.0f)))
+{
+	for (int i = 0; i < kCascadeCount; ++i)
+		cascades_[i].extent = nearestExtent * static_cast<float>(1 << (2 * i));
+
+	// Hardware compared, sampled as sampler2DArrayShadow with bilinear PCF
+	glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &depthArray_);
+	glTextureParameteri(depthArray_, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTextureParameteri(depthArray_, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTextureParameteri(depthArray_, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTextureParameteri(depthArray_, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTextureParameteri(depthArray_, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+	glTextureParameteri(depthArray_, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+	glTextureStorage3D(depthArray_, 1, GL_DEPTH_COMPONENT32F, resolution, resolution, kCascadeCount);
+
+	glCreateFramebuffers(kCascadeCount, framebuffers_);
+	for (int i = 0; i < kCascadeCount; ++i)
+	{
+		glNamedFramebufferTextureLayer(framebuffers_[i], GL_DEPTH_ATTACHMENT, depthArray_, 0, i);
+		glNamedFramebufferDrawBuffer(framebuffers_[i], GL_NONE);
+
+		GLenum status = glCheckNamedFramebufferStatus(framebuffers_[i], GL_FRAMEBUFFER);
+		if (status != GL_FRAMEBUFFER_COMPLETE)
+		{
+			printf("Incomplete shadow framebuffer: 0x%x\n", status);
+			assert(0);
+		}
+	}
+
+	shadowDataBuffer_ = std::make_shared<GLBuffer>(nullptr, static_cast<uint32_t>(sizeof(ShadowData)), GL_DYNAMIC_STORAGE_BIT);
+}
+
+/*****************************************************************************************************************************************/
+
+void TerrainShadows::setLightDirection(const glm::vec3& direction)
+{
+	glm::vec3 lightDirection = glm::normalize(direction);
+	if (lightDirection == lightDirection_)
+		return;
+
+	lightDirection_ = lightDirection;
+	for (Cascade& cascade : cascades_)
+		cascade.stale = true;
+}
+
+/*****************************************************************************************************************************************/
+
+const std::vector<int>& TerrainShadows::update(Camera* camera)
+{
+	frame_++;
+	drawList_.clear();
+
+	glm::vec3 cameraPosition = glm::transpose(getLightBasis()) * camera->getPosition();
+
+	int oldestStale = -1;
+	glm::vec2 origins[kCascadeCount];
+	float depthOrigins[kCascadeCount];
+	for (int i = 0; i < kCascadeCount; ++i)
+	{
+		Cascade& cascade = cascades_[i];
+		float snapSize = cascade.extent / kSnapDivisions;
+		origins[i] = glm::floor(glm::vec2(cameraPosition) / snapSize) * snapSize;
+		depthOrigins[i] = std::floor(cameraPosition.z / snapSize) * snapSize;
+
+		if (i == 0 || !cascade.valid)
+		{
+			updateCascade(cascade, origins[i], depthOrigins[i]);
+			drawList_.push_back(i);
+			continue;
+		}
+
+		if (origins[i] != cascade.origin || depthOrigins[i] != cascade.depthOrigin)
+			cascade.stale = true;
+		if (cascade.stale && (oldestStale < 0 || cascade.drawnFrame < cascades_[oldestStale].drawnFrame))
+			oldestStale = i;
+	}
+
+	if (oldestStale >= 0)
+	{
+		updateCascade(cascades_[oldestStale], origins[oldestStale], depthOrigins[oldestStale]);
+		drawList_.push_back(oldestStale);
+	}
+
+	ShadowData data = {};
+	for (int i = 0; i < kCascadeCount; ++i)
+	{
+		data.viewProjections[i] = cascades_[i].viewProjection;
+		data.texelSizes[i] = cascades_[i].extent / resolution_;
+	}
+	data.lightDirection = glm::vec4(lightDirection_, 0.0f);
+	glNamedBufferSubData(shadowDataBuffer_->getHandle(), 0, sizeof(ShadowData), &data);
+
+	return drawList_;
+}
+
+/*****************************************************************************************************************************************/
+
+void TerrainShadows::updateCascade(Cascade& cascade, const glm::vec2& origin, float depthOrigin)
+{
+	cascade.origin = origin;
+	cascade.depthOrigin = depthOrigin;
+	cascade.valid = true;
+	cascade.stale = false;
+	cascade.drawnFrame = frame_;
+
+	// Light space with its origin at the cascade center and the near plane towards the sun
+	float halfExtent = cascade.extent * 0.5f;
+	float halfDepth = cascade.extent * 2.0f + kDepthMargin;
+	glm::mat4 view = glm::translate(glm::mat4(1.0f), -glm::vec3(origin, depthOrigin + halfDepth)) * glm::mat4(glm::transpose(getLightBasis()));
+	cascade.viewProjection = glm::ortho(-halfExtent, halfExtent, -halfExtent, halfExtent, 0.0f, halfDepth * 2.0f) * view;
+}
+
+/*****************************************************************************************************************************************/
+
+glm::mat3 TerrainShadows::getLightBasis() const
+{
+	glm::vec3 up = std::abs(lightDirection_.y) > 0.999f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+	glm::vec3 x = glm::normalize(glm::cross(up, lightDirection_));
+	glm::vec3 y = glm::cross(lightDirection_, x);
+	return glm::mat3(x, y, lightDirection_);
+}
+
+/*****************************************************************************************************************************************/
+
+void TerrainShadows::beginCascade(int cascade)
+{
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &savedFramebuffer_);
+	glGetIntegerv(GL_VIEWPORT, savedViewport_);
+	glGetIntegerv(GL_POLYGON_MODE, savedPolygonMode_);
+	savedCullFace_ = glIsEnabled(GL_CULL_FACE) == GL_TRUE;
+	glGetIntegerv(GL_CULL_FACE_MODE, &savedCullFaceMode_);
+	savedPolygonOffset_ = glIsEnabled(GL_POLYGON_OFFSET_FILL) == GL_TRUE;
+	glGetFloatv(GL_POLYGON_OFFSET_FACTOR, &savedPolygonOffsetFactor_);
+	glGetFloatv(GL_POLYGON_OFFSET_UNITS, &savedPolygonOffsetUnits_);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffers_[cascade]);
+	glViewport(0, 0, resolution_, resolution_);
+	glClear(GL_DEPTH_BUFFER_BIT);
+
+	// Both sides cast, slopes facing away from the sun would otherwise leak light
+	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+	glDisable(GL_CULL_FACE);
+	glEnable(GL_POLYGON_OFFSET_FILL);
+	glPolygonOffset(2.0f, 4.0f);
+
+	renderedCascadeCount_++;
+}
+
+/*****************************************************************************************************************************************/
+
+void TerrainShadows::endCascade()
+{
+	if (savedPolygonOffset_)
+		glEnable(GL_POLYGON_OFFSET_FILL);
+	else
+		glDisable(GL_POLYGON_OFFSET_FILL);
+	glPolygonOffset(savedPolygonOffsetFactor_, savedPolygonOffsetUnits_);
+	if (savedCullFace_)
+		glEnable(GL_CULL_FACE);
+	else
+		glDisable(GL_CULL_FACE);
+	glCullFace(savedCullFaceMode_);
+	glPolygonMode(GL_FRONT_AND_BACK, savedPolygonMode_[0]);
+	glViewport(savedViewport_[0], savedViewport_[1], savedViewport_[2], savedViewport_[3]);
+	glBindFramebuffer(GL_FRAMEBUFFER, savedFramebuffer_);
+}
+
+/*****************************************************************************************************************************************/
+
+void TerrainShadows::bind() const
+{
+	glBindBufferBase(GL_UNIFORM_BUFFER, 3, shadowDataBuffer_->getHandle());
+	glBindTextureUnit(6, depthArray_);
+}
+
+/*****************************************************************************************************************************************/
+
+TerrainShadows::~TerrainShadows()
+{
+	glDeleteFramebuffers(kCascadeCount, framebuffers_);
+	glDeleteTextures(1, &depthArray_);
+}
+
+/*****************************************************************************************************************************************/
@@ -0,0 +1,40 @@
+#include "terrain/terrain_stats.h"
+
+#include <cstdio>
+
+/*****************************************************************************************************************************************/
+
+TerrainStatsRecorder::TerrainStatsRecorder(const char* filename) :
+	out_(filename)
+{
+	if (!out_)
+	{
+		fprintf(stderr, "Failed to open stats file: %s\n", filename);
+		return;
+	}
+
+	out_ << "frame,frameTimeMs,instancesGenerated,instancesCulled,drawCommands,bytesUploaded,triangles,primitivesGenerated,finestClipLevel,boundsTested";
+	for (int i = 0; i < TerrainStats::kMeshTypeCount; ++i)
+		out_ << ",trianglesMesh" << i;
+	for (int i = 0; i < TerrainStats::kMaxClipLevels; ++i)
+		out_ << ",instancesLevel" << i;
+	out_ << "\n";
+}
+
+/*****************************************************************************************************************************************/
+
+void TerrainStatsRecorder::record(uint64_t frame, float frameTime, const TerrainStats& stats)
+{
+	if (!out_)
+		return;
+
+	out_ << frame << "," << frameTime * 1000.0f << "," << stats.instancesGenerated << "," << stats.instancesCulled << ","
+		<< stats.drawCommandCount << "," << stats.bytesUploaded << "," << stats.getTotalTriangles() << "," << stats.primitivesGenerated << "," << stats.finestClipLevel << "," << stats.boundsTested;
+	for (int i = 0; i < TerrainStats::kMeshTypeCount; ++i)
+		out_ << "," << stats.trianglesPerMesh[i];
+	for (int i = 0; i < TerrainStats::kMaxClipLevels; ++i)
+		out_ << "," << stats.instancesPerLevel[i];
+	out_ << "\n";
+}
+
+/*****************************************************************************************************************************************/
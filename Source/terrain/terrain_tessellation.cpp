@@ -0,0 +1,63 @@
+#include "terrain/terrain_tessellation.h"
+#include "camera.h"
+#include "ogl.h"
+#include "profiler.h"
+
+/*****************************************************************************************************************************************/
+
+TerrainTessellation::TerrainTessellation(TerrainParams* params, const std::vector<std::string>& defines) :
+	params_(params)
+{
+	shader_ = std::make_shared<GLProgram>(GLShader("Assets/Shaders/tessellation.vert", defines),
+		GLShader("Assets/Shaders/tessellation.tesc", defines),
+		GLShader("Assets/Shaders/tessellation.tese", defines),
+		GLShader("Assets/Shaders/main.frag", defines));
+
+	glCreateVertexArrays(1, &vao_);
+}
+
+/*****************************************************************************************************************************************/
+
+void TerrainTessellation::update(Camera* camera, const glm::ivec2& viewportSize)
+{
+	PROFILE_SCOPE("TerrainTessellation::update");
+
+	// Snapped to whole patches so vertices never slide over the heightmap
+	glm::vec3 cameraPosition = camera->getPosition();
+	glm::vec2 cell = glm::floor(glm::vec2(cameraPosition.x, cameraPosition.z) / params_->patchSize);
+	patchOrigin_ = (cell - glm::vec2(static_cast<float>(params_->patchGridSize / 2))) * params_->patchSize;
+	viewportHeight_ = static_cast<float>(viewportSize.y);
+
+	uint32_t patchCount = static_cast<uint32_t>(params_->patchGridSize * params_->patchGridSize);
+	stats_.reset();
+	stats_.instancesGenerated = patchCount;
+	stats_.drawCommandCount = 1;
+}
+
+/*****************************************************************************************************************************************/
+
+void TerrainTessellation::draw(float textureDims)
+{
+	shader_->useProgram();
+	shader_->setFloat("u_TextureDims", textureDims);
+	shader_->setFloat("u_MaxHeight", params_->maxHeight);
+	shader_->setInt("u_FragmentDetail", params_->fragmentDetail);
+	shader_->setVec2("u_PatchOrigin", patchOrigin_.x, patchOrigin_.y);
+	shader_->setFloat("u_PatchSize", params_->patchSize);
+	shader_->setInt("u_PatchGridSize", params_->patchGridSize);
+	shader_->setFloat("u_TessellationPixels", params_->tessellationPixels);
+	shader_->setFloat("u_ViewportHeight", viewportHeight_);
+
+	glBindVertexArray(vao_);
+	glPatchParameteri(GL_PATCH_VERTICES, 4);
+	glDrawArrays(GL_PATCHES, 0, params_->patchGridSize * params_->patchGridSize * 4);
+}
+
+/*****************************************************************************************************************************************/
+
+TerrainTessellation::~TerrainTessellation()
+{
+	glDeleteVertexArrays(1, &vao_);
+}
+
+/*****************************************************************************************************************************************/
@@ -0,0 +1,193 @@
+#include "terrain/terrain_world.h"
+#include "terrain/terrain_geometry.h"
+#include "terrain/terrain_material.h"
+#include "terrain/heightfield.h"
+#include "ogl.h"
+#include "image_utils.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <cmath>
+#include <cstdio>
+
+/*****************************************************************************************************************************************/
+
+TerrainWorld::TerrainWorld(int vertexCount, float unitSize, const std::vector<TerrainDesc>& terrains, float terrainSize) :
+	terrainParams_{ vertexCount, unitSize, 12, 0.0f, 0.0f, 0.1f },
+	terrainSize_(terrainSize)
+{
+	// main.vert collapses morphed vertices on a grid from the world origin while the
+	// morph maps are indexed from the terrain center, both agree on every level only
+	// with the center on the grid of the coarsest level
+	float centerGrid = static_cast<float>(1 << (terrainParams_.maxClipLevelCount - 1)) * terrainParams_.unitSize;
+
+	// Heightmaps that fail to load are left out instead of leaving an empty layer
+	std::vector<std::shared_ptr<Heightfield>> heightfields;
+	for (TerrainDesc terrain : terrains)
+	{
+		glm::vec2 center = glm::round(terrain.center / centerGrid) * centerGrid;
+		if (center != terrain.center)
+		{
+			fprintf(stderr, "Terrain %s moved from (%g, %g) to (%g, %g), centers snap to multiples of %g\n", terrain.heightmapFile.c_str(),
+				terrain.center.x, terrain.center.y, center.x, center.y, centerGrid);
+			terrain.center = center;
+		}
+
+		auto heightfield = std::make_shared<Heightfield>();
+		if (!heightfield->load(terrain.heightmapFile.c_str()))
+		{
+			fprintf(stderr, "Skipping terrain %s\n", terrain.heightmapFile.c_str());
+			continue;
+		}
+
+		if (!heightfields.empty() && (heightfield->getWidth() != heightfields[0]->getWidth() || heightfield->getHeight() != heightfields[0]->getHeight()))
+			heightfield->resize(heightfields[0]->getWidth(), heightfields[0]->getHeight());
+		heightfield->buildMinMaxPyramid();
+
+		heightfields.push_back(heightfield);
+		terrains_.push_back(terrain);
+		if (static_cast<int>(terrains_.size()) == TerrainGeometry::kMaxTerrainCount)
+			break;
+	}
+
+	// Nothing to draw, update and draw skip the world
+	if (terrains_.empty())
+	{
+		fprintf(stderr, "No heightmap of the world loaded, it stays empty\n");
+		return;
+	}
+
+	int layerCount = static_cast<int>(terrains_.size());
+	for (const TerrainDesc& terrain : terrains_)
+		terrainParams_.maxHeight = std::max(terrainParams_.maxHeight, terrain.maxHeight);
+
+	terrainGeometry_ = std::make_shared<TerrainGeometry>(&terrainParams_);
+
+	// Every block is tested against the area and height range of each terrain
+	std::vector<TerrainGeometry::TerrainRegion> regions;
+	std::vector<TerrainInfo> terrainInfos;
+	for (int i = 0; i < layerCount; ++i)
+	{
+		const TerrainDesc& terrain = terrains_[i];
+		float minHeight = 0.0f;
+		float maxHeight = 1.0f;
+		heightfields[i]->getHeightRange(0.0f, 0.0f, static_cast<float>(heightfields[i]->getWidth()), static_cast<float>(heightfields[i]->getHeight()), minHeight, maxHeight);
+
+		regions.push_back(TerrainGeometry::TerrainRegion{
+			terrain.center - terrainSize_ * 0.5f, terrain.center + terrainSize_ * 0.5f,
+			minHeight * terrain.maxHeight, maxHeight * terrain.maxHeight });
+		terrainInfos.push_back(TerrainInfo{ terrain.center, terrainSize_, terrain.maxHeight });
+	}
+	terrainGeometry_->setRegions(regions);
+	terrainBuffer_ = std::make_shared<GLBuffer>(terrainInfos.data(), static_cast<uint32_t>(sizeof(TerrainInfo) * terrainInfos.size()), 0);
+
+	{
+		// Same bakes as Terrain, one layer per terrain
+		TextureParams params = {};
+		params.width = heightfields[0]->getWidth();
+		params.height = heightfields[0]->getHeight();
+		params.depth = layerCount;
+		params.type = TextureType::Texture2DArray;
+		params.format = TextureFormat::RG16_SNORM;
+		params.wrapS = params.wrapT = TextureWrap::ClampToEdge;
+		normalMaps_ = std::make_shared<GLTexture>(nullptr, params);
+
+		std::vector<int16_t> normals;
+		for (int i = 0; i < layerCount; ++i)
+		{
+			heightfields[i]->generateNormals(terrains_[i].maxHeight, terrainSize_ / params.width, normals);
+			normalMaps_->setLayer(i, normals.data());
+		}
+	}
+	{
+		TextureParams params = {};
+		params.width = params.height = static_cast<int>(terrainSize_ / terrainParams_.unitSize);
+		params.depth = layerCount;
+		params.type = TextureType::Texture2DArray;
+		params.format = TextureFormat::RG32F;
+		params.minFilter = TextureFilter::NearestMipmap;
+		params.magFilter = TextureFilter::Nearest;
+		morphMaps_ = std::make_shared<GLTexture>(nullptr, params);
+
+		int levelCount = static_cast<int>(std::log2(params.width)) + 1;
+		std::vector<std::vector<float>> levels;
+		for (int i = 0; i < layerCount; ++i)
+		{
+			heightfields[i]->generateMorphLevels(terrainSize_, terrainParams_.unitSize, levelCount, levels);
+			for (int level = 0; level < levelCount; ++level)
+				morphMaps_->setMipLevel(level, levels[level].data(), i);
+		}
+	}
+	{
+		ImageHeader header = {};
+		unsigned char* data = ImageUtils::LoadImage("Assets/Textures/gradient.png", header);
+		TextureParams params = {};
+		params.width = header.width;
+		params.height = header.height;
+		params.format = TextureFormat::RGB8;
+		params.wrapS = params.wrapT = TextureWrap::ClampToEdge;
+		gradientMap_ = std::make_shared<GLTexture>(data, params);
+		ImageUtils::FreeImage(data);
+	}
+
+	material_ = std::make_shared<TerrainMaterial>();
+
+	std::vector<std::string> defines = { "TERRAIN_WORLD" };
+	shader_ = std::make_shared<GLProgram>(GLShader("Assets/Shaders/main.vert", defines), GLShader("Assets/Shaders/main.frag", defines));
+}
+
+/*****************************************************************************************************************************************/
+
+void TerrainWorld::update(Camera* camera, const glm::ivec2& viewportSize, float dt)
+{
+	PROFILE_SCOPE("TerrainWorld::update");
+	if (terrains_.empty())
+		return;
+
+	terrainGeometry_->update(camera, viewportSize);
+	stats_ = terrainGeometry_->getStats();
+}
+
+/*****************************************************************************************************************************************/
+
+void TerrainWorld::draw()
+{
+	PROFILE_GPU_SCOPE("TerrainWorld::draw");
+	if (terrains_.empty())
+		return;
+
+	glBindBufferBase(GL_UNIFORM_BUFFER, 2, material_->getRuleBuffer());
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, terrainBuffer_->getHandle());
+
+	const GLuint textures[] = {
+		gradientMap_->getHandle(),
+		material_->getAlbedoArray()->getHandle(),
+		material_->getNormalArray()->getHandle(),
+		normalMaps_->getHandle(),
+		morphMaps_->getHandle(),
+	};
+	glBindTextures(1, 5, textures);
+
+	// main.vert clips the copies of a block to the area of their terrain
+	for (int i = 0; i < 4; ++i)
+		glEnable(GL_CLIP_DISTANCE0 + i);
+
+	shader_->useProgram();
+	shader_->setInt("u_VertexCount", terrainParams_.vertexCount);
+	shader_->setFloat("u_TransitionRegionWidth", terrainParams_.transitionRegionWidth);
+	shader_->setFloat("u_LodRange", TerrainGeometry::GetLodRange(terrainParams_));
+	shader_->setFloat("u_UnitSize", terrainParams_.unitSize);
+	shader_->setInt("u_VertexPulling", terrainParams_.vertexPulling ? 1 : 0);
+	shader_->setInt("u_FragmentDetail", terrainParams_.fragmentDetail);
+	shader_->setVec2("u_InstanceOrigin", terrainGeometry_->getInstanceOrigin().x, terrainGeometry_->getInstanceOrigin().y);
+
+	// Every terrain in one multi-draw
+	terrainGeometry_->draw();
+	stats_ = terrainGeometry_->getStats();
+
+	for (int i = 0; i < 4; ++i)
+		glDisable(GL_CLIP_DISTANCE0 + i);
+}
+
+/*****************************************************************************************************************************************/